@@ -0,0 +1,174 @@
+#include <NTL/ZZ.h>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../HomeServer/Server.h"
+
+#define INPUT_POOL 64
+#define MINIMUM_SECONDS 0.2
+
+using namespace std;
+using namespace NTL;
+
+// Times the protocol's arithmetic one kernel at a time:
+//   sign       OfficeServer::signBlindMessageUsingCRT (CRTContext::exponentiate)
+//   sign8      CRTContext::exponentiateLanes, MULTI_BUFFER_LANES messages
+//   decrypt    HomeServer::decryptMessageUsingCRT
+//   g, f       GFunction / FFunction::applyFunction
+//   verify     OfficeServer::verifyCorrectFunction, one opened index
+//   blind      OfficeClient::createBlindSignatures, all k messages
+//   product    HomeServer's findNewInformationAndProduct without the socket
+//              (Server::computeProduct), all k - k / 2 requests
+// The first six don't depend on k and are reported with k = 0.
+// Every kernel is timed with both arithmetics of PowerModKernel and
+// CRTContext: zz is NTL's, fixed is MontgomeryEngine (fixedWidthArithmetic);
+// sign8 is also timed as lanes, in MultiBufferEngine (multiBufferExponentiation).
+// Output is CSV: kernel,arithmetic,bits,k,repetitions,ns_per_call
+
+ZZ randomKey(long bits, ZZ& firstPrime, ZZ& secondPrime) {
+    // the same primes OfficeServer looks for: p != 1 (mod 3), so 3 is invertible
+    do {
+        firstPrime = GenPrime_ZZ(bits / 2);
+    } while((firstPrime - 1) % 3 == 0);
+    do {
+        secondPrime = GenPrime_ZZ(bits / 2);
+    } while(secondPrime == firstPrime || (secondPrime - 1) % 3 == 0);
+    ZZ publicKey;
+    publicKey = 3;
+    return InvMod(publicKey, (firstPrime - 1) * (secondPrime - 1));
+}
+
+bool verifyCorrectFunction(const ZZ& blindSignature, const ZZ& ID, const ZZ& a, const ZZ& c, const ZZ& d, const ZZ& r) {
+    ZZ op;
+    op = a ^ ID;
+    return PowerModKernel::blind(a, c, op, d, r, G_EXPONENT, F_EXPONENT, compositeNumber) == blindSignature;
+}
+
+ZZ blindMessage(const ZZ& ID, const ZZ& a, const ZZ& c, const ZZ& d, const ZZ& r) {
+    ZZ op;
+    op = a ^ ID;
+    return PowerModKernel::blind(a, c, op, d, r, G_EXPONENT, F_EXPONENT, compositeNumber);
+}
+
+// Signs the group of MULTI_BUFFER_LANES messages that holds message i.
+void signLanes(const ZZ* messages, ZZ* results, int i) {
+    int start = i - i % MULTI_BUFFER_LANES;
+    decryptionContext.exponentiateLanes(messages + start, results + start, MULTI_BUFFER_LANES);
+}
+
+// Calls kernel(i) with doubling repetitions until a run lasts long enough
+// to be measured, then prints one CSV row.
+void timeKernel(const char* name, long bits, int k, function<void(int)> kernel) {
+    kernel(0); // warm up allocations and caches
+    for(long repetitions = 1; ; repetitions *= 2) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(long i = 0; i < repetitions; ++i) {
+            kernel(i % INPUT_POOL);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if(seconds >= MINIMUM_SECONDS) {
+            printf("%s,%s,%ld,%d,%ld,%.0f\n", name, multiBufferExponentiation ? "lanes" : fixedWidthArithmetic ? "fixed" : "zz",
+                bits, k, repetitions, seconds * 1e9 / repetitions);
+            fflush(stdout);
+            return;
+        }
+    }
+}
+
+// Usage: cryptoBenchmark [bits...]
+// Without arguments every modulus size in 1024, 2048, 3072 and 4096 is timed.
+int main(int argc, char* argv[]) {
+    vector<long> moduliBits;
+    for(int i = 1; i < argc; ++i) {
+        moduliBits.push_back(atol(argv[i]));
+    }
+    if(moduliBits.empty()) {
+        moduliBits = {1024, 2048, 3072, 4096};
+    }
+    int securityConstants[] = {10, 100, 1000};
+
+    printf("kernel,arithmetic,bits,k,repetitions,ns_per_call\n");
+    for(size_t m = 0; m < moduliBits.size(); ++m) {
+        long bits = moduliBits[m];
+        privateKey = randomKey(bits, firstPrimeNumber, secondPrimeNumber);
+        compositeNumber = firstPrimeNumber * secondPrimeNumber;
+        decryptionContext.build(privateKey, firstPrimeNumber, secondPrimeNumber);
+        GFunction::configure(compositeNumber);
+        FFunction::configure(compositeNumber);
+
+        ZZ ID;
+        ID = 1950704070024L;
+        vector<ZZ> x(INPUT_POOL), y(INPUT_POOL), a(INPUT_POOL), c(INPUT_POOL), d(INPUT_POOL), r(INPUT_POOL);
+        vector<ZZ> signatures(INPUT_POOL), results(INPUT_POOL);
+        for(int i = 0; i < INPUT_POOL; ++i) {
+            x[i] = RandomBnd(compositeNumber);
+            y[i] = RandomBnd(compositeNumber);
+            a[i] = RandomBnd(compositeNumber);
+            c[i] = RandomBnd(compositeNumber);
+            d[i] = RandomBnd(compositeNumber);
+            r[i] = RandomBnd(compositeNumber);
+            signatures[i] = blindMessage(ID, a[i], c[i], d[i], r[i]);
+        }
+        for(int fixed = 0; fixed < 2; ++fixed) {
+            // the signatures were made with ZZ, the engine must agree with them
+            fixedWidthArithmetic = fixed;
+            if(!verifyCorrectFunction(signatures[0], ID, a[0], c[0], d[0], r[0])
+                || blindMessage(ID, a[1], c[1], d[1], r[1]) != signatures[1]
+                || PowerMod(Server::decryptMessageUsingCRT(x[0]), 3, compositeNumber) != x[0]) {
+                fprintf(stderr, "The kernels disagree for %ld bits.\n", bits);
+                return 1;
+            }
+
+            timeKernel("sign", bits, 0, [&](int i) { results[i] = decryptionContext.exponentiate(x[i]); });
+            timeKernel("sign8", bits, 0, [&](int i) { signLanes(x.data(), results.data(), i); });
+            timeKernel("decrypt", bits, 0, [&](int i) { results[i] = Server::decryptMessageUsingCRT(x[i]); });
+            timeKernel("g", bits, 0, [&](int i) { results[i] = GFunction::applyFunction(x[i], y[i]); });
+            timeKernel("f", bits, 0, [&](int i) { results[i] = FFunction::applyFunction(x[i], y[i]); });
+            timeKernel("verify", bits, 0, [&](int i) {
+                if(!verifyCorrectFunction(signatures[i], ID, a[i], c[i], d[i], r[i])) {
+                    abort();
+                }
+            });
+
+            for(int s = 0; s < 3; ++s) {
+                int k = securityConstants[s];
+                int numberOfRequests = k - k / 2;
+                timeKernel("blind", bits, k, [&](int i) {
+                    for(int j = 0; j < k; ++j) {
+                        int index = (i + j) % INPUT_POOL;
+                        results[index] = blindMessage(ID, a[index], c[index], d[index], r[index]);
+                    }
+                });
+
+                RevealedInformation information;
+                vector<int> requests(numberOfRequests);
+                for(int j = 0; j < numberOfRequests; ++j) {
+                    requests[j] = RandomBnd(2);
+                }
+                Server::prepareInformation(information, requests.data(), numberOfRequests);
+                for(int j = 0; j < numberOfRequests; ++j) {
+                    information.first[j] = a[j % INPUT_POOL];
+                    information.second[j] = c[j % INPUT_POOL];
+                    information.third[j] = d[j % INPUT_POOL];
+                }
+                timeKernel("product", bits, k, [&](int i) {
+                    results[i] = Server::computeProduct(information, numberOfRequests);
+                });
+            }
+        }
+
+        multiBufferExponentiation = true;
+        signLanes(x.data(), results.data(), 0);
+        for(int i = 0; i < MULTI_BUFFER_LANES; ++i) {
+            if(results[i] != decryptionContext.exponentiate(x[i])) {
+                fprintf(stderr, "The lanes disagree for %ld bits.\n", bits);
+                return 1;
+            }
+        }
+        timeKernel("sign8", bits, 0, [&](int i) { signLanes(x.data(), results.data(), i); });
+        multiBufferExponentiation = false;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <NTL/ZZ.h>
+#include <chrono>
+#include <stdio.h>
+#include "../OfficeServer/GFunction.h"
+
+#define REPETITIONS 2000
+
+using namespace std;
+using namespace NTL;
+
+// What GFunction::applyFunction did before PowerModKernel.
+ZZ separatePowers(const ZZ& x, const ZZ& y, const ZZ& g, const ZZ& n) {
+    ZZ result = PowerMod(x, g, n);
+    result += PowerMod(y, g, n);
+    result = result % n;
+    return result;
+}
+
+double nanosecondsPerCall(bool useKernel, ZZ* x, ZZ* y, const ZZ& g, const ZZ& n, int repetitions) {
+    ZZ sink;
+    sink = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(int i = 0; i < repetitions; ++i) {
+        if(useKernel) {
+            sink += GFunction::applyFunction(x[i], y[i], g, n);
+        }
+        else {
+            sink += separatePowers(x[i], y[i], g, n);
+        }
+    }
+    chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+    if(sink == -1) {
+        printf("unreachable\n");
+    }
+    return chrono::duration<double, nano>(stop - start).count() / repetitions;
+}
+
+// Times x ^ g + y ^ g mod n both ways for a few moduli and exponents and
+// checks that both give the same value.
+int main() {
+    long moduliBits[] = {1024, 2048, 3072, 4096};
+    const char* exponentNames[] = {"3", "65537", "random"};
+    printf("bits exponent separate_ns kernel_ns speedup\n");
+    for(int m = 0; m < 4; ++m) {
+        ZZ n = GenPrime_ZZ(moduliBits[m] / 2) * GenPrime_ZZ(moduliBits[m] / 2);
+        ZZ x[REPETITIONS], y[REPETITIONS];
+        for(int i = 0; i < REPETITIONS; ++i) {
+            x[i] = RandomBnd(n);
+            y[i] = RandomBnd(n);
+        }
+        for(int e = 0; e < 3; ++e) {
+            ZZ g;
+            if(e == 0) {
+                g = 3;
+            }
+            else if(e == 1) {
+                g = 65537;
+            }
+            else {
+                g = RandomBnd(n);
+            }
+            if(GFunction::applyFunction(x[0], y[0], g, n) != separatePowers(x[0], y[0], g, n)) {
+                printf("kernel and PowerMod disagree for %ld bits, exponent %s\n", moduliBits[m], exponentNames[e]);
+                return 1;
+            }
+            // full-size exponents are a thousand times slower, fewer calls are enough
+            int repetitions = e == 2 ? REPETITIONS / 100 : REPETITIONS;
+            double separate = nanosecondsPerCall(false, x, y, g, n, repetitions);
+            double kernel = nanosecondsPerCall(true, x, y, g, n, repetitions);
+            printf("%ld %s %.0f %.0f %.2f\n", moduliBits[m], exponentNames[e], separate, kernel, separate / kernel);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,410 @@
+#include <NTL/ZZ.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../OfficeClient/WireCodec.h"
+#include "../OfficeClient/GFunction.h"
+#include "../OfficeClient/FFunction.h"
+#include "../OfficeClient/BlindingPool.h"
+#include "../OfficeClient/VoterProtocol.h"
+#include "../OfficeClient/Gateway.h"
+
+#define OFFICE_PORT 2021
+#define HOME_PORT 2022
+#define OFFICE_GATEWAY_PORT 2031
+#define HOME_GATEWAY_PORT 2032
+
+#define FIRST_GENERATED_ID 1000000000000L
+#define MAX_BUSY_RETRIES 20 // times a full admission queue is waited out
+
+using namespace std;
+using namespace NTL;
+
+// What one simulated voter keeps between registering and voting.
+class Voter {
+public:
+    Credentials credentials;
+    bool registered;
+};
+
+// One session the generator runs: which voter, and whether it's the voter's
+// second ballot.
+class Arrival {
+public:
+    int voter;
+    bool doubleVote;
+};
+
+// Latencies and outcomes of one phase.
+class PhaseResult {
+public:
+    vector<double> latencies; // milliseconds, from the scheduled arrival to the last reply
+    long failures;
+    long verdicts[3];
+    double seconds;
+};
+
+const char* serverAddress = "127.0.0.1";
+int concurrency = 64;
+double arrivalRate = 0; // sessions per second, 0 for as fast as the workers go
+double doubleVoteRatio = 0;
+int expectedKeyBits = 0;
+int expectedSecurityConstant = 0;
+bool version2 = true;
+bool useGateway = false;
+map<int, GatewayConnection*> gateways; // port -> the gateway connection to it
+ZZ compositeNumber;
+mutex setupMutex;
+
+class LoadGenerator {
+private:
+    static int connectTo(int port);
+    static int connectDirectly(int port);
+    static bool checkParameters(const ZZ& modulus, int securityConstant);
+    static bool registerVoter(Voter& voter);
+    static int castBallot(Voter& voter);
+    static PhaseResult runPhase(int numberOfSessions, function<int(int)> session);
+    static double percentile(vector<double>& sorted, double fraction);
+    static void report(const char* phase, PhaseResult& result);
+
+public:
+    static void writeRoll(const char* path, long numberOfIDs);
+    static bool readRoll(const char* path, long limit, vector<Voter>& voters);
+    static void run(vector<Voter>& voters);
+};
+
+// A session with the server at port: its own connection, or with --gateway a
+// session of the one gateway connection to that server.
+int LoadGenerator::connectTo(int port) {
+    if(!useGateway) {
+        return connectDirectly(port);
+    }
+    lock_guard<mutex> lock(setupMutex);
+    if(gateways.find(port) == gateways.end()) {
+        int sd = connectDirectly(port == OFFICE_PORT ? OFFICE_GATEWAY_PORT : HOME_GATEWAY_PORT);
+        if(sd < 0) {
+            return -1;
+        }
+        gateways[port] = new GatewayConnection(sd, false, NULL);
+        thread(&GatewayConnection::run, gateways[port]).detach();
+    }
+    return gateways[port]->openSession();
+}
+
+int LoadGenerator::connectDirectly(int port) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sd < 0) {
+        return -1;
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(serverAddress);
+    server.sin_port = htons(port);
+    if(connect(sd, (struct sockaddr*) &server, sizeof(server)) < 0) {
+        close(sd);
+        return -1;
+    }
+    int on = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sd;
+}
+
+bool LoadGenerator::checkParameters(const ZZ& modulus, int securityConstant) {
+    lock_guard<mutex> lock(setupMutex);
+    if(compositeNumber == 0) {
+        compositeNumber = modulus;
+        GFunction::configure(compositeNumber);
+        FFunction::configure(compositeNumber);
+        printf("server modulus: %ld bits, k = %d\n", NumBits(compositeNumber), securityConstant);
+        if(expectedKeyBits > 0 && NumBits(compositeNumber) != expectedKeyBits) {
+            fprintf(stderr, "The OfficeServer uses a %ld-bit key, start it with --key-bits %d.\n", NumBits(compositeNumber), expectedKeyBits);
+            exit(1);
+        }
+        if(expectedSecurityConstant > 0 && securityConstant != expectedSecurityConstant) {
+            fprintf(stderr, "The OfficeServer uses k = %d, start it with --security-constant %d.\n", securityConstant, expectedSecurityConstant);
+            exit(1);
+        }
+    }
+    return compositeNumber == modulus;
+}
+
+// The OfficeClient's registration, minus the prompts and the file. The
+// blinding is computed on the spot, no pool blinds ahead. A full admission
+// queue is waited out as the server asks, up to MAX_BUSY_RETRIES times.
+bool LoadGenerator::registerVoter(Voter& voter) {
+    for(int attempt = 0; attempt <= MAX_BUSY_RETRIES; ++attempt) {
+        int sd = connectTo(OFFICE_PORT);
+        if(sd < 0) {
+            return false;
+        }
+        WireCodec codec(sd);
+        ZZ modulus = codec.receiveNumber();
+        int securityConstant = codec.receiveInt();
+        if(!codec.isBroken() && modulus == 0) {
+            // the second field says when to come back
+            close(sd);
+            this_thread::sleep_for(chrono::milliseconds(securityConstant));
+            continue;
+        }
+        if(codec.isBroken() || securityConstant < 2 || !checkParameters(modulus, securityConstant)) {
+            close(sd);
+            return false;
+        }
+        Registration registration;
+        registration.ID = voter.credentials.ID;
+        vector<BlindingTuple> tuples;
+        BlindingPool::take(tuples, securityConstant, compositeNumber);
+        for(int i = 0; i < securityConstant; ++i) {
+            registration.a.push_back(tuples[i].a);
+            registration.c.push_back(tuples[i].c);
+            registration.d.push_back(tuples[i].d);
+            registration.r.push_back(tuples[i].r);
+            registration.x.push_back(tuples[i].x);
+            registration.rCubed.push_back(tuples[i].rCubed);
+        }
+        int status = VoterProtocol::registerVoter(codec, registration, compositeNumber, securityConstant, version2, false);
+        close(sd);
+        if(status != ID_OK) {
+            return false;
+        }
+        VoterProtocol::keepCredentials(registration, securityConstant, voter.credentials);
+        voter.registered = true;
+        return true;
+    }
+    return false;
+}
+
+// The HomeClient's ballot with a random vote. Returns the verdict, or -1
+// when the session didn't complete.
+int LoadGenerator::castBallot(Voter& voter) {
+    int sd = connectTo(HOME_PORT);
+    if(sd < 0) {
+        return -1;
+    }
+    WireCodec codec(sd);
+    ZZ modulus = codec.receiveNumber();
+    if(codec.isBroken() || modulus != compositeNumber) {
+        close(sd);
+        return -1;
+    }
+    ZZ response, foundID;
+    response = RandomBnd(2);
+    int verdict = VoterProtocol::castBallot(codec, voter.credentials, compositeNumber, response, version2, false, foundID);
+    close(sd);
+    return verdict;
+}
+
+// Runs numberOfSessions sessions on `concurrency` threads. With an arrival
+// rate, session i is due at i / rate seconds and its latency counts from then,
+// so a server that falls behind shows up as growing latency instead of a
+// slower generator.
+PhaseResult LoadGenerator::runPhase(int numberOfSessions, function<int(int)> session) {
+    PhaseResult result;
+    result.failures = 0;
+    memset(result.verdicts, 0, sizeof(result.verdicts));
+    result.latencies.reserve(numberOfSessions);
+    atomic<int> next(0);
+    mutex resultMutex;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for(int w = 0; w < concurrency; ++w) {
+        workers.push_back(thread([&] {
+            vector<double> latencies;
+            long failures = 0, verdicts[3] = {0, 0, 0};
+            while(true) {
+                int i = next++;
+                if(i >= numberOfSessions) {
+                    break;
+                }
+                chrono::steady_clock::time_point due = start;
+                if(arrivalRate > 0) {
+                    due += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(i / arrivalRate));
+                    this_thread::sleep_until(due);
+                }
+                else {
+                    due = chrono::steady_clock::now();
+                }
+                int outcome = session(i);
+                latencies.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - due).count());
+                if(outcome < 0) {
+                    ++failures;
+                }
+                else {
+                    ++verdicts[outcome];
+                }
+            }
+            lock_guard<mutex> lock(resultMutex);
+            result.latencies.insert(result.latencies.end(), latencies.begin(), latencies.end());
+            result.failures += failures;
+            for(int v = 0; v < 3; ++v) {
+                result.verdicts[v] += verdicts[v];
+            }
+        }));
+    }
+    for(size_t w = 0; w < workers.size(); ++w) {
+        workers[w].join();
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+double LoadGenerator::percentile(vector<double>& sorted, double fraction) {
+    if(sorted.empty()) {
+        return 0;
+    }
+    size_t index = min(sorted.size() - 1, (size_t) (fraction * sorted.size()));
+    return sorted[index];
+}
+
+void LoadGenerator::report(const char* phase, PhaseResult& result) {
+    sort(result.latencies.begin(), result.latencies.end());
+    long completed = result.latencies.size() - result.failures;
+    printf("%s sessions=%zu failed=%ld throughput=%.1f/s p50=%.2fms p99=%.2fms p999=%.2fms",
+        phase, result.latencies.size(), result.failures, completed / result.seconds,
+        percentile(result.latencies, 0.5), percentile(result.latencies, 0.99), percentile(result.latencies, 0.999));
+    if(strcmp(phase, "vote") == 0) {
+        printf(" ok=%ld invalid=%ld fraud=%ld", result.verdicts[VOTE_OK], result.verdicts[VOTE_INVALID], result.verdicts[VOTE_FRAUD]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+void LoadGenerator::writeRoll(const char* path, long numberOfIDs) {
+    ofstream out(path, fstream::trunc | fstream::out);
+    out << numberOfIDs << '\n';
+    for(long i = 0; i < numberOfIDs; ++i) {
+        out << FIRST_GENERATED_ID + i << '\n';
+    }
+    out.close();
+}
+
+bool LoadGenerator::readRoll(const char* path, long limit, vector<Voter>& voters) {
+    ifstream in(path);
+    long numberOfIDs;
+    if(!(in >> numberOfIDs)) {
+        return false;
+    }
+    numberOfIDs = min(numberOfIDs, limit);
+    voters.resize(numberOfIDs);
+    for(long i = 0; i < numberOfIDs; ++i) {
+        in >> voters[i].credentials.ID;
+        voters[i].registered = false;
+    }
+    return true;
+}
+
+void LoadGenerator::run(vector<Voter>& voters) {
+    PhaseResult registration = runPhase(voters.size(), [&](int i) {
+        return registerVoter(voters[i]) ? ID_OK : -1;
+    });
+    report("registration", registration);
+
+    // every registered voter votes once; some of them come back afterwards
+    vector<Arrival> arrivals;
+    for(size_t i = 0; i < voters.size(); ++i) {
+        if(voters[i].registered) {
+            Arrival arrival = {(int) i, false};
+            arrivals.push_back(arrival);
+        }
+    }
+    size_t numberOfFirstVotes = arrivals.size();
+    for(size_t i = 0; i < numberOfFirstVotes; ++i) {
+        if(rand() < doubleVoteRatio * ((double) RAND_MAX + 1)) {
+            Arrival arrival = {arrivals[i].voter, true};
+            arrivals.push_back(arrival);
+        }
+    }
+    PhaseResult voting = runPhase(arrivals.size(), [&](int i) {
+        return castBallot(voters[arrivals[i].voter]);
+    });
+    report("vote", voting);
+    printf("expected fraud verdicts: %zu\n", arrivals.size() - numberOfFirstVotes);
+}
+
+// Usage: loadGenerator [--roll idsFile] [--sessions N] [--concurrency C]
+//                      [--rate R] [--double-vote-ratio x] [--key-bits b]
+//                      [--security-constant k] [--server address] [--v1] [--gateway]
+//        loadGenerator --write-roll N idsFile
+// Registers up to N voters from the roll against the OfficeServer, then casts
+// their ballots against the HomeServer, a fraction x of them twice. The key
+// size and k are the servers' (officeServer --key-bits, --security-constant);
+// passing them here only checks that the servers run with them.
+// Run the servers as officeServer --workers and homeServer --epoll, the
+// sequential modes only keep a backlog of 5 connections.
+// --v1 uses the original protocol instead of v2 for both phases.
+// --gateway runs all sessions of a phase over one gateway connection (ports
+// 2031 and 2032, officeServer --gateway and homeServer --epoll --gateway).
+// --write-roll writes a roll of N generated IDs to feed the OfficeServer.
+int main(int argc, char* argv[]) {
+    const char* rollPath = "../OfficeServer/ids.txt";
+    long numberOfSessions = 1000;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--write-roll") == 0 && i + 2 < argc) {
+            LoadGenerator::writeRoll(argv[i + 2], atol(argv[i + 1]));
+            return 0;
+        }
+        if(strcmp(argv[i], "--v1") == 0) {
+            version2 = false;
+            continue;
+        }
+        if(strcmp(argv[i], "--gateway") == 0) {
+            useGateway = true;
+            continue;
+        }
+        if(i + 1 >= argc) {
+            break;
+        }
+        if(strcmp(argv[i], "--roll") == 0) {
+            rollPath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--sessions") == 0) {
+            numberOfSessions = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--concurrency") == 0) {
+            concurrency = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--rate") == 0) {
+            arrivalRate = atof(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--double-vote-ratio") == 0) {
+            doubleVoteRatio = atof(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--key-bits") == 0) {
+            expectedKeyBits = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--security-constant") == 0) {
+            expectedSecurityConstant = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--server") == 0) {
+            serverAddress = argv[++i];
+        }
+    }
+    // a server closing a session early must not kill the generator
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<Voter> voters;
+    if(!LoadGenerator::readRoll(rollPath, numberOfSessions, voters)) {
+        fprintf(stderr, "Could not read the roll %s.\n", rollPath);
+        return 1;
+    }
+    LoadGenerator::run(voters);
+    return 0;
+}
@@ -6,69 +6,34 @@
 #include <sstream>
 #include "FFunction.h"
 #include "GFunction.h"
+#include "WireCodec.h"
+#include "FiatShamir.h"
+#include "VoterProtocol.h"
+#include "Election.h"
 
 #define INFORMATION "../OfficeClient/votingInformation"
-#define OK 0
-#define INVALID 1
+#define ELECTION_FILE "../HomeServer/ballot.txt"
 
 using namespace std;
 using namespace NTL;
 
-ZZ ID;
-ZZ pseudonym;
-int securityConstant;
-ZZ *a, *c, *d, *r;
 ZZ publicKey;
 ZZ compositeNumber;
 
 class Client {
 private:
-    static ZZ receiveNumberFromServer(int sd);
-    static void sendNumberToServer(ZZ& number, int sd);
     static string zToString(const ZZ &z);
     static ZZ cstringToNumber(char x[]);
-    static void initializeFromFile(ZZ ID);
-    static void revealSubsecrets(int sd, int* requests, ZZ* a, ZZ* c, ZZ* d, ZZ* r);
+    static bool initializeFromFile(ZZ ID, Credentials& credentials);
+    static void reportVerdict(int finalResponse, ZZ& foundID);
+    static ZZ askForBallot();
 
 public:
-    static void execute(int sd);
+    static void execute(int sd, bool version2, bool nonInteractive);
+    static void executeBatch(int sd, const char* ballotsFile);
 };
 
 
-void Client::sendNumberToServer(ZZ& number, int sd) {
-    long numberLength = NumBytes(number);
-    if(write(sd, &numberLength, sizeof(long)) < 0) {
-        perror("Error at writing number length to server.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    BytesFromZZ(representation, number, numberLength);
-    for(long i = 0; i < numberLength; ++i) {
-        if(write(sd, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to server.\n");
-            exit(0);
-        }
-    }
-}
-
-ZZ Client::receiveNumberFromServer(int sd) {
-    long numberLength;
-    if(read(sd, &numberLength, sizeof(long)) < 0) {
-        perror ("Error at reading number length from server.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    for(long i = 0; i < numberLength; ++i) {
-        if(read(sd, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to server.\n");
-            exit(0);
-        }
-    }
-    ZZ result;
-    ZZFromBytes(result, representation, numberLength);
-    return result;
-}
-
 string Client::zToString(const ZZ &z) {
     stringstream buffer;
     buffer << z;
@@ -83,101 +48,166 @@ ZZ Client::cstringToNumber(char x[]) {
     return z;
 }
 
-void Client::initializeFromFile(ZZ ID) {
+bool Client::initializeFromFile(ZZ ID, Credentials& credentials) {
     string path;
     path += INFORMATION;
     path += zToString(ID);
     path += ".txt";
     ifstream in(path.c_str());
+    if(!in) {
+        return false;
+    }
 
-    in >> pseudonym;
-    in >> securityConstant;
+    credentials.ID = ID;
+    in >> credentials.pseudonym;
+    in >> credentials.securityConstant;
 
-    a = new ZZ[securityConstant];
-    c = new ZZ[securityConstant];
-    d = new ZZ[securityConstant];
-    r = new ZZ[securityConstant];
+    int securityConstant = credentials.securityConstant;
+    if(!in || securityConstant < 2) {
+        return false;
+    }
+    credentials.a.resize(securityConstant);
+    credentials.c.resize(securityConstant);
+    credentials.d.resize(securityConstant);
+    credentials.r.resize(securityConstant);
 
     for(int i = 0; i < securityConstant; ++i) {
-        in >> a[i] >> c[i] >> d[i] >> r[i];
+        in >> credentials.a[i] >> credentials.c[i] >> credentials.d[i] >> credentials.r[i];
     }
 
     in.close();
+    return true;
+}
+
+// Asks every question of the election and encodes the answers as one number.
+ZZ Client::askForBallot() {
+    Election::load(ELECTION_FILE);
+    vector<int> answers(Election::numberOfQuestions());
+    for(int q = 0; q < Election::numberOfQuestions(); ++q) {
+        cout << "Question: " << Election::question(q) << '\n';
+        int options = Election::numberOfOptions(q);
+        do {
+            if(options == 2) {
+                cout << "Vote with 0 for NO and 1 for YES: ";
+            }
+            else {
+                cout << "Choose an option from 0 to " << options - 1 << ": ";
+            }
+            if(!(cin >> answers[q])) {
+                exit(0);
+            }
+        } while(answers[q] < 0 || answers[q] >= options);
+    }
+    return Election::encode(answers);
 }
 
-void Client::revealSubsecrets(int sd, int* requests, ZZ* a, ZZ* c, ZZ* d, ZZ* r) {
-    for(int i = 0; i < (securityConstant - securityConstant / 2); ++i) {
-        if(requests[i] == 0) {
-            ZZ x = GFunction::applyFunction(a[i], c[i]);
-            ZZ secondPart = a[i] ^ ID;
-            sendNumberToServer(x, sd);
-            sendNumberToServer(secondPart, sd);
-            sendNumberToServer(d[i], sd);
+void Client::reportVerdict(int finalResponse, ZZ& foundID) {
+    if(finalResponse == VOTE_OK) {
+        cout << "Thank your for your response!\n";
+    }
+    else {
+        if(finalResponse == VOTE_INVALID) {
+            std::cout << "You entered invalid data!" << std::endl;
         }
         else {
-            ZZ part = a[i] ^ ID;
-            ZZ y = GFunction::applyFunction(part, d[i]);
-            sendNumberToServer(a[i], sd);
-            sendNumberToServer(c[i], sd);
-            sendNumberToServer(y, sd);
+            cout << "You are a fraud! Your ID is " << foundID << " and you will support consequences.\n";
         }
     }
 }
 
-void Client::execute(int sd) {
+// Only credentials with at least FIAT_SHAMIR_MIN_SECURITY_CONSTANT blinded
+// values may vote non-interactively, see VoterProtocol::castBallot.
+void Client::execute(int sd, bool version2, bool nonInteractive) {
     cout << "Please insert a valid ID: ";
     ZZ ID;
     cin >> ID;
-    initializeFromFile(ID);
-    cout << "Question: Do you want the linden trees to be replanted on Stefan cel Mare Boulevard?\n";
-    cout << "Vote with 0 for NO and 1 for YES: ";
-    ZZ response;
-    cin >> response;
+    Credentials credentials;
+    if(!initializeFromFile(ID, credentials)) {
+        cout << "You are not registered. Please register at the office first.\n";
+        return;
+    }
+    ZZ response = askForBallot();
 
     // We now start the communication with the Server
-    compositeNumber = receiveNumberFromServer(sd);
-    publicKey = 3;
-
-    if(write(sd, &securityConstant, sizeof(int)) < 0) {
-        perror("Error at writing security constant to server.\n");
-        exit(1);
+    WireCodec codec(sd);
+    compositeNumber = codec.receiveNumber();
+    if(codec.isBroken()) {
+        exit(0);
     }
+    GFunction::configure(compositeNumber);
 
-    // We encrypt the messages
-    ZZ encryptedPseudonym = PowerMod(pseudonym, publicKey, compositeNumber);
-    ZZ encryptedResponse = PowerMod(response, publicKey, compositeNumber);
-
-    sendNumberToServer(encryptedPseudonym, sd);
-    sendNumberToServer(encryptedResponse, sd);
-
-    // The first k - k / 2 indexes are the ones that we look for
+    if(nonInteractive && credentials.securityConstant < FIAT_SHAMIR_MIN_SECURITY_CONSTANT) {
+        cout << "Your credentials have too few blinded values to vote non-interactively, using v2.\n";
+        nonInteractive = false;
+        version2 = true;
+    }
+    ZZ foundID;
+    int finalResponse = VoterProtocol::castBallot(codec, credentials, compositeNumber, response, version2, nonInteractive, foundID);
+    if(finalResponse < 0) {
+        exit(0);
+    }
+    reportVerdict(finalResponse, foundID);
+}
 
-    int numberOfRequests = securityConstant - securityConstant / 2;
-    int requests[numberOfRequests];
-    for(int i = 0; i < numberOfRequests; ++i) {
-        if(read(sd, requests + i, sizeof(int)) < 0) {
-            perror("Error at reading requests from server.\n");
-            exit(0);
+// A polling-station gateway submits every ballot it collected in one
+// connection. The file holds one "ID vote" pair per line, the vote being the
+// answers already encoded the way Election::encode does it.
+void Client::executeBatch(int sd, const char* ballotsFile) {
+    vector<Credentials> voters;
+    vector<ZZ> responses;
+    ifstream in(ballotsFile);
+    ZZ ID, response;
+    while(in >> ID >> response) {
+        Credentials credentials;
+        if(!initializeFromFile(ID, credentials)) {
+            cout << ID << ": not registered, ballot skipped.\n";
+            continue;
         }
+        voters.push_back(credentials);
+        responses.push_back(response);
+    }
+    in.close();
+    if(voters.empty()) {
+        return;
     }
-    revealSubsecrets(sd, requests, a, c, d, r);
 
-    int finalResponse;
-    if(read(sd, &finalResponse, sizeof(int)) < 0) {
-        perror("Error at reading final response from server.\n");
+    WireCodec codec(sd);
+    compositeNumber = codec.receiveNumber();
+    if(codec.isBroken()) {
         exit(0);
     }
+    GFunction::configure(compositeNumber);
+    publicKey = 3;
 
-    if(finalResponse == OK) {
-        cout << "Thank your for your response!\n";
+    codec.sendInt(BATCH_SUBMISSION);
+    codec.sendInt(voters.size());
+    for(size_t i = 0; i < voters.size(); ++i) {
+        codec.sendInt(voters[i].securityConstant);
+        codec.sendNumber(PowerMod(voters[i].pseudonym, publicKey, compositeNumber));
+        codec.sendNumber(PowerMod(responses[i], publicKey, compositeNumber));
     }
-    else {
-        if(finalResponse == INVALID) {
-            std::cout << "You entered invalid data!" << std::endl;
+
+    vector<vector<int> > requests(voters.size());
+    for(size_t i = 0; i < voters.size(); ++i) {
+        requests[i].resize(voters[i].securityConstant - voters[i].securityConstant / 2);
+        for(size_t j = 0; j < requests[i].size(); ++j) {
+            requests[i][j] = codec.receiveInt();
         }
-        else {
-            ZZ foundID = receiveNumberFromServer(sd);
-            cout << "You are a fraud! Your ID is " << foundID << " and you will support consequences.\n";
+    }
+    for(size_t i = 0; i < voters.size(); ++i) {
+        VoterProtocol::revealSubsecrets(codec, requests[i].data(), voters[i]);
+    }
+
+    for(size_t i = 0; i < voters.size(); ++i) {
+        int finalResponse = codec.receiveInt();
+        ZZ foundID;
+        if(finalResponse == VOTE_FRAUD) {
+            foundID = codec.receiveNumber();
+        }
+        if(codec.isBroken()) {
+            exit(0);
         }
+        cout << voters[i].ID << ": ";
+        reportVerdict(finalResponse, foundID);
     }
 }
@@ -14,7 +14,11 @@ extern int errno;
 
 #define PORT 2022
 
-int main ()
+// Usage: homeClient [--batch ballotsFile | --v1 | --non-interactive]
+// --v1 votes with the original protocol, for HomeServers that predate v2.
+// --non-interactive sends the revealed values with the ballot, for voters
+// registered with at least 256 blinded values.
+int main (int argc, char* argv[])
 {
     int sd;
     struct sockaddr_in server;
@@ -35,6 +39,14 @@ int main ()
         return errno;
     }
 
-    Client::execute(sd);
+    if (argc == 3 && strcmp (argv[1], "--batch") == 0)
+    {
+        Client::executeBatch(sd, argv[2]);
+    }
+    else
+    {
+        bool nonInteractive = argc > 1 && strcmp (argv[1], "--non-interactive") == 0;
+        Client::execute(sd, !(argc > 1 && strcmp (argv[1], "--v1") == 0), nonInteractive);
+    }
     close (sd);
 }
@@ -0,0 +1,166 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <vector>
+#include <string.h>
+#include "RevealedInformation.h"
+
+#define LIMB_BITS 64
+#define MIN_BUCKETS 1024 // the pseudonym index doubles when half full
+
+using namespace std;
+using namespace NTL;
+
+// Where one stored ballot starts in the arena.
+class BallotSlot {
+public:
+    size_t offset; // first limb of the ballot
+    int numberOfRequests;
+    long vote; // the ballot's answers as Election encodes them, -1 if unknown
+};
+
+// One bucket of the pseudonym index.
+class BallotBucket {
+public:
+    unsigned long digest; // of the pseudonym, see BallotArena::digest
+    long ballot; // -1 while the bucket is empty
+};
+
+// Stored ballots, packed into one contiguous array of limbs and addressed by
+// the index store() returns, or found by their pseudonym with find().
+//
+// A ballot takes the pseudonym, then ceil(k / 64) limbs of challenge bits,
+// then one fixed-width value per request. Double-vote detection only ever reads the
+// first revealed value of a request answered with 1 and the second one of a
+// request answered with 0, so that is the only value kept. Every value is
+// limbsPerValue limbs wide, enough for any number below the composite number.
+//
+// The pseudonyms are indexed by an open-addressing table with linear probing.
+// A bucket holds a keyed digest of the pseudonym next to the ballot, so a
+// lookup only compares pseudonyms (in the arena) when the digests match.
+class BallotArena {
+private:
+    size_t limbsPerValue;
+    vector<unsigned long> limbs;
+    vector<BallotSlot> slots;
+    vector<BallotBucket> buckets; // a power of two of them
+    unsigned long digestKey; // random, so no one can line pseudonyms up in one run of buckets
+
+    size_t requestLimbs(int numberOfRequests) const { return (numberOfRequests + LIMB_BITS - 1) / LIMB_BITS; }
+    const unsigned long* pseudonymLimbs(long ballot) const { return limbs.data() + slots[ballot].offset; }
+    unsigned long digest(const unsigned long* pseudonym) const;
+    void index(unsigned long pseudonymDigest, long ballot);
+
+public:
+    BallotArena() : limbsPerValue(1), buckets(MIN_BUCKETS, BallotBucket { 0, -1 }), digestKey(0) {}
+
+    void configure(const ZZ& compositeNumber);
+    bool fits(RevealedInformation& information, int numberOfRequests) const;
+    long find(const ZZ& pseudonym) const; // the ballot, -1 if the pseudonym has none
+    long store(const ZZ& pseudonym, RevealedInformation& information, int numberOfRequests, long vote);
+
+    int numberOfRequests(long ballot) const { return slots[ballot].numberOfRequests; }
+    long vote(long ballot) const { return slots[ballot].vote; }
+    int request(long ballot, int index) const;
+    ZZ revealedValue(long ballot, int index) const;
+    size_t memoryUsage() const {
+        return limbs.capacity() * sizeof(unsigned long) + slots.capacity() * sizeof(BallotSlot) + buckets.capacity() * sizeof(BallotBucket);
+    }
+};
+
+void BallotArena::configure(const ZZ& compositeNumber) {
+    size_t bytes = NumBytes(compositeNumber);
+    limbsPerValue = bytes == 0 ? 1 : (bytes + sizeof(unsigned long) - 1) / sizeof(unsigned long);
+    BytesFromZZ((unsigned char*) &digestKey, RandomBits_ZZ(LIMB_BITS), sizeof(digestKey));
+}
+
+unsigned long BallotArena::digest(const unsigned long* pseudonym) const {
+    unsigned long hash = digestKey;
+    for(size_t i = 0; i < limbsPerValue; ++i) {
+        hash = (hash ^ pseudonym[i]) * 0x9e3779b97f4a7c15UL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Puts ballot in the first free bucket from its digest on, doubling the
+// table first if that would make it more than half full.
+void BallotArena::index(unsigned long pseudonymDigest, long ballot) {
+    if(2 * slots.size() > buckets.size()) {
+        vector<BallotBucket> old(2 * buckets.size(), BallotBucket { 0, -1 });
+        old.swap(buckets);
+        for(size_t i = 0; i < old.size(); ++i) {
+            if(old[i].ballot >= 0) {
+                index(old[i].digest, old[i].ballot);
+            }
+        }
+    }
+    size_t mask = buckets.size() - 1;
+    size_t bucket = pseudonymDigest & mask;
+    while(buckets[bucket].ballot >= 0) {
+        bucket = (bucket + 1) & mask;
+    }
+    buckets[bucket].digest = pseudonymDigest;
+    buckets[bucket].ballot = ballot;
+}
+
+long BallotArena::find(const ZZ& pseudonym) const {
+    if(sign(pseudonym) < 0 || (size_t) NumBytes(pseudonym) > limbsPerValue * sizeof(unsigned long)) {
+        return -1;
+    }
+    vector<unsigned long> key(limbsPerValue);
+    BytesFromZZ((unsigned char*) key.data(), pseudonym, limbsPerValue * sizeof(unsigned long));
+    unsigned long pseudonymDigest = digest(key.data());
+    size_t mask = buckets.size() - 1;
+    for(size_t bucket = pseudonymDigest & mask; buckets[bucket].ballot >= 0; bucket = (bucket + 1) & mask) {
+        if(buckets[bucket].digest == pseudonymDigest
+            && memcmp(pseudonymLimbs(buckets[bucket].ballot), key.data(), limbsPerValue * sizeof(unsigned long)) == 0) {
+            return buckets[bucket].ballot;
+        }
+    }
+    return -1;
+}
+
+bool BallotArena::fits(RevealedInformation& information, int numberOfRequests) const {
+    // honest voters reveal numbers below n, anything wider can't be stored
+    for(int i = 0; i < numberOfRequests; ++i) {
+        ZZ& value = information.requests[i] == 1 ? information.first[i] : information.second[i];
+        if(sign(value) < 0 || (size_t) NumBytes(value) > limbsPerValue * sizeof(unsigned long)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The pseudonym must be below the composite number and not stored yet.
+long BallotArena::store(const ZZ& pseudonym, RevealedInformation& information, int numberOfRequests, long vote) {
+    BallotSlot slot;
+    slot.offset = limbs.size();
+    slot.numberOfRequests = numberOfRequests;
+    slot.vote = vote;
+    limbs.resize(limbs.size() + limbsPerValue + requestLimbs(numberOfRequests) + numberOfRequests * limbsPerValue, 0);
+
+    unsigned long* key = limbs.data() + slot.offset;
+    BytesFromZZ((unsigned char*) key, pseudonym, limbsPerValue * sizeof(unsigned long));
+    unsigned long* bits = key + limbsPerValue;
+    unsigned long* values = bits + requestLimbs(numberOfRequests);
+    for(int i = 0; i < numberOfRequests; ++i) {
+        if(information.requests[i] == 1) {
+            bits[i / LIMB_BITS] |= 1UL << (i % LIMB_BITS);
+        }
+        ZZ& value = information.requests[i] == 1 ? information.first[i] : information.second[i];
+        BytesFromZZ((unsigned char*) (values + i * limbsPerValue), value, limbsPerValue * sizeof(unsigned long));
+    }
+    slots.push_back(slot);
+    index(digest(key), slots.size() - 1);
+    return slots.size() - 1;
+}
+
+int BallotArena::request(long ballot, int index) const {
+    const unsigned long* bits = pseudonymLimbs(ballot) + limbsPerValue;
+    return (bits[index / LIMB_BITS] >> (index % LIMB_BITS)) & 1;
+}
+
+ZZ BallotArena::revealedValue(long ballot, int index) const {
+    const unsigned long* values = pseudonymLimbs(ballot) + limbsPerValue + requestLimbs(slots[ballot].numberOfRequests);
+    return ZZFromBytes((const unsigned char*) (values + index * limbsPerValue), limbsPerValue * sizeof(unsigned long));
+}
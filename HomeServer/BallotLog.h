@@ -0,0 +1,388 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "WireCodec.h"
+#include "RevealedInformation.h"
+#include "Election.h"
+#include "TaskScheduler.h"
+
+#define AUDIT_MEMORY_BYTES (1L << 30) // what the audit may hold in memory, split between the sorting threads
+#define AUDIT_READ_BUFFER (1 << 20)
+
+using namespace std;
+using namespace NTL;
+
+int ballotLogDescriptor = -1;
+vector<unsigned char> pendingBallots; // appended but not yet handed to the disk
+long ballotsAppended = 0, ballotsDurable = 0;
+int ballotLogNotifyDescriptor = -1; // an eventfd written whenever ballotsDurable moves
+mutex ballotLogMutex;
+condition_variable ballotLogWork, ballotLogDurable;
+
+// Every ballot of an election whose double votes are looked for afterwards
+// (homeServer --ballot-log), in arrival order. A record is its length
+// (unsigned int) followed by the pseudonym, the vote, the number of requests,
+// the requests as a bit vector and, per request, the one revealed value
+// double-vote detection needs: the first if the request was 1, the second
+// otherwise, all in the wire encoding.
+//
+// Ballots are made durable the way VoteJournal does it: a commit thread
+// writes and fdatasync()s whatever accumulated meanwhile, and a voter is
+// answered once durable() reaches what appended() was after its ballot.
+class BallotLog {
+private:
+    static void commitLoop();
+
+public:
+    static bool isEnabled() { return ballotLogDescriptor >= 0; }
+    static void open(const char* path);
+    static void append(ZZ& pseudonym, RevealedInformation& information, int numberOfRequests);
+    static long appended();
+    static long durable();
+    static void waitFor(long sequence);
+    static void notify(int descriptor);
+};
+
+void BallotLog::open(const char* path) {
+    ballotLogDescriptor = ::open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if(ballotLogDescriptor < 0) {
+        perror("Error at opening the ballot log.\n");
+        exit(1);
+    }
+    thread(commitLoop).detach();
+}
+
+void BallotLog::append(ZZ& pseudonym, RevealedInformation& information, int numberOfRequests) {
+    vector<unsigned char> record(sizeof(unsigned int));
+    WireCodec::appendNumber(record, pseudonym);
+    WireCodec::appendNumber(record, information.vote);
+    WireCodec::appendInt(record, numberOfRequests);
+    WireCodec::appendBits(record, information.requests.data(), numberOfRequests);
+    for(int i = 0; i < numberOfRequests; ++i) {
+        WireCodec::appendNumber(record, information.requests[i] == 1 ? information.first[i] : information.second[i]);
+    }
+    unsigned int length = record.size() - sizeof(unsigned int);
+    memcpy(record.data(), &length, sizeof(unsigned int));
+    {
+        lock_guard<mutex> lock(ballotLogMutex);
+        pendingBallots.insert(pendingBallots.end(), record.begin(), record.end());
+        ++ballotsAppended;
+    }
+    ballotLogWork.notify_one();
+}
+
+long BallotLog::appended() {
+    lock_guard<mutex> lock(ballotLogMutex);
+    return ballotsAppended;
+}
+
+long BallotLog::durable() {
+    lock_guard<mutex> lock(ballotLogMutex);
+    return ballotsDurable;
+}
+
+void BallotLog::waitFor(long sequence) {
+    unique_lock<mutex> lock(ballotLogMutex);
+    ballotLogDurable.wait(lock, [sequence] { return ballotsDurable >= sequence; });
+}
+
+void BallotLog::notify(int descriptor) {
+    lock_guard<mutex> lock(ballotLogMutex);
+    ballotLogNotifyDescriptor = descriptor;
+}
+
+void BallotLog::commitLoop() {
+    vector<unsigned char> block;
+    while(true) {
+        long sequence;
+        {
+            unique_lock<mutex> lock(ballotLogMutex);
+            ballotLogWork.wait(lock, [] { return !pendingBallots.empty(); });
+            block.swap(pendingBallots);
+            sequence = ballotsAppended;
+        }
+        size_t offset = 0;
+        while(offset < block.size()) {
+            ssize_t written = write(ballotLogDescriptor, block.data() + offset, block.size() - offset);
+            if(written <= 0) {
+                perror("Error at writing the ballot log.\n");
+                exit(1);
+            }
+            offset += written;
+        }
+        if(fdatasync(ballotLogDescriptor) < 0) {
+            perror("Error at syncing the ballot log.\n");
+            exit(1);
+        }
+        block.clear();
+        int notifyDescriptor;
+        {
+            lock_guard<mutex> lock(ballotLogMutex);
+            ballotsDurable = sequence;
+            notifyDescriptor = ballotLogNotifyDescriptor;
+        }
+        ballotLogDurable.notify_all();
+        uint64_t one = 1;
+        if(notifyDescriptor >= 0 && write(notifyDescriptor, &one, sizeof(one)) < 0) {
+            perror("Error at waking the session engine.\n");
+        }
+    }
+}
+
+// A run file being merged: its current record and where it came from.
+class AuditRun {
+public:
+    FILE* in;
+    int index;
+    vector<unsigned char> record;
+};
+
+// Finds the double votes of a ballot log after the election, without ever
+// holding the whole election in memory: an external sort by pseudonym whose
+// runs are sorted on every core, then one merge in which the ballots of a
+// pseudonym arrive next to each other. A pseudonym with two ballots gives
+// away its ID exactly as in Server::recordBallot; its ballots are not
+// counted, every other ballot is.
+class BallotAudit {
+private:
+    static int compareKeys(const unsigned char* x, const unsigned char* y);
+    static bool readRecord(FILE* in, vector<unsigned char>& record);
+    static void decodeRecord(const vector<unsigned char>& record, ZZ& pseudonym, ZZ& vote, vector<int>& requests, vector<ZZ>& values);
+    static void writeRuns(const char* path, size_t memoryBytes, vector<string>& runs);
+    static void report(vector<vector<unsigned char> >& group, vector<long>& tallies, long& fraudsters);
+
+public:
+    static void run(const char* path, size_t memoryBytes);
+};
+
+// Orders two records by the pseudonym that starts them. A wire number is its
+// byte count and then its bytes, least significant first, without leading
+// zeros, so the longer one is larger and equal lengths compare from the end.
+int BallotAudit::compareKeys(const unsigned char* x, const unsigned char* y) {
+    long xLength, yLength;
+    memcpy(&xLength, x + sizeof(unsigned int), sizeof(long));
+    memcpy(&yLength, y + sizeof(unsigned int), sizeof(long));
+    if(xLength != yLength) {
+        return xLength < yLength ? -1 : 1;
+    }
+    const unsigned char* xBytes = x + sizeof(unsigned int) + sizeof(long);
+    const unsigned char* yBytes = y + sizeof(unsigned int) + sizeof(long);
+    for(long i = xLength - 1; i >= 0; --i) {
+        if(xBytes[i] != yBytes[i]) {
+            return xBytes[i] < yBytes[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+bool BallotAudit::readRecord(FILE* in, vector<unsigned char>& record) {
+    unsigned int length;
+    if(fread(&length, sizeof(unsigned int), 1, in) != 1) {
+        return false;
+    }
+    record.resize(sizeof(unsigned int) + length);
+    memcpy(record.data(), &length, sizeof(unsigned int));
+    // a record cut short by a crash ends the log
+    return fread(record.data() + sizeof(unsigned int), 1, length, in) == length;
+}
+
+void BallotAudit::decodeRecord(const vector<unsigned char>& record, ZZ& pseudonym, ZZ& vote, vector<int>& requests, vector<ZZ>& values) {
+    const unsigned char* bytes = record.data();
+    size_t offset = sizeof(unsigned int), used;
+    WireCodec::parseNumber(bytes + offset, record.size() - offset, pseudonym, used);
+    offset += used;
+    WireCodec::parseNumber(bytes + offset, record.size() - offset, vote, used);
+    offset += used;
+    int numberOfRequests = 0;
+    if(offset + sizeof(int) <= record.size()) {
+        memcpy(&numberOfRequests, bytes + offset, sizeof(int));
+        offset += sizeof(int);
+    }
+    if(numberOfRequests < 0 || offset + (numberOfRequests + 7) / 8 > record.size()) {
+        numberOfRequests = 0;
+    }
+    requests.resize(numberOfRequests);
+    for(int i = 0; i < numberOfRequests; ++i) {
+        requests[i] = (bytes[offset + i / 8] >> (i % 8)) & 1;
+    }
+    offset += (numberOfRequests + 7) / 8;
+    values.resize(numberOfRequests);
+    for(int i = 0; i < numberOfRequests; ++i) {
+        WireCodec::parseNumber(bytes + offset, record.size() - offset, values[i], used);
+        offset += used;
+    }
+}
+
+// Cuts the log into runs that fit memoryBytes between them and sorts every
+// run on its own thread. The log is read in order, so run i only holds
+// ballots that arrived before those of run i + 1, and the stable sort keeps
+// a pseudonym's ballots in arrival order inside a run.
+void BallotAudit::writeRuns(const char* path, size_t memoryBytes, vector<string>& runs) {
+    FILE* in = fopen(path, "rb");
+    if(in == NULL) {
+        perror("Error at opening the ballot log.\n");
+        exit(1);
+    }
+    setvbuf(in, NULL, _IOFBF, AUDIT_READ_BUFFER);
+    int numberOfSorters = computeThreads.size() + 1;
+    size_t runBytes = max(memoryBytes / numberOfSorters, (size_t) AUDIT_READ_BUFFER);
+    mutex inMutex;
+    bool exhausted = false;
+    int nextRun = 0;
+
+    TaskScheduler::parallelFor(numberOfSorters, [&](int) {
+        vector<unsigned char> contents, record;
+        vector<size_t> offsets;
+        while(true) {
+            string runPath;
+            contents.clear();
+            offsets.clear();
+            {
+                lock_guard<mutex> lock(inMutex);
+                while(!exhausted && contents.size() < runBytes) {
+                    if(!readRecord(in, record)) {
+                        exhausted = true;
+                        break;
+                    }
+                    offsets.push_back(contents.size());
+                    contents.insert(contents.end(), record.begin(), record.end());
+                }
+                if(offsets.empty()) {
+                    return;
+                }
+                runPath = string(path) + ".run." + to_string(nextRun++);
+                runs.push_back(runPath);
+            }
+            const unsigned char* base = contents.data();
+            stable_sort(offsets.begin(), offsets.end(), [base](size_t x, size_t y) {
+                return compareKeys(base + x, base + y) < 0;
+            });
+            FILE* out = fopen(runPath.c_str(), "wb");
+            if(out == NULL) {
+                perror("Error at writing an audit run.\n");
+                exit(1);
+            }
+            setvbuf(out, NULL, _IOFBF, AUDIT_READ_BUFFER);
+            for(size_t i = 0; i < offsets.size(); ++i) {
+                unsigned int length;
+                memcpy(&length, base + offsets[i], sizeof(unsigned int));
+                fwrite(base + offsets[i], 1, sizeof(unsigned int) + length, out);
+            }
+            if(fclose(out) != 0) {
+                perror("Error at writing an audit run.\n");
+                exit(1);
+            }
+        }
+    });
+    fclose(in);
+}
+
+// Judges all the ballots of one pseudonym, in arrival order.
+void BallotAudit::report(vector<vector<unsigned char> >& group, vector<long>& tallies, long& fraudsters) {
+    ZZ pseudonym, vote;
+    vector<int> requests;
+    vector<ZZ> values;
+    decodeRecord(group[0], pseudonym, vote, requests, values);
+    if(group.size() == 1) {
+        long code, indexes[MAX_QUESTIONS];
+        if(Election::decode(vote, code)) {
+            Election::tallyIndexes(code, indexes);
+            for(int q = 0; q < Election::numberOfQuestions(); ++q) {
+                ++tallies[indexes[q]];
+            }
+        }
+        return;
+    }
+    // the first two ballots are enough, their requests differ somewhere
+    ZZ secondPseudonym, secondVote, ID;
+    vector<int> secondRequests;
+    vector<ZZ> secondValues;
+    decodeRecord(group[1], secondPseudonym, secondVote, secondRequests, secondValues);
+    ID = 0;
+    size_t comparedRequests = min(requests.size(), secondRequests.size());
+    for(size_t i = 0; i < comparedRequests; ++i) {
+        if(requests[i] != secondRequests[i]) {
+            // one kept its first value and the other its second
+            ID = values[i] ^ secondValues[i];
+        }
+    }
+    ++fraudsters;
+    cout << "FRAUD " << pseudonym << ' ' << ID << ' ' << group.size() << '\n';
+}
+
+void BallotAudit::run(const char* path, size_t memoryBytes) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<string> runs;
+    writeRuns(path, memoryBytes, runs);
+    double sortSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // k-way merge; ties go to the earlier run, which holds the earlier ballots
+    vector<AuditRun> sources(runs.size());
+    auto later = [&](int x, int y) {
+        int order = compareKeys(sources[x].record.data(), sources[y].record.data());
+        return order != 0 ? order > 0 : sources[x].index > sources[y].index;
+    };
+    priority_queue<int, vector<int>, decltype(later)> heads(later);
+    for(size_t r = 0; r < runs.size(); ++r) {
+        sources[r].index = r;
+        sources[r].in = fopen(runs[r].c_str(), "rb");
+        if(sources[r].in == NULL) {
+            perror("Error at reading an audit run.\n");
+            exit(1);
+        }
+        setvbuf(sources[r].in, NULL, _IOFBF, AUDIT_READ_BUFFER);
+        if(readRecord(sources[r].in, sources[r].record)) {
+            heads.push(r);
+        }
+    }
+
+    vector<long> tallies(Election::numberOfTallies(), 0);
+    long numberOfBallots = 0, fraudsters = 0;
+    vector<vector<unsigned char> > group;
+    while(!heads.empty()) {
+        int r = heads.top();
+        heads.pop();
+        if(!group.empty() && compareKeys(group[0].data(), sources[r].record.data()) != 0) {
+            report(group, tallies, fraudsters);
+            group.clear();
+        }
+        group.push_back(sources[r].record);
+        ++numberOfBallots;
+        if(readRecord(sources[r].in, sources[r].record)) {
+            heads.push(r);
+        }
+    }
+    if(!group.empty()) {
+        report(group, tallies, fraudsters);
+    }
+    for(size_t r = 0; r < runs.size(); ++r) {
+        fclose(sources[r].in);
+        unlink(runs[r].c_str());
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("Audited %ld ballots in %zu runs: sorted in %.1f s, finished in %.1f s.\n",
+        numberOfBallots, runs.size(), sortSeconds, seconds);
+    printf("%ld pseudonyms voted more than once, none of their ballots is counted.\n", fraudsters);
+    for(int q = 0; q < Election::numberOfQuestions(); ++q) {
+        printf("Question %d:", q);
+        for(int option = 0; option < Election::numberOfOptions(q); ++option) {
+            printf(" %ld", tallies[Election::tallyIndex(q, option)]);
+        }
+        printf("\n");
+    }
+}
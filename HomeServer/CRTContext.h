@@ -0,0 +1,83 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <memory>
+#include "MontgomeryEngine.h"
+#include "MultiBufferEngine.h"
+
+using namespace std;
+using namespace NTL;
+
+// Everything c^d mod n needs when it is computed with the CRT, derived once
+// from the key instead of on every signature/decryption.
+class CRTContext {
+public:
+    ZZ firstPrimeNumber, secondPrimeNumber;
+    ZZ firstModularExpression;  // d mod (p - 1)
+    ZZ secondModularExpression; // d mod (q - 1)
+    ZZ firstInvModularSecond;   // p ^ (-1) mod q
+    // the two half-size exponentiations when fixedWidthArithmetic is on
+    shared_ptr<MontgomeryEngine> firstEngine, secondEngine;
+    // the same for up to MULTI_BUFFER_LANES messages when multiBufferExponentiation is on
+    shared_ptr<MultiBufferEngine> firstLanes, secondLanes;
+
+    void build(const ZZ& privateKey, const ZZ& firstPrime, const ZZ& secondPrime);
+    void prepareEngines(); // once the primes are set, build() calls it
+    ZZ exponentiate(const ZZ& message) const;
+    // results[i] = messages[i] ^ d mod n for i < count <= MULTI_BUFFER_LANES
+    void exponentiateLanes(const ZZ* messages, ZZ* results, int count) const;
+
+private:
+    ZZ combine(const ZZ& x1, const ZZ& x2) const;
+};
+
+void CRTContext::build(const ZZ& privateKey, const ZZ& firstPrime, const ZZ& secondPrime) {
+    firstPrimeNumber = firstPrime;
+    secondPrimeNumber = secondPrime;
+    firstModularExpression = privateKey % (firstPrimeNumber - 1);
+    secondModularExpression = privateKey % (secondPrimeNumber - 1);
+    firstInvModularSecond = InvMod(firstPrimeNumber % secondPrimeNumber, secondPrimeNumber);
+    prepareEngines();
+}
+
+void CRTContext::prepareEngines() {
+    firstEngine = MontgomeryEngine::create(firstPrimeNumber);
+    secondEngine = MontgomeryEngine::create(secondPrimeNumber);
+    firstLanes = MultiBufferEngine::create(firstPrimeNumber);
+    secondLanes = MultiBufferEngine::create(secondPrimeNumber);
+}
+
+// The result of c ^ d mod n is: x1 + p((x2 - x1)(p ^ (-1) mod q) mod q).
+ZZ CRTContext::combine(const ZZ& x1, const ZZ& x2) const {
+    ZZ result;
+    result = x1 + firstPrimeNumber * (((x2 - x1) * firstInvModularSecond) % secondPrimeNumber);
+    return result;
+}
+
+ZZ CRTContext::exponentiate(const ZZ& message) const {
+    ZZ x1, x2;
+    // We compute x1 = c ^ (d mod (p - 1)) mod p and x2 = c ^ (d mod (q - 1)) mod q
+    if(fixedWidthArithmetic && firstEngine && secondEngine) {
+        x1 = firstEngine->power(message, firstModularExpression);
+        x2 = secondEngine->power(message, secondModularExpression);
+    }
+    else {
+        x1 = PowerMod(message % firstPrimeNumber, firstModularExpression, firstPrimeNumber);
+        x2 = PowerMod(message % secondPrimeNumber, secondModularExpression, secondPrimeNumber);
+    }
+    return combine(x1, x2);
+}
+
+void CRTContext::exponentiateLanes(const ZZ* messages, ZZ* results, int count) const {
+    if(!multiBufferExponentiation || !firstLanes || !secondLanes) {
+        for(int i = 0; i < count; ++i) {
+            results[i] = exponentiate(messages[i]);
+        }
+        return;
+    }
+    ZZ x1[MULTI_BUFFER_LANES], x2[MULTI_BUFFER_LANES];
+    firstLanes->power(x1, messages, count, firstModularExpression);
+    secondLanes->power(x2, messages, count, secondModularExpression);
+    for(int i = 0; i < count; ++i) {
+        results[i] = combine(x1[i], x2[i]);
+    }
+}
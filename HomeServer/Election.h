@@ -0,0 +1,103 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define MAX_QUESTIONS 256
+#define MAX_OPTIONS 65536
+#define MAX_BALLOT_CODE (1L << 62) // every combination of answers must fit a long
+
+using namespace std;
+using namespace NTL;
+
+vector<int> electionOptions;      // number of options of every question
+vector<string> electionQuestions;
+vector<long> electionTallyOffsets; // first tally index of every question
+long electionCombinations = 1;
+
+// The questions on the ballot. A ballot answers every question and is sent
+// as one number, the answers in mixed radix with the first question as the
+// least significant digit: answer0 + options0 * (answer1 + options1 * ...).
+// With the default election (one yes/no question) that is 0 for NO and 1
+// for YES, as it always was.
+//
+// The election file has one question per line, the number of options first:
+//     2 Do you want the linden trees to be replanted on Stefan cel Mare Boulevard?
+//     3 Which color should the new benches be? (0 green, 1 brown, 2 grey)
+class Election {
+public:
+    static void load(const char* path);
+    static int numberOfQuestions() { return electionOptions.size(); }
+    static int numberOfOptions(int question) { return electionOptions[question]; }
+    static const string& question(int question) { return electionQuestions[question]; }
+    static long numberOfTallies() { return electionTallyOffsets.back() + electionOptions.back(); }
+    static long tallyIndex(int question, int option) { return electionTallyOffsets[question] + option; }
+
+    static ZZ encode(const vector<int>& answers);
+    static bool decode(const ZZ& vote, long& code);
+    static void tallyIndexes(long code, long* indexes);
+};
+
+void Election::load(const char* path) {
+    electionOptions.clear();
+    electionQuestions.clear();
+    ifstream in(path);
+    int options;
+    string text;
+    while(in >> options && getline(in, text)) {
+        if(options < 2 || options > MAX_OPTIONS || (int) electionOptions.size() == MAX_QUESTIONS) {
+            fprintf(stderr, "Invalid question in %s, refusing to start.\n", path);
+            exit(1);
+        }
+        size_t start = text.find_first_not_of(" \t");
+        electionOptions.push_back(options);
+        electionQuestions.push_back(start == string::npos ? "" : text.substr(start));
+    }
+    in.close();
+    if(electionOptions.empty()) {
+        electionOptions.push_back(2);
+        electionQuestions.push_back("Do you want the linden trees to be replanted on Stefan cel Mare Boulevard?");
+    }
+
+    electionTallyOffsets.clear();
+    electionCombinations = 1;
+    long offset = 0;
+    for(size_t q = 0; q < electionOptions.size(); ++q) {
+        electionTallyOffsets.push_back(offset);
+        offset += electionOptions[q];
+        if(electionCombinations > MAX_BALLOT_CODE / electionOptions[q]) {
+            fprintf(stderr, "The ballot in %s has too many combinations, refusing to start.\n", path);
+            exit(1);
+        }
+        electionCombinations *= electionOptions[q];
+    }
+}
+
+ZZ Election::encode(const vector<int>& answers) {
+    long code = 0;
+    for(int q = numberOfQuestions() - 1; q >= 0; --q) {
+        code = code * electionOptions[q] + answers[q];
+    }
+    ZZ vote;
+    vote = code;
+    return vote;
+}
+
+bool Election::decode(const ZZ& vote, long& code) {
+    if(sign(vote) < 0 || vote >= electionCombinations) {
+        return false;
+    }
+    code = to_long(vote);
+    return true;
+}
+
+// The tally index of every answer of a ballot, one per question.
+void Election::tallyIndexes(long code, long* indexes) {
+    for(size_t q = 0; q < electionOptions.size(); ++q) {
+        indexes[q] = electionTallyOffsets[q] + code % electionOptions[q];
+        code /= electionOptions[q];
+    }
+}
@@ -1,4 +1,6 @@
 #include "Server.h"
+#include "SessionEngine.h"
+#include "Gateway.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -7,14 +9,136 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #define PORT 2022
+#define METRICS_PORT 9022
+#define GATEWAY_PORT 2032
 extern int errno;
 
 using namespace std;
 
-int main ()
+// Usage: homeServer [--epoll [--gateway [port]]] [--journal directory | --ballot-log file] [--trace file]
+//                   [--metrics [port]] [--request-deadline ms] [--reply-deadline ms] [--fixed-width]
+//                   [--multi-buffer]
+//        homeServer --audit file [--audit-memory MB]
+// Without arguments voters are served one after another by Server::execute.
+// With --epoll a single thread multiplexes all voting sessions.
+// With --gateway it also serves the sessions of gateway connections accepted
+// on port (2032), many ballots per connection (see Gateway.h).
+// With --journal the vote state is recovered from and persisted to directory.
+// With --trace the phases of every session are written to file in the Chrome
+// trace format, refreshed each second.
+// With --metrics counters, phase histograms and the running tally are served
+// on 127.0.0.1:port (9022).
+// With --ballot-log every valid ballot is appended to file and counted at
+// once; double votes are only looked for afterwards, by --audit, which sorts
+// the log by pseudonym in runs of at most MB megabytes (1024) on every core,
+// reports every impostor and prints the final tally.
+// --request-deadline and --reply-deadline bound the time a voter gets for its
+// ballot and for its revealed information and verdict, in milliseconds
+// (10000, 0 for none); a voter that misses one is counted as timed out.
+// With --fixed-width decryption and the ballot checks use the fixed-width
+// Montgomery arithmetic of MontgomeryEngine.h instead of ZZ.
+// With --multi-buffer decryptions run 8 at a time in the SIMD lanes of
+// MultiBufferEngine.h: with --epoll those of every ballot completed in the
+// same round of events, otherwise those of a ballot or a batch submission.
+// It needs a build with AVX-512 IFMA.
+// The questions are read from ballot.txt (see Election.h); without it the
+// ballot is the single yes/no question.
+int main (int argc, char* argv[])
 {
+    bool eventDriven = false;
+    int gatewayPort = 0;
+    const char* journal = NULL;
+    const char* ballotLog = NULL;
+    const char* audit = NULL;
+    size_t auditMemory = AUDIT_MEMORY_BYTES;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp (argv[i], "--epoll") == 0)
+        {
+            eventDriven = true;
+        }
+        else if (strcmp (argv[i], "--gateway") == 0)
+        {
+            gatewayPort = GATEWAY_PORT;
+            if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+            {
+                gatewayPort = atoi (argv[++i]);
+            }
+        }
+        else if (strcmp (argv[i], "--metrics") == 0)
+        {
+            int metricsPort = METRICS_PORT;
+            if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+            {
+                metricsPort = atoi (argv[++i]);
+            }
+            Metrics::serve (metricsPort);
+        }
+        else if (strcmp (argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            Trace::enable (argv[++i]);
+        }
+        else if (strcmp (argv[i], "--request-deadline") == 0 && i + 1 < argc)
+        {
+            requestDeadline = atol (argv[++i]);
+        }
+        else if (strcmp (argv[i], "--reply-deadline") == 0 && i + 1 < argc)
+        {
+            replyDeadline = atol (argv[++i]);
+        }
+        else if (strcmp (argv[i], "--journal") == 0 && i + 1 < argc)
+        {
+            journal = argv[++i];
+        }
+        else if (strcmp (argv[i], "--ballot-log") == 0 && i + 1 < argc)
+        {
+            ballotLog = argv[++i];
+        }
+        else if (strcmp (argv[i], "--audit") == 0 && i + 1 < argc)
+        {
+            audit = argv[++i];
+        }
+        else if (strcmp (argv[i], "--audit-memory") == 0 && i + 1 < argc)
+        {
+            auditMemory = max (1L, atol (argv[++i])) << 20;
+        }
+        else if (strcmp (argv[i], "--fixed-width") == 0)
+        {
+            fixedWidthArithmetic = true;
+        }
+        else if (strcmp (argv[i], "--multi-buffer") == 0)
+        {
+            multiBufferExponentiation = true;
+        }
+    }
+    if (audit != NULL)
+    {
+        Election::load (ELECTION_FILE);
+        TaskScheduler::start (thread::hardware_concurrency () > 1 ? thread::hardware_concurrency () - 1 : 0);
+        BallotAudit::run (audit, auditMemory);
+        return 0;
+    }
+    if (gatewayPort > 0 && !eventDriven)
+    {
+        fprintf (stderr, "--gateway needs --epoll.\n");
+        return 1;
+    }
+    if (journal != NULL && ballotLog != NULL)
+    {
+        fprintf (stderr, "--journal and --ballot-log cannot be used together.\n");
+        return 1;
+    }
+    if (multiBufferExponentiation && !MULTI_BUFFER_IFMA)
+    {
+        fprintf (stderr, "--multi-buffer needs a build with AVX-512 IFMA, the lanes are slower than NTL without it.\n");
+        return 1;
+    }
+    // a voter hanging up mid-session must not take the whole server down
+    signal (SIGPIPE, SIG_IGN);
+
     struct sockaddr_in server;
     struct sockaddr_in from;
     int sd;
@@ -41,11 +165,33 @@ int main ()
     setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
     Server::initialize();
-    if (listen (sd, 5) == -1)
+    if (journal != NULL)
+    {
+        Server::recover (journal);
+        vector<long> totals;
+        Tally::snapshot (totals);
+        printf ("Recovered %ld counted ballots\n", Tally::ballots (totals));
+    }
+    if (ballotLog != NULL)
+    {
+        BallotLog::open (ballotLog);
+    }
+    if (listen (sd, eventDriven ? SOMAXCONN : 5) == -1)
     {
         perror ("Error at listening to port.\n");
         return errno;
     }
+    if (eventDriven)
+    {
+        if (gatewayPort > 0)
+        {
+            Gateway::serve (gatewayPort, SessionEngine::adopt);
+            printf ("Gateways connect at port %d\n", gatewayPort);
+        }
+        printf ("We wait at port %d\n", PORT);
+        fflush (stdout);
+        SessionEngine::run(sd);
+    }
 
     while (1)
     {
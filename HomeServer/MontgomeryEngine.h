@@ -0,0 +1,393 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <memory>
+#include <string.h>
+
+// moduli narrower than this stay with ZZ, which is as fast for them
+#define FIXED_WIDTH_MIN_BITS 512
+#define FIXED_WIDTH_WINDOW_BITS 4
+
+using namespace std;
+using namespace NTL;
+
+typedef unsigned long Limb;
+typedef unsigned __int128 DoubleLimb;
+
+// true sends the hot paths through MontgomeryEngine instead of ZZ
+// (--fixed-width); off by default, where NTL sits on GMP its assembly
+// multiplications still win
+bool fixedWidthArithmetic = false;
+
+// The protocol's chains of mulmod and powmod, evaluated whole on a modulus
+// fixed at construction: numbers enter and leave as ZZ, everything between
+// stays in one engine's representation. create() picks the implementation
+// by the width of n.
+class MontgomeryEngine {
+public:
+    virtual ~MontgomeryEngine() {}
+
+    // base ^ exponent mod n
+    virtual ZZ power(const ZZ& base, const ZZ& exponent) const = 0;
+    // x ^ g + y ^ g mod n
+    virtual ZZ sumOfPowers(const ZZ& x, const ZZ& y, long g) const = 0;
+    // r ^ 3 * F(G(a, c), G(op, d)) mod n, a blinded value from scratch
+    virtual ZZ blind(const ZZ& a, const ZZ& c, const ZZ& op, const ZZ& d, const ZZ& r, long g, long f) const = 0;
+    // rCubed * F(x, G(op, d)) mod n, a blinded value whose x = G(a, c) and r ^ 3 are known
+    virtual ZZ bindID(const ZZ& x, const ZZ& rCubed, const ZZ& op, const ZZ& d, long g, long f) const = 0;
+    // the product over i of F(first, G(second, third)) when requests[i] is 0,
+    // of F(G(first, second), third) otherwise
+    virtual ZZ productOfFunctions(const int* requests, const ZZ* first, const ZZ* second, const ZZ* third,
+        int count, long g, long f) const = 0;
+
+    // NULL when n is even or has no fixed width, the caller then uses ZZ
+    static shared_ptr<MontgomeryEngine> create(const ZZ& n);
+    // create() remembered per thread for the last n it was asked about;
+    // NULL as well while fixedWidthArithmetic is off
+    static MontgomeryEngine* cached(const ZZ& n);
+};
+
+template<int LIMBS> class FixedNumber {
+public:
+    Limb limbs[LIMBS];
+};
+
+// Arithmetic modulo an odd n of at most 64 * LIMBS bits on numbers in
+// Montgomery form (x * R mod n, R = 2 ^ (64 * LIMBS)). They live in fixed
+// arrays on the stack, so nothing allocates between the conversions at the
+// ends of a chain. Limbs are the host's little-endian words, which is also
+// the byte order of BytesFromZZ.
+//
+// Reductions end in a masked subtraction rather than a branch, and power()
+// reads its whole window table for every lookup, so the secret CRT exponents
+// that go through here leave no trace in the timing of the multiplications.
+template<int LIMBS> class MontgomeryField : public MontgomeryEngine {
+public:
+    typedef FixedNumber<LIMBS> Number;
+
+private:
+    Number modulus;
+    Number rSquared;       // R ^ 2 mod n, turns x into x * R
+    Number montgomeryOne;  // R mod n
+    Limb inverse;          // -n ^ (-1) mod 2 ^ 64
+    ZZ modulusNumber;
+
+    static void select(Number& out, const Limb* chosen, const Limb* other, Limb mask);
+    static Limb addMultiple(Limb* sum, const Limb* x, Limb factor, int count);
+    void reduce(Number& out, Limb* product) const;
+
+public:
+    MontgomeryField(const ZZ& n);
+
+    void toMontgomery(Number& out, const ZZ& value) const;
+    ZZ fromMontgomery(const Number& value) const;
+    void multiply(Number& out, const Number& x, const Number& y) const;
+    void square(Number& out, const Number& x) const;
+    void add(Number& out, const Number& x, const Number& y) const;
+    void power(Number& out, const Number& base, long exponent) const;
+    void power(Number& out, const Number& base, const ZZ& exponent) const;
+    void sumOfPowers(Number& out, const Number& x, const Number& y, long g) const;
+
+    ZZ power(const ZZ& base, const ZZ& exponent) const;
+    ZZ sumOfPowers(const ZZ& x, const ZZ& y, long g) const;
+    ZZ blind(const ZZ& a, const ZZ& c, const ZZ& op, const ZZ& d, const ZZ& r, long g, long f) const;
+    ZZ bindID(const ZZ& x, const ZZ& rCubed, const ZZ& op, const ZZ& d, long g, long f) const;
+    ZZ productOfFunctions(const int* requests, const ZZ* first, const ZZ* second, const ZZ* third,
+        int count, long g, long f) const;
+};
+
+template<int LIMBS> MontgomeryField<LIMBS>::MontgomeryField(const ZZ& n) : modulusNumber(n) {
+    BytesFromZZ((unsigned char*) modulus.limbs, n, sizeof(modulus.limbs));
+    // Newton's iteration doubles the correct low bits of n ^ (-1) each
+    // step; n * n = 1 (mod 8) for an odd n, so n starts with 3 of them
+    Limb inverseOfModulus = modulus.limbs[0];
+    for(int i = 0; i < 5; ++i) {
+        inverseOfModulus *= 2 - modulus.limbs[0] * inverseOfModulus;
+    }
+    inverse = -inverseOfModulus;
+    ZZ r = (ZZ(1) << (64 * LIMBS)) % n;
+    BytesFromZZ((unsigned char*) montgomeryOne.limbs, r, sizeof(montgomeryOne.limbs));
+    BytesFromZZ((unsigned char*) rSquared.limbs, (r * r) % n, sizeof(rSquared.limbs));
+}
+
+template<int LIMBS> void MontgomeryField<LIMBS>::select(Number& out, const Limb* chosen, const Limb* other, Limb mask) {
+    for(int i = 0; i < LIMBS; ++i) {
+        out.limbs[i] = (chosen[i] & mask) | (other[i] & ~mask);
+    }
+}
+
+template<int LIMBS> void MontgomeryField<LIMBS>::toMontgomery(Number& out, const ZZ& value) const {
+    Number plain;
+    if(sign(value) < 0 || value >= modulusNumber) {
+        BytesFromZZ((unsigned char*) plain.limbs, value % modulusNumber, sizeof(plain.limbs));
+    }
+    else {
+        BytesFromZZ((unsigned char*) plain.limbs, value, sizeof(plain.limbs));
+    }
+    multiply(out, plain, rSquared);
+}
+
+template<int LIMBS> ZZ MontgomeryField<LIMBS>::fromMontgomery(const Number& value) const {
+    // multiplying by a plain 1 divides by R
+    Number unit, plain;
+    memset(unit.limbs, 0, sizeof(unit.limbs));
+    unit.limbs[0] = 1;
+    multiply(plain, value, unit);
+    ZZ result;
+    ZZFromBytes(result, (const unsigned char*) plain.limbs, sizeof(plain.limbs));
+    return result;
+}
+
+// sum[0, count) += x[0, count) * factor, returning the limb carried out
+template<int LIMBS> Limb MontgomeryField<LIMBS>::addMultiple(Limb* sum, const Limb* x, Limb factor, int count) {
+    Limb carry = 0;
+    for(int j = 0; j < count; ++j) {
+        DoubleLimb product = (DoubleLimb) x[j] * factor + sum[j] + carry;
+        sum[j] = (Limb) product;
+        carry = (Limb) (product >> 64);
+    }
+    return carry;
+}
+
+// product / R mod n for a product of two numbers below n, which is
+// consumed. Each step adds the multiple of n that clears the lowest limb
+// left; after LIMBS of them the upper half is below 2n and one subtraction
+// away from the result.
+template<int LIMBS> void MontgomeryField<LIMBS>::reduce(Number& out, Limb* product) const {
+    Limb top = 0;
+    for(int i = 0; i < LIMBS; ++i) {
+        Limb carry = addMultiple(product + i, modulus.limbs, product[i] * inverse, LIMBS);
+        DoubleLimb upper = (DoubleLimb) product[i + LIMBS] + carry + top;
+        product[i + LIMBS] = (Limb) upper;
+        top = (Limb) (upper >> 64);
+    }
+    // subtract n unless that borrows past the top limb
+    const Limb* sum = product + LIMBS;
+    Limb difference[LIMBS];
+    Limb borrow = 0;
+    for(int j = 0; j < LIMBS; ++j) {
+        DoubleLimb subtracted = (DoubleLimb) sum[j] - modulus.limbs[j] - borrow;
+        difference[j] = (Limb) subtracted;
+        borrow = (Limb) (subtracted >> 64) & 1;
+    }
+    Limb keepDifference = -(Limb) ((top | (borrow ^ 1)) != 0);
+    select(out, difference, sum, keepDifference);
+}
+
+// x * y / R mod n: the whole product first, one row per limb of y, then
+// the reduction. GCC keeps a single carry chain in registers far better
+// than the interleaved chains of the integrated forms. out may alias x or y.
+template<int LIMBS> void MontgomeryField<LIMBS>::multiply(Number& out, const Number& x, const Number& y) const {
+    Limb product[2 * LIMBS];
+    memset(product, 0, sizeof(product));
+    for(int i = 0; i < LIMBS; ++i) {
+        product[i + LIMBS] = addMultiple(product + i, x.limbs, y.limbs[i], LIMBS);
+    }
+    reduce(out, product);
+}
+
+// x * x / R mod n with each cross product computed once and doubled, which
+// saves close to half of the product's multiplications.
+template<int LIMBS> void MontgomeryField<LIMBS>::square(Number& out, const Number& x) const {
+    Limb product[2 * LIMBS];
+    memset(product, 0, sizeof(product));
+    for(int i = 0; i < LIMBS - 1; ++i) {
+        product[i + LIMBS] = addMultiple(product + 2 * i + 1, x.limbs + i + 1, x.limbs[i], LIMBS - i - 1);
+    }
+    Limb shifted = 0;
+    for(int j = 0; j < 2 * LIMBS; ++j) {
+        Limb limb = product[j];
+        product[j] = (limb << 1) | shifted;
+        shifted = limb >> 63;
+    }
+    Limb carry = 0;
+    for(int i = 0; i < LIMBS; ++i) {
+        DoubleLimb diagonal = (DoubleLimb) x.limbs[i] * x.limbs[i];
+        DoubleLimb low = (DoubleLimb) product[2 * i] + (Limb) diagonal + carry;
+        product[2 * i] = (Limb) low;
+        DoubleLimb high = (DoubleLimb) product[2 * i + 1] + (Limb) (diagonal >> 64) + (Limb) (low >> 64);
+        product[2 * i + 1] = (Limb) high;
+        carry = (Limb) (high >> 64);
+    }
+    reduce(out, product);
+}
+
+template<int LIMBS> void MontgomeryField<LIMBS>::add(Number& out, const Number& x, const Number& y) const {
+    Limb sum[LIMBS], difference[LIMBS];
+    Limb carry = 0, borrow = 0;
+    for(int j = 0; j < LIMBS; ++j) {
+        DoubleLimb added = (DoubleLimb) x.limbs[j] + y.limbs[j] + carry;
+        sum[j] = (Limb) added;
+        carry = (Limb) (added >> 64);
+    }
+    for(int j = 0; j < LIMBS; ++j) {
+        DoubleLimb subtracted = (DoubleLimb) sum[j] - modulus.limbs[j] - borrow;
+        difference[j] = (Limb) subtracted;
+        borrow = (Limb) (subtracted >> 64) & 1;
+    }
+    Limb keepDifference = -(Limb) ((carry | (borrow ^ 1)) != 0);
+    select(out, difference, sum, keepDifference);
+}
+
+// For the public exponents of G, F and r ^ 3: plain square and multiply.
+template<int LIMBS> void MontgomeryField<LIMBS>::power(Number& out, const Number& base, long exponent) const {
+    if(exponent <= 0) {
+        out = montgomeryOne;
+        return;
+    }
+    Number result = base;
+    int highestBit = 0;
+    while((exponent >> (highestBit + 1)) != 0) {
+        ++highestBit;
+    }
+    for(int bitIndex = highestBit - 1; bitIndex >= 0; --bitIndex) {
+        square(result, result);
+        if((exponent >> bitIndex) & 1) {
+            multiply(result, result, base);
+        }
+    }
+    out = result;
+}
+
+// Fixed windows of FIXED_WIDTH_WINDOW_BITS: the same squarings and
+// multiplications whatever the exponent's bits are.
+template<int LIMBS> void MontgomeryField<LIMBS>::power(Number& out, const Number& base, const ZZ& exponent) const {
+    const int tableSize = 1 << FIXED_WIDTH_WINDOW_BITS;
+    Number table[tableSize];
+    table[0] = montgomeryOne;
+    table[1] = base;
+    for(int i = 2; i < tableSize; ++i) {
+        multiply(table[i], table[i - 1], base);
+    }
+    long windows = (NumBits(exponent) + FIXED_WIDTH_WINDOW_BITS - 1) / FIXED_WIDTH_WINDOW_BITS;
+    Number result = montgomeryOne, entry;
+    for(long w = windows - 1; w >= 0; --w) {
+        for(int s = 0; s < FIXED_WIDTH_WINDOW_BITS; ++s) {
+            square(result, result);
+        }
+        long digit = 0;
+        for(int b = 0; b < FIXED_WIDTH_WINDOW_BITS; ++b) {
+            digit |= bit(exponent, w * FIXED_WIDTH_WINDOW_BITS + b) << b;
+        }
+        memset(entry.limbs, 0, sizeof(entry.limbs));
+        for(int i = 0; i < tableSize; ++i) {
+            Limb mask = -(Limb) (i == digit);
+            for(int j = 0; j < LIMBS; ++j) {
+                entry.limbs[j] |= table[i].limbs[j] & mask;
+            }
+        }
+        multiply(result, result, entry);
+    }
+    out = result;
+}
+
+template<int LIMBS> void MontgomeryField<LIMBS>::sumOfPowers(Number& out, const Number& x, const Number& y, long g) const {
+    Number xg, yg;
+    power(xg, x, g);
+    power(yg, y, g);
+    add(out, xg, yg);
+}
+
+template<int LIMBS> ZZ MontgomeryField<LIMBS>::power(const ZZ& base, const ZZ& exponent) const {
+    Number value;
+    toMontgomery(value, base);
+    power(value, value, exponent);
+    return fromMontgomery(value);
+}
+
+template<int LIMBS> ZZ MontgomeryField<LIMBS>::sumOfPowers(const ZZ& x, const ZZ& y, long g) const {
+    Number first, second;
+    toMontgomery(first, x);
+    toMontgomery(second, y);
+    sumOfPowers(first, first, second, g);
+    return fromMontgomery(first);
+}
+
+template<int LIMBS> ZZ MontgomeryField<LIMBS>::blind(const ZZ& a, const ZZ& c, const ZZ& op, const ZZ& d, const ZZ& r,
+    long g, long f) const {
+    Number first, second, x, y, rCubed;
+    toMontgomery(first, a);
+    toMontgomery(second, c);
+    sumOfPowers(x, first, second, g);
+    toMontgomery(first, op);
+    toMontgomery(second, d);
+    sumOfPowers(y, first, second, g);
+    sumOfPowers(x, x, y, f);
+    toMontgomery(first, r);
+    power(rCubed, first, 3);
+    multiply(x, x, rCubed);
+    return fromMontgomery(x);
+}
+
+template<int LIMBS> ZZ MontgomeryField<LIMBS>::bindID(const ZZ& x, const ZZ& rCubed, const ZZ& op, const ZZ& d,
+    long g, long f) const {
+    Number first, second, y;
+    toMontgomery(first, op);
+    toMontgomery(second, d);
+    sumOfPowers(y, first, second, g);
+    toMontgomery(first, x);
+    sumOfPowers(y, first, y, f);
+    toMontgomery(second, rCubed);
+    multiply(y, y, second);
+    return fromMontgomery(y);
+}
+
+template<int LIMBS> ZZ MontgomeryField<LIMBS>::productOfFunctions(const int* requests, const ZZ* first, const ZZ* second,
+    const ZZ* third, int count, long g, long f) const {
+    Number product = montgomeryOne, u, v, w;
+    for(int i = 0; i < count; ++i) {
+        toMontgomery(u, first[i]);
+        toMontgomery(v, second[i]);
+        toMontgomery(w, third[i]);
+        if(requests[i] == 0) {
+            sumOfPowers(v, v, w, g);
+            sumOfPowers(u, u, v, f);
+        }
+        else {
+            sumOfPowers(u, u, v, g);
+            sumOfPowers(u, u, w, f);
+        }
+        multiply(product, product, u);
+    }
+    return fromMontgomery(product);
+}
+
+// The widths of 1024 to 4096-bit moduli and of their CRT halves; any other
+// width goes to the next one up.
+shared_ptr<MontgomeryEngine> MontgomeryEngine::create(const ZZ& n) {
+    long bits = NumBits(n);
+    if(bits < FIXED_WIDTH_MIN_BITS || bit(n, 0) == 0) {
+        return shared_ptr<MontgomeryEngine>();
+    }
+    if(bits <= 512) {
+        return make_shared<MontgomeryField<8> >(n);
+    }
+    if(bits <= 1024) {
+        return make_shared<MontgomeryField<16> >(n);
+    }
+    if(bits <= 1536) {
+        return make_shared<MontgomeryField<24> >(n);
+    }
+    if(bits <= 2048) {
+        return make_shared<MontgomeryField<32> >(n);
+    }
+    if(bits <= 3072) {
+        return make_shared<MontgomeryField<48> >(n);
+    }
+    if(bits <= 4096) {
+        return make_shared<MontgomeryField<64> >(n);
+    }
+    return shared_ptr<MontgomeryEngine>();
+}
+
+MontgomeryEngine* MontgomeryEngine::cached(const ZZ& n) {
+    thread_local ZZ cachedModulus;
+    thread_local shared_ptr<MontgomeryEngine> cachedEngine;
+    if(!fixedWidthArithmetic) {
+        return NULL;
+    }
+    if(n != cachedModulus) {
+        cachedEngine = create(n);
+        cachedModulus = n;
+    }
+    return cachedEngine.get();
+}
@@ -0,0 +1,270 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <memory>
+#include <string.h>
+#if defined(__AVX512IFMA__)
+#include <immintrin.h>
+#endif
+
+#define MULTI_BUFFER_LANES 8
+#define MULTI_BUFFER_MIN_BITS 256
+#define MULTI_BUFFER_WINDOW_BITS 4
+
+// Limbs are LANE_RADIX_BITS wide. With AVX-512 IFMA (-mavx512ifma or a
+// -march that has it) they are the 52 bits vpmadd52 multiplies. Otherwise
+// they are 32 bits, so each product fits in a 64-bit lane and GCC's generic
+// vectors do the rest. That is four times the multiplications of 64-bit limbs
+// and loses to NTL even with AVX2, so the servers refuse --multi-buffer on
+// such builds; the lanes stay so CryptoBenchmark can time them anywhere.
+#if defined(__AVX512IFMA__) && defined(__AVX512F__)
+#define LANE_RADIX_BITS 52
+#define MULTI_BUFFER_IFMA 1
+#else
+#define LANE_RADIX_BITS 32
+#define MULTI_BUFFER_IFMA 0
+#endif
+#define LANE_MASK ((1UL << LANE_RADIX_BITS) - 1)
+
+using namespace std;
+using namespace NTL;
+
+// one 64-bit word per lane; GCC maps it onto whatever vector registers the
+// target has (one zmm, two ymm, ...)
+typedef unsigned long LaneWord __attribute__((vector_size(8 * MULTI_BUFFER_LANES)));
+
+// true sends CRT exponentiations that come in groups through
+// MultiBufferEngine (--multi-buffer)
+bool multiBufferExponentiation = false;
+
+// low += (a * b) mod 2 ^ LANE_RADIX_BITS and high += (a * b) >> LANE_RADIX_BITS,
+// lane by lane, for a and b below 2 ^ LANE_RADIX_BITS.
+static inline void multiplyAddLanes(LaneWord& low, LaneWord& high, const LaneWord& a, const LaneWord& b) {
+#if defined(__AVX512IFMA__) && defined(__AVX512F__)
+    low = (LaneWord) _mm512_madd52lo_epu64((__m512i) low, (__m512i) a, (__m512i) b);
+    high = (LaneWord) _mm512_madd52hi_epu64((__m512i) high, (__m512i) a, (__m512i) b);
+#else
+    LaneWord product = a * b;
+    low += product & LANE_MASK;
+    high += product >> LANE_RADIX_BITS;
+#endif
+}
+
+// CRT half-exponentiations are the servers' heaviest arithmetic, and under
+// load many of them share a modulus and an exponent (the key's p and d mod
+// (p - 1)). This runs MULTI_BUFFER_LANES of them at once, lane i of every
+// vector belonging to the i-th base. create() picks the implementation by
+// the width of the modulus.
+class MultiBufferEngine {
+public:
+    virtual ~MultiBufferEngine() {}
+
+    // results[i] = bases[i] ^ exponent mod n for i < count <= MULTI_BUFFER_LANES
+    virtual void power(ZZ* results, const ZZ* bases, int count, const ZZ& exponent) const = 0;
+
+    // NULL when n is even or has no lane width, the caller then uses ZZ
+    static shared_ptr<MultiBufferEngine> create(const ZZ& n);
+};
+
+template<int LIMBS> class LaneNumber {
+public:
+    LaneWord limbs[LIMBS];
+};
+
+// Montgomery arithmetic modulo an odd n below R = 2 ^ (LANE_RADIX_BITS * LIMBS),
+// MULTI_BUFFER_LANES numbers at a time. A multiplication accumulates every
+// partial product unnormalized in 64-bit lanes and only carries the limb it
+// shifts out, so the lanes never wait on each other's carries; the headroom
+// above LANE_RADIX_BITS covers the sums of up to 4096-bit moduli.
+//
+// Every lane follows the same exponent, so power() takes the same path for
+// all of them, and like MontgomeryField it reads the whole window table for
+// every lookup and reduces with masks rather than branches.
+template<int LIMBS> class MultiBufferField : public MultiBufferEngine {
+public:
+    typedef LaneNumber<LIMBS> Number;
+
+private:
+    static const int WORDS = (LIMBS * LANE_RADIX_BITS + 63) / 64 + 1;
+
+    Number modulus;        // n in every lane
+    Number rSquared;       // R ^ 2 mod n in every lane
+    Number montgomeryOne;  // R mod n in every lane
+    LaneWord inverse;      // -n ^ (-1) mod 2 ^ LANE_RADIX_BITS in every lane
+    ZZ modulusNumber;
+
+    void broadcast(Number& out, const ZZ& value) const;
+    void toLanes(Number& out, const ZZ* values, int count) const;
+    void fromLanes(ZZ* values, int count, const Number& number) const;
+    void multiply(Number& out, const Number& x, const Number& y) const;
+
+public:
+    MultiBufferField(const ZZ& n);
+
+    void power(ZZ* results, const ZZ* bases, int count, const ZZ& exponent) const;
+};
+
+template<int LIMBS> MultiBufferField<LIMBS>::MultiBufferField(const ZZ& n) : modulusNumber(n) {
+    broadcast(modulus, n);
+    // Newton's iteration, as in MontgomeryField
+    unsigned long lowest;
+    BytesFromZZ((unsigned char*) &lowest, n, sizeof(lowest));
+    unsigned long inverseOfModulus = lowest;
+    for(int i = 0; i < 5; ++i) {
+        inverseOfModulus *= 2 - lowest * inverseOfModulus;
+    }
+    inverse = (LaneWord) {} + (-inverseOfModulus & LANE_MASK);
+    ZZ r = (ZZ(1) << (LANE_RADIX_BITS * LIMBS)) % n;
+    broadcast(montgomeryOne, r);
+    broadcast(rSquared, (r * r) % n);
+}
+
+template<int LIMBS> void MultiBufferField<LIMBS>::broadcast(Number& out, const ZZ& value) const {
+    ZZ values[MULTI_BUFFER_LANES];
+    for(int i = 0; i < MULTI_BUFFER_LANES; ++i) {
+        values[i] = value;
+    }
+    toLanes(out, values, MULTI_BUFFER_LANES);
+}
+
+// Splits values (below R) into limbs, lane i getting values[i]; lanes past
+// count hold 0.
+template<int LIMBS> void MultiBufferField<LIMBS>::toLanes(Number& out, const ZZ* values, int count) const {
+    memset(out.limbs, 0, sizeof(out.limbs));
+    for(int i = 0; i < count; ++i) {
+        unsigned long words[WORDS];
+        BytesFromZZ((unsigned char*) words, values[i], sizeof(words));
+        for(int j = 0; j < LIMBS; ++j) {
+            int word = j * LANE_RADIX_BITS / 64, shift = j * LANE_RADIX_BITS % 64;
+            unsigned long limb = words[word] >> shift;
+            if(shift + LANE_RADIX_BITS > 64) {
+                limb |= words[word + 1] << (64 - shift);
+            }
+            out.limbs[j][i] = limb & LANE_MASK;
+        }
+    }
+}
+
+template<int LIMBS> void MultiBufferField<LIMBS>::fromLanes(ZZ* values, int count, const Number& number) const {
+    for(int i = 0; i < count; ++i) {
+        unsigned long words[WORDS];
+        memset(words, 0, sizeof(words));
+        for(int j = 0; j < LIMBS; ++j) {
+            int word = j * LANE_RADIX_BITS / 64, shift = j * LANE_RADIX_BITS % 64;
+            unsigned long limb = number.limbs[j][i];
+            words[word] |= limb << shift;
+            if(shift + LANE_RADIX_BITS > 64) {
+                words[word + 1] |= limb >> (64 - shift);
+            }
+        }
+        ZZFromBytes(values[i], (const unsigned char*) words, sizeof(words));
+    }
+}
+
+// x * y / R mod n in every lane, for x and y below n with normalized limbs.
+// out may alias x or y.
+template<int LIMBS> void MultiBufferField<LIMBS>::multiply(Number& out, const Number& x, const Number& y) const {
+    LaneWord sum[LIMBS + 1];
+    memset(sum, 0, sizeof(sum));
+    for(int i = 0; i < LIMBS; ++i) {
+        for(int j = 0; j < LIMBS; ++j) {
+            multiplyAddLanes(sum[j], sum[j + 1], x.limbs[j], y.limbs[i]);
+        }
+        // adding m * n clears the lowest limb, whose carry is all that moves
+        LaneWord m = {};
+        LaneWord unused = {};
+        LaneWord lowest = sum[0] & LANE_MASK;
+        multiplyAddLanes(m, unused, lowest, inverse);
+        m &= LANE_MASK;
+        for(int j = 0; j < LIMBS; ++j) {
+            multiplyAddLanes(sum[j], sum[j + 1], m, modulus.limbs[j]);
+        }
+        LaneWord carry = sum[0] >> LANE_RADIX_BITS;
+        memmove(sum, sum + 1, LIMBS * sizeof(LaneWord));
+        sum[0] += carry;
+        sum[LIMBS] = (LaneWord) {};
+    }
+    for(int j = 0; j < LIMBS; ++j) {
+        sum[j + 1] += sum[j] >> LANE_RADIX_BITS;
+        sum[j] &= LANE_MASK;
+    }
+    // the sum is below 2n: subtract n in the lanes where that doesn't borrow
+    // past the top limb
+    LaneWord difference[LIMBS];
+    LaneWord borrow = {};
+    for(int j = 0; j < LIMBS; ++j) {
+        difference[j] = sum[j] - modulus.limbs[j] - borrow;
+        borrow = difference[j] >> 63;
+        difference[j] &= LANE_MASK;
+    }
+    LaneWord keepDifference = ((sum[LIMBS] - borrow) >> 63) - 1;
+    for(int j = 0; j < LIMBS; ++j) {
+        out.limbs[j] = (difference[j] & keepDifference) | (sum[j] & ~keepDifference);
+    }
+}
+
+template<int LIMBS> void MultiBufferField<LIMBS>::power(ZZ* results, const ZZ* bases, int count, const ZZ& exponent) const {
+    ZZ reduced[MULTI_BUFFER_LANES];
+    for(int i = 0; i < count; ++i) {
+        reduced[i] = sign(bases[i]) < 0 || bases[i] >= modulusNumber ? bases[i] % modulusNumber : bases[i];
+    }
+    const int tableSize = 1 << MULTI_BUFFER_WINDOW_BITS;
+    unique_ptr<Number[]> table(new Number[tableSize]);
+    Number base, result, entry;
+    toLanes(base, reduced, count);
+    multiply(base, base, rSquared);
+    table[0] = montgomeryOne;
+    table[1] = base;
+    for(int i = 2; i < tableSize; ++i) {
+        multiply(table[i], table[i - 1], base);
+    }
+    long windows = (NumBits(exponent) + MULTI_BUFFER_WINDOW_BITS - 1) / MULTI_BUFFER_WINDOW_BITS;
+    result = montgomeryOne;
+    for(long w = windows - 1; w >= 0; --w) {
+        for(int s = 0; s < MULTI_BUFFER_WINDOW_BITS; ++s) {
+            multiply(result, result, result);
+        }
+        long digit = 0;
+        for(int b = 0; b < MULTI_BUFFER_WINDOW_BITS; ++b) {
+            digit |= bit(exponent, w * MULTI_BUFFER_WINDOW_BITS + b) << b;
+        }
+        memset(entry.limbs, 0, sizeof(entry.limbs));
+        for(int i = 0; i < tableSize; ++i) {
+            LaneWord mask = (LaneWord) {} - (unsigned long) (i == digit);
+            for(int j = 0; j < LIMBS; ++j) {
+                entry.limbs[j] |= table[i].limbs[j] & mask;
+            }
+        }
+        multiply(result, result, entry);
+    }
+    // multiplying by a plain 1 leaves Montgomery form
+    Number unit;
+    memset(unit.limbs, 0, sizeof(unit.limbs));
+    unit.limbs[0] += 1;
+    multiply(result, result, unit);
+    fromLanes(results, count, result);
+}
+
+// The CRT halves of 1024 to 4096-bit moduli; any other width goes to the
+// next one up.
+shared_ptr<MultiBufferEngine> MultiBufferEngine::create(const ZZ& n) {
+    long bits = NumBits(n);
+    if(bits < MULTI_BUFFER_MIN_BITS || bit(n, 0) == 0) {
+        return shared_ptr<MultiBufferEngine>();
+    }
+    if(bits <= 512) {
+        return make_shared<MultiBufferField<(512 + LANE_RADIX_BITS - 1) / LANE_RADIX_BITS> >(n);
+    }
+    if(bits <= 768) {
+        return make_shared<MultiBufferField<(768 + LANE_RADIX_BITS - 1) / LANE_RADIX_BITS> >(n);
+    }
+    if(bits <= 1024) {
+        return make_shared<MultiBufferField<(1024 + LANE_RADIX_BITS - 1) / LANE_RADIX_BITS> >(n);
+    }
+    if(bits <= 1536) {
+        return make_shared<MultiBufferField<(1536 + LANE_RADIX_BITS - 1) / LANE_RADIX_BITS> >(n);
+    }
+    if(bits <= 2048) {
+        return make_shared<MultiBufferField<(2048 + LANE_RADIX_BITS - 1) / LANE_RADIX_BITS> >(n);
+    }
+    return shared_ptr<MultiBufferEngine>();
+}
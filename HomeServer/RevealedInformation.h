@@ -1,8 +1,17 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <vector>
+
+using namespace std;
+using namespace NTL;
+
+// What a voter revealed during one session. Only lives as long as the
+// session; accepted ballots are kept in the BallotArena.
 class RevealedInformation {
 public:
-    int* requests;
-    ZZ* first;
-    ZZ* second;
-    ZZ* third;
+    vector<int> requests;
+    vector<ZZ> first;
+    vector<ZZ> second;
+    vector<ZZ> third;
     ZZ vote;
 };
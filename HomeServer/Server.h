@@ -4,7 +4,12 @@
 #include <string>
 #include <map>
 #include <set>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <unistd.h>
+#include <poll.h>
 #include <stdio.h>
 #include <errno.h>
 #include <iostream>
@@ -13,227 +18,561 @@
 #include "FFunction.h"
 #include "GFunction.h"
 #include "RevealedInformation.h"
+#include "BallotArena.h"
+#include "WireCodec.h"
+#include "CRTContext.h"
+#include "KeyFile.h"
+#include "Trace.h"
+#include "TaskScheduler.h"
+#include "ExponentiationBatcher.h"
+#include "FiatShamir.h"
 
 #define PRIMES_LENGTH 10
+#define MAX_SECURITY_CONSTANT 4096
+#define MAX_BALLOTS_PER_BATCH 4096
+#define DEFAULT_DEADLINE 10000 // milliseconds a voter gets for each of its messages
+#define BALLOT_NONCE_BITS 128 // sent after PROTOCOL_NONINTERACTIVE, the requests are hashed from it
+
+// sent instead of the security constant by gateways submitting many ballots
+#define BATCH_SUBMISSION -1
+// sent before the security constant by protocol v2 clients, which get their
+// requests back as one bit vector instead of one int each
+#define PROTOCOL_V2 -2
+// sent the same way by clients that reveal the values a hash of their ballot
+// requests (see FiatShamir.h), so the requests are never sent
+#define PROTOCOL_NONINTERACTIVE -3
 
 #define INFORMATION "../OfficeServer/serverInfo.txt"
+#define ELECTION_FILE "ballot.txt" // the questions, one yes/no question without it
+#define KEY_FILE "../OfficeServer/serverKey.bin"
 
 #define OK 0
 #define INVALID 1
 #define FRAUD 2
 
+#include "VoteJournal.h"
+#include "Tally.h"
+#include "BallotLog.h"
+
 using namespace std;
 using namespace NTL;
 
 ZZ compositeNumber;
 ZZ firstPrimeNumber, secondPrimeNumber;
 ZZ privateKey;
+CRTContext decryptionContext; // built once the key is read, read-only afterwards
 int securityConstant;
-map<ZZ, RevealedInformation> storedInformation;
+long requestDeadline = DEFAULT_DEADLINE; // for the ballot, 0 for none
+long replyDeadline = DEFAULT_DEADLINE;   // for the revealed information
+BallotArena storedBallots; // indexed by pseudonym
 map<ZZ, ZZ> impostors;
 
-int positiveVotes = 0;
-int negativeVotes = 0;
+// A verdict of the sequential server waiting for its ballot to reach the disk.
+class HeldReply {
+public:
+	int client; // a dup() of the voter's socket, closed once the reply is sent
+	vector<unsigned char> reply;
+	long journalSequence, ballotLogSequence;
+};
+deque<HeldReply> heldReplies;
+mutex heldRepliesMutex;
+condition_variable heldRepliesWork;
+
+// One ballot of a batched submission, kept until the whole batch is judged.
+class BallotSubmission {
+public:
+	int securityConstant;
+	int numberOfRequests;
+	ZZ encryptedPseudonym, encryptedResponse;
+	ZZ pseudonym;
+	bool wellFormed;
+	RevealedInformation information;
+};
 
 class Server {
 private:
 
-    static void sendNumberToClient(ZZ& number, int client);
-	static ZZ receiveNumberFromClient(int client);
-    static ZZ decryptMessageUsingCRT(ZZ blindMessage); // sign a single blinded message
-	static void chooseRandomRequests(int* requests, int numberOfRequests);
 	static bool verifyCorrectFunction(ZZ blindSignature, ZZ ID, ZZ a, ZZ c, ZZ d, ZZ r);
-	static ZZ findNewInformationAndProduct(RevealedInformation& information, int* requests, int numberOfRequests, int client);
+	static ZZ findNewInformationAndProduct(RevealedInformation& information, int* requests, int numberOfRequests, WireCodec& codec, long session);
+	static void executeBatch(WireCodec& codec, int client);
+	static void sendReply(int client, vector<unsigned char>& reply);
+	static void replyWhenDurable(WireCodec& codec, int client, vector<unsigned char>& reply);
+	static void replyLoop();
+	static void journalBallot(ZZ& pseudonym, RevealedInformation& information, int numberOfRequests);
+	static void journalFraud(ZZ& pseudonym, ZZ& ID, ZZ& vote, int delta);
+	static void restoreRecord(JournalRecord& record);
+
 public:
+	// Protocol steps that don't touch the socket, shared by execute() and the
+	// event-driven SessionEngine.
+	static ZZ decryptMessageUsingCRT(ZZ cryptotext);
+	static void chooseRandomRequests(int* requests, int numberOfRequests);
+	static void deriveRequests(int* requests, int securityConstant, ZZ& nonce, ZZ& encryptedPseudonym, ZZ& encryptedResponse);
+	static void prepareInformation(RevealedInformation& information, int* requests, int numberOfRequests);
+	static ZZ computeProduct(RevealedInformation& information, int numberOfRequests);
+	static bool isWellFormedBallot(ZZ& encryptedPseudonym, ZZ& encryptedResponse, ZZ& product);
+	static int recordBallot(ZZ& pseudonym, RevealedInformation& newInformation, int numberOfRequests, ZZ& ID);
+	static int judgeBallot(ZZ& encryptedPseudonym, ZZ& encryptedResponse, RevealedInformation& newInformation, ZZ& product, int numberOfRequests, ZZ& ID);
+
+	static Counter verdictCounter(int verdict);
+
 	static void initialize();
+	static void recover(const char* directory);
     static void execute(int client);
 };
 
 void Server::initialize() {
-	ifstream in(INFORMATION);
-	in >> privateKey >> compositeNumber >> firstPrimeNumber >> secondPrimeNumber;
-	in.close();
-}
-
-void Server::sendNumberToClient(ZZ& number, int client) {
-    long numberLength = NumBytes(number);
-    if(write(client, &numberLength, sizeof(long)) < 0) {
-        perror("Error at writing number length to client.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    BytesFromZZ(representation, number, numberLength);
-    for(long i = 0; i < numberLength; ++i) {
-        if(write(client, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to client.\n");
-            exit(0);
-        }
-    }
-}
-
-ZZ Server::receiveNumberFromClient(int client) {
-    long numberLength;
-    if(read(client, &numberLength, sizeof(long)) < 0) {
-        perror ("Error at reading number length from client.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    for(long i = 0; i < numberLength; ++i) {
-        if(read(client, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to client.\n");
-            exit(0);
-        }
-    }
-    ZZ result;
-    ZZFromBytes(result, representation, numberLength);
-    return result;
+	// the key file carries the CRT values too, the text form needs them rebuilt
+	if(KeyFile::load(KEY_FILE, privateKey, compositeNumber, decryptionContext)) {
+		firstPrimeNumber = decryptionContext.firstPrimeNumber;
+		secondPrimeNumber = decryptionContext.secondPrimeNumber;
+	}
+	else {
+		ifstream in(INFORMATION);
+		in >> privateKey >> compositeNumber >> firstPrimeNumber >> secondPrimeNumber;
+		in.close();
+		decryptionContext.build(privateKey, firstPrimeNumber, secondPrimeNumber);
+	}
+	Election::load(ELECTION_FILE);
+	Metrics::addSource(Tally::exposition);
+	storedBallots.configure(compositeNumber);
+	GFunction::configure(compositeNumber);
+	FFunction::configure(compositeNumber);
+	if(computeThreads.empty()) {
+		TaskScheduler::start(thread::hardware_concurrency() > 1 ? thread::hardware_concurrency() - 1 : 0);
+	}
+	thread(replyLoop).detach();
 }
 
-ZZ Server::decryptMessageUsingCRT(ZZ cryptotext) {
+// Like the codec, a voter that doesn't read its verdict gets replyDeadline.
+void Server::sendReply(int client, vector<unsigned char>& reply) {
+	size_t offset = 0;
+	while(offset < reply.size()) {
+		struct pollfd ready;
+		ready.fd = client;
+		ready.events = POLLOUT;
+		if(poll(&ready, 1, replyDeadline > 0 ? replyDeadline : -1) == 0) {
+			fprintf(stderr, "Error at sending the verdict, deadline passed.\n");
+			return;
+		}
+		ssize_t written = write(client, reply.data() + offset, reply.size() - offset);
+		Metrics::count(SESSION_SYSCALLS);
+		if(written < 0 && errno == EINTR) {
+			continue;
+		}
+		if(written <= 0) {
+			perror("Error at sending the verdict.\n");
+			return;
+		}
+		offset += written;
+		Metrics::count(SESSION_BYTES_WRITTEN, written);
+	}
+}
 
-	// We compute c^d mod n by using CRT:
-	// First we compute	d mod (p-1), d mod (q - 1) and p ^ (-1) mod q.
+// The voter is only answered once its ballot survives a crash. Waiting for
+// the sync here would keep the next voter waiting too, so the reply is handed
+// to replyLoop with a dup() of the socket, and every voter judged while one
+// sync runs is answered after the next.
+void Server::replyWhenDurable(WireCodec& codec, int client, vector<unsigned char>& reply) {
+	codec.flush();
+	HeldReply held;
+	held.journalSequence = VoteJournal::isEnabled() ? VoteJournal::appended() : 0;
+	held.ballotLogSequence = BallotLog::isEnabled() ? BallotLog::appended() : 0;
+	if(held.journalSequence <= VoteJournal::durable() && held.ballotLogSequence <= BallotLog::durable()) {
+		sendReply(client, reply);
+		return;
+	}
+	held.client = dup(client);
+	if(held.client < 0) {
+		perror("Error at holding the verdict back.\n");
+		VoteJournal::waitFor(held.journalSequence);
+		BallotLog::waitFor(held.ballotLogSequence);
+		sendReply(client, reply);
+		return;
+	}
+	held.reply.swap(reply);
+	{
+		lock_guard<mutex> lock(heldRepliesMutex);
+		heldReplies.push_back(held);
+	}
+	heldRepliesWork.notify_one();
+}
 
-	ZZ firstModularExpression = privateKey % (firstPrimeNumber - 1);
-	ZZ secondModularExpression = privateKey % (secondPrimeNumber - 1);
-	ZZ firstInvModularSecond = InvMod(firstPrimeNumber % secondPrimeNumber, secondPrimeNumber);
+void Server::replyLoop() {
+	while(true) {
+		HeldReply held;
+		{
+			unique_lock<mutex> lock(heldRepliesMutex);
+			heldRepliesWork.wait(lock, [] { return !heldReplies.empty(); });
+			held = heldReplies.front();
+			heldReplies.pop_front();
+		}
+		VoteJournal::waitFor(held.journalSequence);
+		BallotLog::waitFor(held.ballotLogSequence);
+		sendReply(held.client, held.reply);
+		close(held.client);
+	}
+}
 
-	ZZ x1, x2;
-	// We compute x1 = (d mod p) ^ n_1  mod p and x2 = (d mod q) ^ n_2 mod q
-	x1 = PowerMod(cryptotext % firstPrimeNumber, firstModularExpression, firstPrimeNumber);
-	x2 = PowerMod(cryptotext % secondPrimeNumber, secondModularExpression, secondPrimeNumber);
+void Server::recover(const char* directory) {
+	vector<long> tallies(Election::numberOfTallies(), 0);
+	VoteJournal::recover(directory, restoreRecord, tallies);
+	Tally::addTotals(tallies);
+}
 
-	// The result of c ^ d mod n is: x1 + p((x2 - x1)(p ^ (-1) mod q) mod q).
-	ZZ decryptedMessage;
-	decryptedMessage = x1 + firstPrimeNumber * (((x2 - x1) * firstInvModularSecond) % secondPrimeNumber);
-	return decryptedMessage;
+void Server::restoreRecord(JournalRecord& record) {
+	long code;
+	bool counted = Election::decode(record.vote, code);
+	if(record.type == JOURNAL_FRAUD) {
+		impostors[record.pseudonym] = record.ID;
+		if(counted && record.delta != 0) {
+			Tally::add(code, record.delta);
+		}
+	}
+	else {
+		int numberOfRequests = record.requests.size();
+		RevealedInformation information;
+		prepareInformation(information, record.requests.data(), numberOfRequests);
+		for(int i = 0; i < numberOfRequests; ++i) {
+			information.first[i] = record.first[i];
+			information.second[i] = record.second[i];
+			information.third[i] = record.third[i];
+		}
+		information.vote = record.vote;
+		storedBallots.store(record.pseudonym, information, numberOfRequests, counted ? code : -1);
+		if(counted) {
+			Tally::add(code, 1);
+		}
+	}
+}
+
+Counter Server::verdictCounter(int verdict) {
+	if(verdict == OK) {
+		return SESSIONS_COMPLETED;
+	}
+	return verdict == INVALID ? REJECTED_INVALID : REJECTED_FRAUD;
+}
+
+void Server::journalBallot(ZZ& pseudonym, RevealedInformation& information, int numberOfRequests) {
+	JournalRecord record;
+	record.type = JOURNAL_BALLOT;
+	record.pseudonym = pseudonym;
+	record.vote = information.vote;
+	record.delta = 0;
+	record.requests = information.requests;
+	record.first = information.first;
+	record.second = information.second;
+	record.third = information.third;
+	VoteJournal::append(record);
+}
+
+void Server::journalFraud(ZZ& pseudonym, ZZ& ID, ZZ& vote, int delta) {
+	JournalRecord record;
+	record.type = JOURNAL_FRAUD;
+	record.pseudonym = pseudonym;
+	record.ID = ID;
+	record.vote = vote;
+	record.delta = delta;
+	VoteJournal::append(record);
+}
+
+ZZ Server::decryptMessageUsingCRT(ZZ cryptotext) {
+	// d mod (p-1), d mod (q - 1) and p ^ (-1) mod q were computed in initialize()
+	return decryptionContext.exponentiate(cryptotext);
 }
 
 void Server::chooseRandomRequests(int* requests, int numberOfRequests) {
-	srand(time(NULL));
+	// Reseeding rand() with time(NULL) handed the same challenges to every
+	// voter served within the same second; NTL's generator is seeded once.
 	for(int i = 0; i < numberOfRequests; ++i) {
-		requests[i] = rand() % 2;
+		requests[i] = RandomBnd(2);
 	}
 }
 
-ZZ Server::findNewInformationAndProduct(RevealedInformation& newInformation, int* requests, int numberOfRequests, int client) {
-	newInformation.requests = new int[numberOfRequests];
-	newInformation.first = new ZZ[numberOfRequests];
-	newInformation.second = new ZZ[numberOfRequests];
-	newInformation.third = new ZZ[numberOfRequests];
-	ZZ product;
-	product = 1;
-	for(int i = 0; i < numberOfRequests; ++i) {
-		newInformation.first[i] = receiveNumberFromClient(client);
-		newInformation.second[i] = receiveNumberFromClient(client);
-		newInformation.third[i] = receiveNumberFromClient(client);
-		if(requests[i] == 0) {
-			ZZ y = GFunction::applyFunction(newInformation.second[i], newInformation.third[i]);
-			ZZ res = FFunction::applyFunction(newInformation.first[i], y);
-			product = (product * res) % compositeNumber;
-		}
-		else {
-			ZZ x = GFunction::applyFunction(newInformation.first[i], newInformation.second[i]);
-			ZZ res = FFunction::applyFunction(x, newInformation.third[i]);
-			product = (product * res) % compositeNumber;
+void Server::deriveRequests(int* requests, int securityConstant, ZZ& nonce, ZZ& encryptedPseudonym, ZZ& encryptedResponse) {
+	// Textbook RSA is deterministic, so a voter voting twice could send the
+	// same ballot again and get the same requests, hiding its ID. The nonce
+	// this session sent before the ballot makes the second one's requests fresh.
+	Transcript transcript("evote ballot");
+	transcript.add(compositeNumber);
+	transcript.add(nonce);
+	transcript.add((long) securityConstant);
+	transcript.add(encryptedPseudonym);
+	transcript.add(encryptedResponse);
+	transcript.chooseBits(requests, securityConstant - securityConstant / 2);
+}
+
+void Server::prepareInformation(RevealedInformation& newInformation, int* requests, int numberOfRequests) {
+	// the challenge bits are what double-vote detection compares later
+	newInformation.requests.assign(requests, requests + numberOfRequests);
+	newInformation.first.resize(numberOfRequests);
+	newInformation.second.resize(numberOfRequests);
+	newInformation.third.resize(numberOfRequests);
+}
+
+ZZ Server::computeProduct(RevealedInformation& newInformation, int numberOfRequests) {
+	// F(a, G(c, d)) for a request of 0, F(G(a, c), d) for a request of 1
+	return PowerModKernel::productOfFunctions(newInformation.requests.data(), newInformation.first.data(),
+		newInformation.second.data(), newInformation.third.data(), numberOfRequests, G_EXPONENT, F_EXPONENT,
+		compositeNumber);
+}
+
+ZZ Server::findNewInformationAndProduct(RevealedInformation& newInformation, int* requests, int numberOfRequests, WireCodec& codec, long session) {
+	prepareInformation(newInformation, requests, numberOfRequests);
+	{
+		TraceSpan span("receive revealed values", session);
+		for(int i = 0; i < numberOfRequests; ++i) {
+			newInformation.first[i] = codec.receiveNumber();
+			newInformation.second[i] = codec.receiveNumber();
+			newInformation.third[i] = codec.receiveNumber();
 		}
 	}
-	return product;
+	TraceSpan span("compute product", session);
+	return computeProduct(newInformation, numberOfRequests);
 }
 
 
 bool Server::verifyCorrectFunction(ZZ blindSignature, ZZ ID, ZZ a, ZZ c, ZZ d, ZZ r) {
-    ZZ x = GFunction::applyFunction(a, c);
 	ZZ op;
 	op = a ^ ID;
-	ZZ y = GFunction::applyFunction(op, d);
-	ZZ fResult = FFunction::applyFunction(x, y);
-	ZZ correctResult = (r * r * r * fResult) % compositeNumber;
+	// r ^ 3 * F(G(a, c), G(a ^ ID, d)) (mod n)
+	ZZ correctResult = PowerModKernel::blind(a, c, op, d, r, G_EXPONENT, F_EXPONENT, compositeNumber);
 	return correctResult == blindSignature;
 }
 
-void Server::execute(int client) { // IS it an int??
-    sendNumberToClient(compositeNumber, client);
-	if(read(client, &securityConstant, sizeof(int)) < 0) {
-		perror("Error at reading security constant from client.\n");
-		exit(1);
-	}
-	ZZ encryptedPseudonym = receiveNumberFromClient(client);
-	ZZ encryptedResponse = receiveNumberFromClient(client);
+bool Server::isWellFormedBallot(ZZ& encryptedPseudonym, ZZ& encryptedResponse, ZZ& product) {
+	// The pseudonym s is well formed when s ^ 3 = product (mod n). Since the
+	// voter sent c = s ^ 3 mod n, that is simply c = product: no decryption
+	// is needed to reject a malformed ballot. Ciphertexts must be reduced, or
+	// c + j * n would let a voter vary the transcript of the same ballot.
+	return encryptedPseudonym == product && sign(encryptedResponse) >= 0 && encryptedResponse < compositeNumber;
+}
 
-	ZZ pseudonym = decryptMessageUsingCRT(encryptedPseudonym);
-	ZZ response = decryptMessageUsingCRT(encryptedResponse);
-	int numberOfRequests = securityConstant - securityConstant / 2;
-	int requests[numberOfRequests];
-	chooseRandomRequests(requests, numberOfRequests);
-	for(int i = 0; i < numberOfRequests; ++i) {
-		if(write(client, requests + i, sizeof(int)) < 0) {
-            perror("Error at writing requests to client.\n");
-            exit(0);
-        }
+int Server::recordBallot(ZZ& pseudonym, RevealedInformation& newInformation, int numberOfRequests, ZZ& ID) {
+	long code;
+	if(!Election::decode(newInformation.vote, code)) {
+		// an answer no question offers
+		return INVALID;
 	}
-
-	RevealedInformation newInformation;
-	newInformation.vote = response;
-	ZZ product = findNewInformationAndProduct(newInformation, requests, numberOfRequests, client);
-	if(pseudonym * pseudonym * pseudonym != product) {
-		// it is not constructed correctly
-		int response = INVALID;
-		if(write(client, &response, sizeof(int)) < 0) {
-            perror("Error at writing response to client.\n");
-            exit(0);
-        }
-		return;
+	if(BallotLog::isEnabled()) {
+		// double votes are found after the election by BallotAudit, the
+		// count is provisional until then
+		BallotLog::append(pseudonym, newInformation, numberOfRequests);
+		Tally::add(code, 1);
+		return OK;
 	}
-
-	// else, all data is valid. We search for fraud.
+	// all data is valid. We search for fraud.
 	if(impostors.find(pseudonym) != impostors.end()) {
-		int responsee = FRAUD;
-		ZZ ID = impostors.find(pseudonym)->second;
-		if(write(client, &responsee, sizeof(int)) < 0) {
-			perror("Error at writing response to client.\n");
-			exit(0);
-		}
-		sendNumberToClient(ID, client);
-		newInformation.vote == 0 ? ++negativeVotes : ++positiveVotes;
-		return;
+		// a caught impostor's ballots are never counted
+		ID = impostors.find(pseudonym)->second;
+		journalFraud(pseudonym, ID, newInformation.vote, 0);
+		return FRAUD;
 	}
 	// else, he was not revealed yet
 
-	if(storedInformation.find(pseudonym) == storedInformation.end()) {
-		int responsee = OK;
-		if(write(client, &responsee, sizeof(int)) < 0) {
-            perror("Error at writing response to client.\n");
-            exit(0);
-        }
-        storedInformation[pseudonym] = newInformation;
-		return;
+	long oldBallot = storedBallots.find(pseudonym);
+	if(oldBallot < 0) {
+		if(!storedBallots.fits(newInformation, numberOfRequests)) {
+			return INVALID;
+		}
+		storedBallots.store(pseudonym, newInformation, numberOfRequests, code);
+		Tally::add(code, 1);
+		journalBallot(pseudonym, newInformation, numberOfRequests);
+		return OK;
 	}
 	// else, this is the second attempt to vote
 
-	RevealedInformation oldInformation = storedInformation[pseudonym];
-	ZZ ID;
+	int comparedRequests = min(numberOfRequests, storedBallots.numberOfRequests(oldBallot));
 	ID = 0;
-	for(int i = 0; i < numberOfRequests; ++i) {
-		if(oldInformation.requests[i] != newInformation.requests[i]) {
-			if(oldInformation.requests[i] == 1) {
-				ID = oldInformation.first[i] ^ newInformation.second[i];
+	for(int i = 0; i < comparedRequests; ++i) {
+		if(storedBallots.request(oldBallot, i) != newInformation.requests[i]) {
+			if(storedBallots.request(oldBallot, i) == 1) {
+				ID = storedBallots.revealedValue(oldBallot, i) ^ newInformation.second[i];
 			}
 			else {
-				ID = oldInformation.second[i] ^ newInformation.first[i];
+				ID = storedBallots.revealedValue(oldBallot, i) ^ newInformation.first[i];
 			}
 		}
 	}
 
-	int responsee = FRAUD;
-	if(write(client, &responsee, sizeof(int)) < 0) {
-		perror("Error at writing response to client.\n");
-		exit(0);
+	impostors[pseudonym] = ID;
+	// the first ballot was counted, take it back
+	long oldCode = storedBallots.vote(oldBallot);
+	if(oldCode >= 0) {
+		Tally::add(oldCode, -1);
 	}
-	sendNumberToClient(ID, client);
+	ZZ oldVote;
+	oldVote = oldCode;
+	journalFraud(pseudonym, ID, oldVote, -1);
+	return FRAUD;
+}
 
-	impostors[pseudonym] = ID;
-	oldInformation.vote == 0 ? --negativeVotes : --positiveVotes;
+int Server::judgeBallot(ZZ& encryptedPseudonym, ZZ& encryptedResponse, RevealedInformation& newInformation, ZZ& product, int numberOfRequests, ZZ& ID) {
+	if(!isWellFormedBallot(encryptedPseudonym, encryptedResponse, product)) {
+		// it is not constructed correctly
+		return INVALID;
+	}
+	ZZ encrypted[2] = {encryptedPseudonym, encryptedResponse}, decrypted[2];
+	ExponentiationBatcher::exponentiate(decryptionContext, encrypted, decrypted, 2);
+	newInformation.vote = decrypted[1];
+	return recordBallot(decrypted[0], newInformation, numberOfRequests, ID);
+}
+
+void Server::executeBatch(WireCodec& codec, int client) {
+	int numberOfBallots = codec.receiveInt();
+	if(codec.isBroken() || numberOfBallots < 1 || numberOfBallots > MAX_BALLOTS_PER_BATCH) {
+		return;
+	}
+	vector<BallotSubmission> ballots(numberOfBallots);
+	for(int i = 0; i < numberOfBallots; ++i) {
+		ballots[i].securityConstant = codec.receiveInt();
+		ballots[i].encryptedPseudonym = codec.receiveNumber();
+		ballots[i].encryptedResponse = codec.receiveNumber();
+		if(ballots[i].securityConstant < 1 || ballots[i].securityConstant > MAX_SECURITY_CONSTANT) {
+			return;
+		}
+		ballots[i].numberOfRequests = ballots[i].securityConstant - ballots[i].securityConstant / 2;
+	}
+	if(codec.isBroken()) {
+		return;
+	}
+
+	// the requests of every ballot go out in one message ...
+	for(int i = 0; i < numberOfBallots; ++i) {
+		int requests[ballots[i].numberOfRequests];
+		chooseRandomRequests(requests, ballots[i].numberOfRequests);
+		prepareInformation(ballots[i].information, requests, ballots[i].numberOfRequests);
+		for(int j = 0; j < ballots[i].numberOfRequests; ++j) {
+			codec.sendInt(requests[j]);
+		}
+	}
+	// ... and the revealed information of every ballot comes back in one
+	codec.setDeadline(replyDeadline);
+	for(int i = 0; i < numberOfBallots; ++i) {
+		for(int j = 0; j < ballots[i].numberOfRequests; ++j) {
+			ballots[i].information.first[j] = codec.receiveNumber();
+			ballots[i].information.second[j] = codec.receiveNumber();
+			ballots[i].information.third[j] = codec.receiveNumber();
+		}
+	}
+	if(codec.isBroken()) {
+		return;
+	}
+
+	// Checking and decrypting a ballot only reads the key, so the ballots are
+	// spread over the compute threads. Recording them touches the shared maps
+	// and tallies, so that part stays in submission order on this thread.
+	TaskScheduler::parallelFor(numberOfBallots, [&](int i) {
+		ZZ product = computeProduct(ballots[i].information, ballots[i].numberOfRequests);
+		ballots[i].wellFormed = isWellFormedBallot(ballots[i].encryptedPseudonym, ballots[i].encryptedResponse, product);
+	});
+	// the decryptions of all the well formed ballots go out together, so
+	// --multi-buffer can fill its lanes
+	vector<ZZ> encrypted, decrypted;
+	for(int i = 0; i < numberOfBallots; ++i) {
+		if(ballots[i].wellFormed) {
+			encrypted.push_back(ballots[i].encryptedPseudonym);
+			encrypted.push_back(ballots[i].encryptedResponse);
+		}
+	}
+	decrypted.resize(encrypted.size());
+	ExponentiationBatcher::exponentiate(decryptionContext, encrypted.data(), decrypted.data(), encrypted.size());
+	for(int i = 0, next = 0; i < numberOfBallots; ++i) {
+		if(ballots[i].wellFormed) {
+			ballots[i].pseudonym = decrypted[next++];
+			ballots[i].information.vote = decrypted[next++];
+		}
+	}
+	vector<int> verdicts(numberOfBallots, INVALID);
+	vector<ZZ> IDs(numberOfBallots);
+	for(int i = 0; i < numberOfBallots; ++i) {
+		if(ballots[i].wellFormed) {
+			verdicts[i] = recordBallot(ballots[i].pseudonym, ballots[i].information, ballots[i].numberOfRequests, IDs[i]);
+		}
+	}
+	// one journal sync covers the whole batch
+	vector<unsigned char> reply;
+	for(int i = 0; i < numberOfBallots; ++i) {
+		WireCodec::appendInt(reply, verdicts[i]);
+		if(verdicts[i] == FRAUD) {
+			WireCodec::appendNumber(reply, IDs[i]);
+		}
+	}
+	replyWhenDurable(codec, client, reply);
+}
+
+void Server::execute(int client) { // IS it an int??
+	long session = Trace::newSession();
+	TraceSpan vote("vote", session);
+	WireCodec codec(client);
+	SessionMetrics<WireCodec> metrics(codec);
+	codec.sendNumber(compositeNumber);
+	ZZ nonce, encryptedPseudonym, encryptedResponse;
+	bool version2, nonInteractive;
+	// the next voter waits behind this one, a stalled voter can't keep it waiting
+	codec.setDeadline(requestDeadline);
+	{
+		TraceSpan span("receive ballot", session);
+		securityConstant = codec.receiveInt();
+		nonInteractive = securityConstant == PROTOCOL_NONINTERACTIVE;
+		version2 = securityConstant == PROTOCOL_V2 || nonInteractive;
+		if(nonInteractive) {
+			// only a non-interactive ballot gets a nonce, so older clients
+			// see the greeting they expect
+			nonce = RandomBits_ZZ(BALLOT_NONCE_BITS);
+			codec.sendNumber(nonce);
+		}
+		if(version2) {
+			securityConstant = codec.receiveInt();
+		}
+		if(securityConstant == BATCH_SUBMISSION) {
+			executeBatch(codec, client);
+			metrics.outcome = SESSIONS_COMPLETED;
+			return;
+		}
+		encryptedPseudonym = codec.receiveNumber();
+		encryptedResponse = codec.receiveNumber();
+	}
+	if(codec.isBroken() || securityConstant < 1 || securityConstant > MAX_SECURITY_CONSTANT
+		|| (nonInteractive && securityConstant < FIAT_SHAMIR_MIN_SECURITY_CONSTANT)) {
+		return;
+	}
 
-	return ;
+	int numberOfRequests = securityConstant - securityConstant / 2;
+	int requests[numberOfRequests];
+	if(nonInteractive) {
+		// the revealed values are already on their way
+		deriveRequests(requests, securityConstant, nonce, encryptedPseudonym, encryptedResponse);
+	}
+	else if(version2) {
+		chooseRandomRequests(requests, numberOfRequests);
+		codec.sendBits(requests, numberOfRequests);
+	}
+	else {
+		chooseRandomRequests(requests, numberOfRequests);
+		for(int i = 0; i < numberOfRequests; ++i) {
+			codec.sendInt(requests[i]);
+		}
+	}
+
+	RevealedInformation newInformation;
+	codec.setDeadline(replyDeadline);
+	ZZ product = findNewInformationAndProduct(newInformation, requests, numberOfRequests, codec, session);
+	if(codec.isBroken()) {
+		return;
+	}
+	ZZ ID;
+	int verdict;
+	{
+		TraceSpan span("judge ballot", session);
+		verdict = judgeBallot(encryptedPseudonym, encryptedResponse, newInformation, product, numberOfRequests, ID);
+	}
+	metrics.outcome = verdictCounter(verdict);
+	TraceSpan span("send verdict", session);
+	vector<unsigned char> reply;
+	WireCodec::appendInt(reply, verdict);
+	if(verdict == FRAUD) {
+		WireCodec::appendNumber(reply, ID);
+	}
+	replyWhenDurable(codec, client, reply);
 }
@@ -0,0 +1,633 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+#include "Server.h"
+
+#define MAX_EVENTS 256
+#define READ_CHUNK 4096
+
+// Every voting session is a small state machine. The engine feeds it whatever
+// bytes arrived on its socket and it advances as far as the buffered input
+// allows, so a single thread keeps any number of sessions in flight.
+enum SessionState {
+    AWAITING_SECURITY_CONSTANT,
+    AWAITING_PSEUDONYM,
+    AWAITING_RESPONSE,
+    AWAITING_REVEALED_INFORMATION,
+    AWAITING_DECRYPTION, // well formed, decrypted with the round's other ballots
+    AWAITING_DURABILITY, // verdict ready, held back until the ballot is journaled
+    SENDING_VERDICT
+};
+
+class Session {
+public:
+    int client;
+    SessionState state;
+    vector<unsigned char> input;
+    size_t inputOffset; // bytes of input already consumed
+    vector<unsigned char> output;
+    size_t outputOffset; // bytes of output already written
+    bool watchingOutput;
+    bool version2;
+    bool nonInteractive;
+    int securityConstant;
+    int numberOfRequests;
+    int receivedNumbers; // revealed values received so far, three per request
+    long deadline; // steady clock milliseconds the current phase ends at, 0 for none
+    ZZ nonce; // sent after PROTOCOL_NONINTERACTIVE, see Server::deriveRequests
+    ZZ encryptedPseudonym, encryptedResponse;
+    RevealedInformation information;
+    long journalSequence, ballotLogSequence; // must be durable before the verdict goes out
+};
+
+map<int, Session*> sessions;
+vector<int> heldDecryptions; // clients in AWAITING_DECRYPTION
+vector<int> heldVerdicts; // clients in AWAITING_DURABILITY
+int epollDescriptor;
+vector<int> adoptedClients; // sessions opened by gateways, not yet seen by the engine
+mutex adoptedClientsMutex;
+int adoptionDescriptor = eventfd(0, EFD_NONBLOCK); // wakes the engine up for adoptedClients
+int durabilityDescriptor = eventfd(0, EFD_NONBLOCK); // written by the commit threads, see releaseVerdicts
+std::set<pair<long, int> > deadlines; // (deadline, client) of every session that has one
+int timerDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK); // fires at the earliest deadline
+long armedDeadline = 0; // the deadline timerDescriptor is set for, 0 for none
+
+class SessionEngine {
+private:
+    static void setNonBlocking(int descriptor);
+    static long steadyMilliseconds();
+    static void setDeadline(Session* session, long milliseconds);
+    static void armTimer();
+    static void expireSessions();
+    static void watch(Session* session);
+    static void closeSession(Session* session);
+    static void startSession(int client);
+    static void acceptClients(int sd);
+    static void adoptClients();
+    static int takeInt(Session* session, int& value);
+    static int takeNumber(Session* session, ZZ& number);
+    static size_t inputLimit(Session* session);
+    static bool receive(Session* session);
+    static bool flush(Session* session);
+    static bool advance(Session* session);
+    static void setVerdict(Session* session, int verdict, ZZ& ID);
+    static void handle(Session* session, unsigned int events);
+    static void decryptBallots();
+    static void releaseVerdicts();
+
+public:
+    static void adopt(int client);
+    static void run(int sd);
+};
+
+void SessionEngine::setNonBlocking(int descriptor) {
+    int flags = fcntl(descriptor, F_GETFL, 0);
+    fcntl(descriptor, F_SETFL, flags | O_NONBLOCK);
+}
+
+long SessionEngine::steadyMilliseconds() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The phase a session enters gets milliseconds from now, 0 for none, like
+// WireCodec::setDeadline does for Server::execute.
+void SessionEngine::setDeadline(Session* session, long milliseconds) {
+    if(session->deadline != 0) {
+        deadlines.erase(make_pair(session->deadline, session->client));
+    }
+    session->deadline = milliseconds > 0 ? steadyMilliseconds() + milliseconds : 0;
+    if(session->deadline != 0) {
+        deadlines.insert(make_pair(session->deadline, session->client));
+    }
+}
+
+// One timer serves every session: after each round of events it is set for
+// the earliest deadline left.
+void SessionEngine::armTimer() {
+    long earliest = deadlines.empty() ? 0 : deadlines.begin()->first;
+    if(earliest == armedDeadline) {
+        return;
+    }
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer)); // all zero disarms it
+    if(earliest != 0) {
+        long remaining = max(earliest - steadyMilliseconds(), 1L);
+        timer.it_value.tv_sec = remaining / 1000;
+        timer.it_value.tv_nsec = remaining % 1000 * 1000000;
+    }
+    if(timerfd_settime(timerDescriptor, 0, &timer, NULL) < 0) {
+        perror("Error at setting the session timer.\n");
+        return;
+    }
+    armedDeadline = earliest;
+}
+
+// A voter that lets the deadline of its phase pass is cut off, the way the
+// codec of Server::execute gives up on it.
+void SessionEngine::expireSessions() {
+    uint64_t expirations;
+    armedDeadline = 0;
+    if(read(timerDescriptor, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+    long now = steadyMilliseconds();
+    while(!deadlines.empty() && deadlines.begin()->first <= now) {
+        map<int, Session*>::iterator found = sessions.find(deadlines.begin()->second);
+        if(found == sessions.end()) {
+            deadlines.erase(deadlines.begin());
+            continue;
+        }
+        Metrics::count(SESSIONS_TIMED_OUT);
+        closeSession(found->second);
+    }
+}
+
+void SessionEngine::watch(Session* session) {
+    // we only ask for writability while there is something left to send,
+    // otherwise a level-triggered epoll would wake us up for nothing
+    bool pendingOutput = session->outputOffset < session->output.size();
+    if(pendingOutput == session->watchingOutput) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | (pendingOutput ? EPOLLOUT : 0);
+    event.data.fd = session->client;
+    epoll_ctl(epollDescriptor, EPOLL_CTL_MOD, session->client, &event);
+    session->watchingOutput = pendingOutput;
+}
+
+void SessionEngine::closeSession(Session* session) {
+    Metrics::count(SESSIONS_FINISHED);
+    setDeadline(session, 0);
+    epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, session->client, NULL);
+    close(session->client);
+    sessions.erase(session->client);
+    delete session;
+}
+
+void SessionEngine::startSession(int client) {
+    setNonBlocking(client);
+
+    Session* session = new Session();
+    session->client = client;
+    session->state = AWAITING_SECURITY_CONSTANT;
+    session->inputOffset = 0;
+    session->outputOffset = 0;
+    session->watchingOutput = false;
+    session->receivedNumbers = 0;
+    session->deadline = 0;
+    session->version2 = false;
+    session->nonInteractive = false;
+    sessions[client] = session;
+    Metrics::count(SESSIONS_STARTED);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = client;
+    if(epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, client, &event) < 0) {
+        perror("Error at registering client.\n");
+        close(client);
+        sessions.erase(client);
+        delete session;
+        Metrics::count(SESSIONS_FINISHED);
+        return;
+    }
+    setDeadline(session, requestDeadline);
+    // the session starts by sending the composite number
+    WireCodec::appendNumber(session->output, compositeNumber);
+    if(!flush(session)) {
+        closeSession(session);
+        return;
+    }
+    watch(session);
+}
+
+void SessionEngine::acceptClients(int sd) {
+    while(true) {
+        int client = accept(sd, NULL, NULL);
+        if(client < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error at accepting client.\n");
+            }
+            return;
+        }
+        startSession(client);
+    }
+}
+
+// Called from a gateway's pump thread; the engine starts the session on its
+// own thread, like an accepted client.
+void SessionEngine::adopt(int client) {
+    {
+        lock_guard<mutex> lock(adoptedClientsMutex);
+        adoptedClients.push_back(client);
+    }
+    uint64_t one = 1;
+    if(write(adoptionDescriptor, &one, sizeof(one)) < 0) {
+        perror("Error at waking the session engine.\n");
+    }
+}
+
+void SessionEngine::adoptClients() {
+    uint64_t count;
+    if(read(adoptionDescriptor, &count, sizeof(count)) < 0) {
+        return;
+    }
+    vector<int> clients;
+    {
+        lock_guard<mutex> lock(adoptedClientsMutex);
+        clients.swap(adoptedClients);
+    }
+    for(size_t i = 0; i < clients.size(); ++i) {
+        startSession(clients[i]);
+    }
+}
+
+int SessionEngine::takeInt(Session* session, int& value) {
+    if(session->input.size() - session->inputOffset < sizeof(int)) {
+        return FRAME_INCOMPLETE;
+    }
+    memcpy(&value, session->input.data() + session->inputOffset, sizeof(int));
+    session->inputOffset += sizeof(int);
+    return FRAME_COMPLETE;
+}
+
+int SessionEngine::takeNumber(Session* session, ZZ& number) {
+    size_t consumed = 0;
+    int status = WireCodec::parseNumber(session->input.data() + session->inputOffset,
+        session->input.size() - session->inputOffset, number, consumed);
+    session->inputOffset += consumed;
+    return status;
+}
+
+// The most unconsumed input a voter can have sent in the session's state: it
+// only sends ahead up to the next message it has to wait for, and no number
+// is longer than n. Anything past this is not a ballot, so it isn't buffered.
+size_t SessionEngine::inputLimit(Session* session) {
+    size_t number = sizeof(long) + NumBytes(compositeNumber);
+    switch(session->state) {
+    case AWAITING_SECURITY_CONSTANT:
+    case AWAITING_PSEUDONYM:
+    case AWAITING_RESPONSE: {
+        // the protocol, k, the encrypted pseudonym and response
+        size_t limit = 2 * sizeof(int) + 2 * number;
+        if(session->nonInteractive) {
+            // followed directly by the revealed values
+            int requests = session->state == AWAITING_SECURITY_CONSTANT
+                ? MAX_SECURITY_CONSTANT - MAX_SECURITY_CONSTANT / 2 : session->numberOfRequests;
+            limit += 3 * requests * number;
+        }
+        return limit;
+    }
+    case AWAITING_REVEALED_INFORMATION:
+        return 3 * session->numberOfRequests * number;
+    default:
+        // ignored by advance anyway
+        return READ_CHUNK;
+    }
+}
+
+// Reads until the socket is drained or the input passed inputLimit, which
+// handle checks.
+bool SessionEngine::receive(Session* session) {
+    unsigned char chunk[READ_CHUNK];
+    size_t limit = inputLimit(session);
+    while(session->input.size() - session->inputOffset <= limit) {
+        ssize_t received = read(session->client, chunk, READ_CHUNK);
+        Metrics::count(SESSION_SYSCALLS);
+        if(received > 0) {
+            Metrics::count(SESSION_BYTES_READ, received);
+            session->input.insert(session->input.end(), chunk, chunk + received);
+            continue;
+        }
+        if(received == 0) {
+            // the voter hung up before the session was over
+            return false;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    return true;
+}
+
+bool SessionEngine::flush(Session* session) {
+    while(session->outputOffset < session->output.size()) {
+        ssize_t written = write(session->client, session->output.data() + session->outputOffset,
+            session->output.size() - session->outputOffset);
+        Metrics::count(SESSION_SYSCALLS);
+        if(written < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        Metrics::count(SESSION_BYTES_WRITTEN, written);
+        session->outputOffset += written;
+    }
+    session->output.clear();
+    session->outputOffset = 0;
+    return true;
+}
+
+bool SessionEngine::advance(Session* session) {
+    while(true) {
+        int status;
+        switch(session->state) {
+        case AWAITING_SECURITY_CONSTANT:
+            status = takeInt(session, session->securityConstant);
+            if(status != FRAME_COMPLETE) {
+                return status != FRAME_MALFORMED;
+            }
+            if((session->securityConstant == PROTOCOL_V2 || session->securityConstant == PROTOCOL_NONINTERACTIVE)
+                && !session->version2) {
+                // the real security constant follows
+                session->version2 = true;
+                session->nonInteractive = session->securityConstant == PROTOCOL_NONINTERACTIVE;
+                if(session->nonInteractive) {
+                    session->nonce = RandomBits_ZZ(BALLOT_NONCE_BITS);
+                    WireCodec::appendNumber(session->output, session->nonce);
+                }
+                break;
+            }
+            // batched submissions (BATCH_SUBMISSION) are only served by Server::execute
+            if(session->securityConstant < 1 || session->securityConstant > MAX_SECURITY_CONSTANT
+                || (session->nonInteractive && session->securityConstant < FIAT_SHAMIR_MIN_SECURITY_CONSTANT)) {
+                return false;
+            }
+            session->numberOfRequests = session->securityConstant - session->securityConstant / 2;
+            session->state = AWAITING_PSEUDONYM;
+            break;
+
+        case AWAITING_PSEUDONYM:
+            status = takeNumber(session, session->encryptedPseudonym);
+            if(status != FRAME_COMPLETE) {
+                return status != FRAME_MALFORMED;
+            }
+            session->state = AWAITING_RESPONSE;
+            break;
+
+        case AWAITING_RESPONSE: {
+            status = takeNumber(session, session->encryptedResponse);
+            if(status != FRAME_COMPLETE) {
+                return status != FRAME_MALFORMED;
+            }
+            int requests[session->numberOfRequests];
+            if(session->nonInteractive) {
+                Server::deriveRequests(requests, session->securityConstant, session->nonce,
+                    session->encryptedPseudonym, session->encryptedResponse);
+            }
+            else {
+                Server::chooseRandomRequests(requests, session->numberOfRequests);
+            }
+            Server::prepareInformation(session->information, requests, session->numberOfRequests);
+            // a non-interactive ballot is followed directly by its revealed values
+            if(session->version2 && !session->nonInteractive) {
+                WireCodec::appendBits(session->output, requests, session->numberOfRequests);
+            }
+            else if(!session->version2) {
+                for(int i = 0; i < session->numberOfRequests; ++i) {
+                    WireCodec::appendInt(session->output, requests[i]);
+                }
+            }
+            // the reply deadline also covers sending the verdict back
+            setDeadline(session, replyDeadline);
+            session->state = AWAITING_REVEALED_INFORMATION;
+            break;
+        }
+
+        case AWAITING_REVEALED_INFORMATION: {
+            while(session->receivedNumbers < 3 * session->numberOfRequests) {
+                int index = session->receivedNumbers / 3;
+                ZZ* target;
+                if(session->receivedNumbers % 3 == 0) {
+                    target = &session->information.first[index];
+                }
+                else if(session->receivedNumbers % 3 == 1) {
+                    target = &session->information.second[index];
+                }
+                else {
+                    target = &session->information.third[index];
+                }
+                status = takeNumber(session, *target);
+                if(status != FRAME_COMPLETE) {
+                    return status != FRAME_MALFORMED;
+                }
+                ++session->receivedNumbers;
+            }
+            ZZ product = Server::computeProduct(session->information, session->numberOfRequests);
+            if(!Server::isWellFormedBallot(session->encryptedPseudonym, session->encryptedResponse, product)) {
+                ZZ ID;
+                setVerdict(session, INVALID, ID);
+                break;
+            }
+            session->state = AWAITING_DECRYPTION;
+            break;
+        }
+
+        case AWAITING_DECRYPTION:
+        case AWAITING_DURABILITY:
+        case SENDING_VERDICT:
+            // anything the client sends after its revealed information is ignored
+            session->inputOffset = session->input.size();
+            return true;
+        }
+
+        // drop consumed input so the buffer doesn't grow over the session
+        if(session->inputOffset > READ_CHUNK) {
+            session->input.erase(session->input.begin(), session->input.begin() + session->inputOffset);
+            session->inputOffset = 0;
+        }
+    }
+}
+
+void SessionEngine::setVerdict(Session* session, int verdict, ZZ& ID) {
+    Metrics::count(Server::verdictCounter(verdict));
+    WireCodec::appendInt(session->output, verdict);
+    if(verdict == FRAUD) {
+        WireCodec::appendNumber(session->output, ID);
+    }
+    session->journalSequence = VoteJournal::isEnabled() ? VoteJournal::appended() : 0;
+    session->ballotLogSequence = BallotLog::isEnabled() ? BallotLog::appended() : 0;
+    session->state = SENDING_VERDICT;
+    if(VoteJournal::isEnabled() || BallotLog::isEnabled()) {
+        session->state = AWAITING_DURABILITY;
+        heldVerdicts.push_back(session->client);
+    }
+}
+
+void SessionEngine::handle(Session* session, unsigned int events) {
+    bool alive = true;
+    if(events & EPOLLIN) {
+        bool connected = receive(session);
+        if(session->input.size() - session->inputOffset > inputLimit(session)) {
+            Metrics::count(SESSIONS_OVERSIZED);
+            closeSession(session);
+            return;
+        }
+        alive = advance(session);
+        // a voter may close right after its last message: the frames read
+        // with the EOF still count if they completed the ballot
+        bool answered = session->state >= AWAITING_DECRYPTION;
+        alive = alive && (connected || answered);
+    }
+    else if(events & (EPOLLERR | EPOLLHUP)) {
+        alive = false;
+    }
+    if(alive && session->state == AWAITING_DECRYPTION) {
+        heldDecryptions.push_back(session->client);
+        return;
+    }
+    if(alive && session->state == AWAITING_DURABILITY) {
+        return;
+    }
+    if(alive) {
+        alive = flush(session);
+    }
+    if(!alive || (session->state == SENDING_VERDICT && session->output.empty())) {
+        closeSession(session);
+        return;
+    }
+    watch(session);
+}
+
+// The ballots completed during one round of events are decrypted together,
+// two ciphertexts each, so the compute threads (and with --multi-buffer the
+// SIMD lanes) are shared across sessions. Recording them touches the shared
+// maps and tallies, so that part stays on this thread, in arrival order.
+void SessionEngine::decryptBallots() {
+    if(heldDecryptions.empty()) {
+        return;
+    }
+    vector<Session*> ballots;
+    for(size_t i = 0; i < heldDecryptions.size(); ++i) {
+        map<int, Session*>::iterator found = sessions.find(heldDecryptions[i]);
+        if(found != sessions.end() && found->second->state == AWAITING_DECRYPTION) {
+            ballots.push_back(found->second);
+        }
+    }
+    heldDecryptions.clear();
+    vector<ZZ> encrypted(2 * ballots.size()), decrypted(2 * ballots.size());
+    for(size_t i = 0; i < ballots.size(); ++i) {
+        encrypted[2 * i] = ballots[i]->encryptedPseudonym;
+        encrypted[2 * i + 1] = ballots[i]->encryptedResponse;
+    }
+    ExponentiationBatcher::exponentiate(decryptionContext, encrypted.data(), decrypted.data(), encrypted.size());
+    for(size_t i = 0; i < ballots.size(); ++i) {
+        ZZ ID;
+        ballots[i]->information.vote = decrypted[2 * i + 1];
+        int verdict = Server::recordBallot(decrypted[2 * i], ballots[i]->information, ballots[i]->numberOfRequests, ID);
+        setVerdict(ballots[i], verdict, ID);
+        handle(ballots[i], 0);
+    }
+}
+
+// Sends the held verdicts whose ballots are on disk by now. The commit
+// threads sync in the background and write durabilityDescriptor when they
+// are done, so the engine never waits for the disk and every verdict judged
+// while one sync runs goes out after the next.
+void SessionEngine::releaseVerdicts() {
+    if(heldVerdicts.empty()) {
+        return;
+    }
+    long journalDurable = VoteJournal::durable();
+    long ballotLogDurable = BallotLog::durable();
+    vector<int> clients;
+    clients.swap(heldVerdicts);
+    for(size_t i = 0; i < clients.size(); ++i) {
+        map<int, Session*>::iterator found = sessions.find(clients[i]);
+        if(found == sessions.end() || found->second->state != AWAITING_DURABILITY) {
+            continue;
+        }
+        Session* session = found->second;
+        if(session->journalSequence > journalDurable || session->ballotLogSequence > ballotLogDurable) {
+            heldVerdicts.push_back(session->client);
+            continue;
+        }
+        session->state = SENDING_VERDICT;
+        handle(session, 0);
+    }
+}
+
+void SessionEngine::run(int sd) {
+    setNonBlocking(sd);
+    epollDescriptor = epoll_create1(0);
+    if(epollDescriptor < 0) {
+        perror("Error at creating epoll instance.\n");
+        exit(0);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = sd;
+    if(epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, sd, &event) < 0) {
+        perror("Error at registering listening socket.\n");
+        exit(0);
+    }
+    event.events = EPOLLIN;
+    event.data.fd = adoptionDescriptor;
+    if(adoptionDescriptor < 0 || epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, adoptionDescriptor, &event) < 0) {
+        perror("Error at registering gateway sessions.\n");
+        exit(0);
+    }
+    event.events = EPOLLIN;
+    event.data.fd = durabilityDescriptor;
+    if(durabilityDescriptor < 0 || epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, durabilityDescriptor, &event) < 0) {
+        perror("Error at registering the commit threads.\n");
+        exit(0);
+    }
+    VoteJournal::notify(durabilityDescriptor);
+    BallotLog::notify(durabilityDescriptor);
+    event.events = EPOLLIN;
+    event.data.fd = timerDescriptor;
+    if(timerDescriptor < 0 || epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, timerDescriptor, &event) < 0) {
+        perror("Error at registering the session timer.\n");
+        exit(0);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while(true) {
+        int numberOfEvents = epoll_wait(epollDescriptor, events, MAX_EVENTS, -1);
+        if(numberOfEvents < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Error at waiting for events.\n");
+            exit(0);
+        }
+        for(int i = 0; i < numberOfEvents; ++i) {
+            if(events[i].data.fd == sd) {
+                acceptClients(sd);
+                continue;
+            }
+            if(events[i].data.fd == adoptionDescriptor) {
+                adoptClients();
+                continue;
+            }
+            if(events[i].data.fd == timerDescriptor) {
+                expireSessions();
+                continue;
+            }
+            if(events[i].data.fd == durabilityDescriptor) {
+                // the held verdicts are released after the round
+                uint64_t count;
+                if(read(durabilityDescriptor, &count, sizeof(count)) < 0) {
+                    perror("Error at reading the commit threads' wakeup.\n");
+                }
+                continue;
+            }
+            map<int, Session*>::iterator found = sessions.find(events[i].data.fd);
+            if(found != sessions.end()) {
+                handle(found->second, events[i].events);
+            }
+        }
+        decryptBallots();
+        releaseVerdicts();
+        armTimer();
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include "Election.h"
+
+using namespace std;
+
+// The running totals of one thread, one counter per option of every
+// question. Only the owner writes. It makes sequence odd while it applies a
+// ballot and even again afterwards, so a reader that copied the counters
+// between two equal even values saw whole ballots only, and a reader never
+// makes the owner wait.
+class TallyShard {
+public:
+    atomic<unsigned long> sequence;
+    unique_ptr<atomic<long>[]> counts;
+
+    TallyShard(long numberOfTallies) : sequence(0), counts(new atomic<long>[numberOfTallies]) {
+        for(long i = 0; i < numberOfTallies; ++i) {
+            counts[i] = 0;
+        }
+    }
+};
+
+vector<TallyShard*> tallyShards; // never freed, a reader may still copy them
+mutex tallyShardsMutex;
+thread_local TallyShard* threadTallyShard = NULL;
+
+// Per-question tallies, sharded per thread and merged when read.
+class Tally {
+private:
+    static TallyShard* shard();
+    static void apply(const long* indexes, const long* deltas, size_t count);
+
+public:
+    static void add(long code, int delta);
+    static void addTotals(const vector<long>& totals);
+    static void snapshot(vector<long>& totals);
+    static long ballots(const vector<long>& totals);
+    static string exposition();
+};
+
+TallyShard* Tally::shard() {
+    if(threadTallyShard == NULL) {
+        threadTallyShard = new TallyShard(Election::numberOfTallies());
+        lock_guard<mutex> lock(tallyShardsMutex);
+        tallyShards.push_back(threadTallyShard);
+    }
+    return threadTallyShard;
+}
+
+void Tally::apply(const long* indexes, const long* deltas, size_t count) {
+    TallyShard* owner = shard();
+    unsigned long sequence = owner->sequence.load(memory_order_relaxed);
+    owner->sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for(size_t i = 0; i < count; ++i) {
+        atomic<long>& value = owner->counts[indexes[i]];
+        value.store(value.load(memory_order_relaxed) + deltas[i], memory_order_relaxed);
+    }
+    owner->sequence.store(sequence + 2, memory_order_release);
+}
+
+// Counts (delta 1) or takes back (delta -1) the answers of one ballot.
+void Tally::add(long code, int delta) {
+    long indexes[MAX_QUESTIONS], deltas[MAX_QUESTIONS];
+    int numberOfQuestions = Election::numberOfQuestions();
+    Election::tallyIndexes(code, indexes);
+    for(int q = 0; q < numberOfQuestions; ++q) {
+        deltas[q] = delta;
+    }
+    apply(indexes, deltas, numberOfQuestions);
+}
+
+void Tally::addTotals(const vector<long>& totals) {
+    vector<long> indexes(totals.size());
+    for(size_t i = 0; i < totals.size(); ++i) {
+        indexes[i] = i;
+    }
+    apply(indexes.data(), totals.data(), totals.size());
+}
+
+void Tally::snapshot(vector<long>& totals) {
+    vector<TallyShard*> shards;
+    {
+        lock_guard<mutex> lock(tallyShardsMutex);
+        shards = tallyShards;
+    }
+    long numberOfTallies = Election::numberOfTallies();
+    totals.assign(numberOfTallies, 0);
+    vector<long> copied(numberOfTallies);
+    for(size_t s = 0; s < shards.size(); ++s) {
+        while(true) {
+            unsigned long before = shards[s]->sequence.load(memory_order_acquire);
+            if(before % 2 == 1) {
+                continue; // the owner is in the middle of a ballot
+            }
+            for(long i = 0; i < numberOfTallies; ++i) {
+                copied[i] = shards[s]->counts[i].load(memory_order_relaxed);
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if(shards[s]->sequence.load(memory_order_relaxed) == before) {
+                break;
+            }
+        }
+        for(long i = 0; i < numberOfTallies; ++i) {
+            totals[i] += copied[i];
+        }
+    }
+}
+
+long Tally::ballots(const vector<long>& totals) {
+    // every counted ballot answered the first question exactly once
+    long ballots = 0;
+    for(int option = 0; option < Election::numberOfOptions(0); ++option) {
+        ballots += totals[Election::tallyIndex(0, option)];
+    }
+    return ballots;
+}
+
+// The totals in the Prometheus text format, served next to the Metrics.
+string Tally::exposition() {
+    vector<long> totals;
+    snapshot(totals);
+    string body;
+    char line[128];
+    snprintf(line, sizeof(line), "evote_ballots_counted %ld\n", ballots(totals));
+    body += line;
+    for(int q = 0; q < Election::numberOfQuestions(); ++q) {
+        for(int option = 0; option < Election::numberOfOptions(q); ++option) {
+            snprintf(line, sizeof(line), "evote_tally{question=\"%d\",option=\"%d\"} %ld\n",
+                q, option, totals[Election::tallyIndex(q, option)]);
+            body += line;
+        }
+    }
+    return body;
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+// A loop whose iterations are shared between the compute threads and the
+// thread that asked for it. The caller always takes part, so a parallelFor
+// issued while every compute thread is busy still makes progress.
+// An iteration returning false cancels the batch: iterations claimed after
+// that are skipped.
+class Batch {
+public:
+    function<bool(int)> task;
+    int count;
+    atomic<int> next;
+    atomic<int> finished;
+    atomic<bool> cancelled;
+    mutex finishedMutex;
+    condition_variable allFinished;
+};
+
+deque<shared_ptr<Batch> > pendingBatches;
+mutex pendingBatchesMutex;
+condition_variable pendingBatchesAvailable;
+vector<thread> computeThreads;
+
+class TaskScheduler {
+private:
+    static void work();
+    static void runBatch(Batch& batch);
+    static void retire(shared_ptr<Batch>& batch);
+
+public:
+    static void start(int numberOfThreads);
+    static void parallelFor(int count, function<void(int)> task);
+    static bool parallelAll(int count, function<bool(int)> predicate);
+};
+
+void TaskScheduler::start(int numberOfThreads) {
+    for(int i = 0; i < numberOfThreads; ++i) {
+        computeThreads.push_back(thread(work));
+    }
+}
+
+void TaskScheduler::runBatch(Batch& batch) {
+    int index;
+    while((index = batch.next++) < batch.count) {
+        if(!batch.cancelled && !batch.task(index)) {
+            batch.cancelled = true;
+        }
+        if(++batch.finished == batch.count) {
+            lock_guard<mutex> lock(batch.finishedMutex);
+            batch.allFinished.notify_all();
+        }
+    }
+}
+
+void TaskScheduler::work() {
+    while(true) {
+        shared_ptr<Batch> batch;
+        {
+            unique_lock<mutex> lock(pendingBatchesMutex);
+            pendingBatchesAvailable.wait(lock, [] { return !pendingBatches.empty(); });
+            batch = pendingBatches.front();
+        }
+        runBatch(*batch);
+        retire(batch);
+    }
+}
+
+void TaskScheduler::retire(shared_ptr<Batch>& batch) {
+    // every iteration is claimed, whoever notices first retires the batch
+    lock_guard<mutex> lock(pendingBatchesMutex);
+    deque<shared_ptr<Batch> >::iterator found = find(pendingBatches.begin(), pendingBatches.end(), batch);
+    if(found != pendingBatches.end()) {
+        pendingBatches.erase(found);
+    }
+}
+
+void TaskScheduler::parallelFor(int count, function<void(int)> task) {
+    parallelAll(count, [&task](int i) {
+        task(i);
+        return true;
+    });
+}
+
+// Runs predicate(0) ... predicate(count - 1) and tells whether all of them
+// held, stopping as soon as one of them doesn't.
+bool TaskScheduler::parallelAll(int count, function<bool(int)> predicate) {
+    if(count <= 1 || computeThreads.empty()) {
+        for(int i = 0; i < count; ++i) {
+            if(!predicate(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    shared_ptr<Batch> batch(new Batch());
+    batch->task = predicate;
+    batch->count = count;
+    batch->next = 0;
+    batch->finished = 0;
+    batch->cancelled = false;
+    {
+        lock_guard<mutex> lock(pendingBatchesMutex);
+        pendingBatches.push_back(batch);
+    }
+    pendingBatchesAvailable.notify_all();
+
+    runBatch(*batch);
+    retire(batch);
+    unique_lock<mutex> lock(batch->finishedMutex);
+    batch->allFinished.wait(lock, [&batch] { return batch->finished == batch->count; });
+    return !batch->cancelled;
+}
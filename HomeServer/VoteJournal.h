@@ -0,0 +1,649 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "WireCodec.h"
+#include "Election.h"
+
+#define JOURNAL_BALLOT 1
+#define JOURNAL_FRAUD 2
+
+#define JOURNAL_PREFIX "votes.journal."
+#define SNAPSHOT_NAME "votes.snapshot"
+#define SNAPSHOT_MAGIC "EVOTESNP"
+#define SNAPSHOT_VERSION 2 // 1 only had the totals of a single yes/no question
+#define JOURNAL_SEGMENT_BYTES (64L << 20)
+#define COMPACTION_RATIO 8 // segments wait until they hold 1 / COMPACTION_RATIO of the snapshot
+#define COMPACTION_BUFFER_BYTES (1L << 20)
+
+using namespace std;
+using namespace NTL;
+
+// One event that changed the vote state: a ballot stored for a new pseudonym,
+// or a fraud (a pseudonym caught voting twice, or an impostor voting again).
+// A stored ballot always counts once for the answers in `vote`; delta is what
+// a fraud did on top of that (-1 when the stored ballot was taken back).
+class JournalRecord {
+public:
+    int type;
+    ZZ pseudonym;
+    ZZ ID;
+    ZZ vote;
+    int delta;
+    vector<int> requests;
+    vector<ZZ> first, second, third;
+};
+
+// Fixed-size head of votes.snapshot. It is followed by numberOfTallies fraud
+// deltas summed per answer (see Election), then numberOfBallots ballot records
+// sorted by pseudonym, then numberOfImpostors fraud records sorted the same
+// way, all in the journal's record encoding.
+class SnapshotHeader {
+public:
+    char magic[8];
+    int version;
+    int numberOfTallies; // 0 in version 1
+    long compactedThroughSegment;
+    long positiveVotes; // version 1 only, the YES and NO sums of the single question
+    long negativeVotes;
+    long numberOfBallots;
+    long numberOfImpostors;
+};
+
+string journalDirectory;
+int journalDescriptor = -1;
+long journalSegment;
+long journalSegmentBytes;
+vector<unsigned char> pendingRecords; // appended but not yet handed to the disk
+long appendedSequence = 0, durableSequence = 0;
+int journalNotifyDescriptor = -1; // an eventfd written whenever durableSequence moves
+mutex journalMutex;
+condition_variable journalWork, journalDurable;
+deque<long> segmentsToCompact;
+long snapshotBytes = 0; // size of votes.snapshot, for COMPACTION_RATIO
+mutex compactionMutex;
+condition_variable compactionWork;
+
+// Append-only journal of the HomeServer vote state plus a compacted snapshot.
+//
+// Records are appended to an in-memory buffer by the thread judging ballots.
+// A journal thread writes whatever accumulated as one checksummed block and
+// fdatasync()s it, so every ballot that arrived while the previous block was
+// being synced shares the next sync (group commit). A voter is only answered
+// once durable() reaches what appended() was after its ballot: a thread that
+// may block calls waitFor(), the SessionEngine is woken up through the
+// descriptor given to notify() instead.
+//
+// The journal is split into segments. Once the full segments add up to a
+// fraction of votes.snapshot, a compaction thread merges them into it, and
+// recovery maps the snapshot read-only, so a restart only replays the
+// segments written since the last compaction. Merging a fraction at a time
+// lets the snapshot grow geometrically, so every record is rewritten a
+// bounded number of times.
+class VoteJournal {
+private:
+    static void encode(vector<unsigned char>& buffer, JournalRecord& record);
+    static int decode(const unsigned char* bytes, size_t available, JournalRecord& record, size_t& consumed);
+    static unsigned int checksum(const unsigned char* bytes, size_t length);
+    static string segmentPath(long segment);
+    static string snapshotPath();
+    static vector<long> listSegments();
+    static void syncDirectory();
+    static void openSegment(long segment);
+    static bool readFile(const string& path, vector<unsigned char>& contents);
+    static void replaySegment(long segment, function<void(JournalRecord&)>& apply);
+    static size_t readTallies(const unsigned char* contents, size_t length, SnapshotHeader& header, vector<long>& tallies);
+    static void countFraud(JournalRecord& record, vector<long>& tallies);
+    static long loadSnapshot(function<void(JournalRecord&)>& apply, vector<long>& tallies);
+    static bool writeAll(int descriptor, const unsigned char* bytes, size_t length);
+    static void compact(const vector<long>& segments);
+    static void commitLoop();
+    static void compactionLoop();
+
+public:
+    static bool isEnabled() { return journalDescriptor >= 0; }
+    static void recover(const char* directory, function<void(JournalRecord&)> apply, vector<long>& tallies);
+    static void append(JournalRecord& record);
+    static long appended();
+    static long durable();
+    static void waitFor(long sequence);
+    static void notify(int descriptor);
+};
+
+void VoteJournal::encode(vector<unsigned char>& buffer, JournalRecord& record) {
+    buffer.push_back((unsigned char) record.type);
+    WireCodec::appendNumber(buffer, record.pseudonym);
+    WireCodec::appendNumber(buffer, record.vote);
+    WireCodec::appendInt(buffer, record.delta);
+    if(record.type == JOURNAL_FRAUD) {
+        WireCodec::appendNumber(buffer, record.ID);
+        return;
+    }
+    WireCodec::appendInt(buffer, record.requests.size());
+    for(size_t i = 0; i < record.requests.size(); ++i) {
+        buffer.push_back((unsigned char) record.requests[i]);
+        WireCodec::appendNumber(buffer, record.first[i]);
+        WireCodec::appendNumber(buffer, record.second[i]);
+        WireCodec::appendNumber(buffer, record.third[i]);
+    }
+}
+
+int VoteJournal::decode(const unsigned char* bytes, size_t available, JournalRecord& record, size_t& consumed) {
+    size_t offset = 1, used;
+    if(available < 1) {
+        return FRAME_INCOMPLETE;
+    }
+    record.type = bytes[0];
+    if(record.type != JOURNAL_BALLOT && record.type != JOURNAL_FRAUD) {
+        return FRAME_MALFORMED;
+    }
+    int status = WireCodec::parseNumber(bytes + offset, available - offset, record.pseudonym, used);
+    if(status != FRAME_COMPLETE) {
+        return status;
+    }
+    offset += used;
+    status = WireCodec::parseNumber(bytes + offset, available - offset, record.vote, used);
+    if(status != FRAME_COMPLETE) {
+        return status;
+    }
+    offset += used;
+    if(available - offset < sizeof(int)) {
+        return FRAME_INCOMPLETE;
+    }
+    memcpy(&record.delta, bytes + offset, sizeof(int));
+    offset += sizeof(int);
+    if(record.type == JOURNAL_FRAUD) {
+        status = WireCodec::parseNumber(bytes + offset, available - offset, record.ID, used);
+        consumed = offset + used;
+        return status;
+    }
+
+    int numberOfRequests;
+    if(available - offset < sizeof(int)) {
+        return FRAME_INCOMPLETE;
+    }
+    memcpy(&numberOfRequests, bytes + offset, sizeof(int));
+    offset += sizeof(int);
+    if(numberOfRequests < 0 || numberOfRequests > MAX_SECURITY_CONSTANT) {
+        return FRAME_MALFORMED;
+    }
+    record.requests.resize(numberOfRequests);
+    record.first.resize(numberOfRequests);
+    record.second.resize(numberOfRequests);
+    record.third.resize(numberOfRequests);
+    for(int i = 0; i < numberOfRequests; ++i) {
+        if(available - offset < 1) {
+            return FRAME_INCOMPLETE;
+        }
+        record.requests[i] = bytes[offset++];
+        ZZ* values[3] = {&record.first[i], &record.second[i], &record.third[i]};
+        for(int j = 0; j < 3; ++j) {
+            status = WireCodec::parseNumber(bytes + offset, available - offset, *values[j], used);
+            if(status != FRAME_COMPLETE) {
+                return status;
+            }
+            offset += used;
+        }
+    }
+    consumed = offset;
+    return FRAME_COMPLETE;
+}
+
+unsigned int VoteJournal::checksum(const unsigned char* bytes, size_t length) {
+    // FNV-1a: enough to tell a torn last block from a complete one
+    unsigned int hash = 2166136261u;
+    for(size_t i = 0; i < length; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+string VoteJournal::segmentPath(long segment) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s%08ld", JOURNAL_PREFIX, segment);
+    return journalDirectory + "/" + name;
+}
+
+string VoteJournal::snapshotPath() {
+    return journalDirectory + "/" + SNAPSHOT_NAME;
+}
+
+vector<long> VoteJournal::listSegments() {
+    vector<long> segments;
+    DIR* directory = opendir(journalDirectory.c_str());
+    if(directory == NULL) {
+        return segments;
+    }
+    struct dirent* entry;
+    size_t prefixLength = strlen(JOURNAL_PREFIX);
+    while((entry = readdir(directory)) != NULL) {
+        if(strncmp(entry->d_name, JOURNAL_PREFIX, prefixLength) == 0) {
+            segments.push_back(atol(entry->d_name + prefixLength));
+        }
+    }
+    closedir(directory);
+    sort(segments.begin(), segments.end());
+    return segments;
+}
+
+// Makes the names in the journal directory durable: a file created or
+// renamed there could otherwise vanish in a power failure, synced contents
+// and all.
+void VoteJournal::syncDirectory() {
+    int directory = open(journalDirectory.c_str(), O_RDONLY);
+    if(directory < 0 || fsync(directory) < 0) {
+        perror("Error at syncing the journal directory.\n");
+        exit(1);
+    }
+    close(directory);
+}
+
+// Called before anything is written to the segment, so no verdict can
+// depend on it before its name is durable.
+void VoteJournal::openSegment(long segment) {
+    journalDescriptor = open(segmentPath(segment).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if(journalDescriptor < 0) {
+        perror("Error at opening journal segment.\n");
+        exit(1);
+    }
+    syncDirectory();
+    journalSegment = segment;
+    journalSegmentBytes = 0;
+}
+
+bool VoteJournal::readFile(const string& path, vector<unsigned char>& contents) {
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if(descriptor < 0) {
+        return false;
+    }
+    struct stat information;
+    fstat(descriptor, &information);
+    contents.resize(information.st_size);
+    size_t offset = 0;
+    while(offset < contents.size()) {
+        ssize_t received = read(descriptor, contents.data() + offset, contents.size() - offset);
+        if(received <= 0) {
+            break;
+        }
+        offset += received;
+    }
+    contents.resize(offset);
+    close(descriptor);
+    return true;
+}
+
+void VoteJournal::replaySegment(long segment, function<void(JournalRecord&)>& apply) {
+    vector<unsigned char> contents;
+    if(!readFile(segmentPath(segment), contents)) {
+        return;
+    }
+    // each block is [length][checksum][records]; a crash can only tear the last one
+    size_t offset = 0;
+    while(contents.size() - offset >= 2 * sizeof(unsigned int)) {
+        unsigned int length, expected;
+        memcpy(&length, contents.data() + offset, sizeof(unsigned int));
+        memcpy(&expected, contents.data() + offset + sizeof(unsigned int), sizeof(unsigned int));
+        const unsigned char* block = contents.data() + offset + 2 * sizeof(unsigned int);
+        if(contents.size() - offset - 2 * sizeof(unsigned int) < length || checksum(block, length) != expected) {
+            break;
+        }
+        size_t position = 0, used;
+        JournalRecord record;
+        while(position < length && decode(block + position, length - position, record, used) == FRAME_COMPLETE) {
+            apply(record);
+            position += used;
+        }
+        offset += 2 * sizeof(unsigned int) + length;
+    }
+}
+
+// Adds the fraud deltas of the snapshot to tallies (sized for the election)
+// and returns where its records start, 0 if the snapshot can't be used.
+size_t VoteJournal::readTallies(const unsigned char* contents, size_t length, SnapshotHeader& header, vector<long>& tallies) {
+    memcpy(&header, contents, sizeof(SnapshotHeader));
+    if(memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 || (header.version != 1 && header.version != SNAPSHOT_VERSION)) {
+        return 0;
+    }
+    if(header.version == 1) {
+        // a version 1 server only knew the yes/no question, which is question 0
+        tallies[Election::tallyIndex(0, 0)] += header.negativeVotes;
+        tallies[Election::tallyIndex(0, 1)] += header.positiveVotes;
+        return sizeof(SnapshotHeader);
+    }
+    size_t offset = sizeof(SnapshotHeader) + header.numberOfTallies * sizeof(long);
+    if(header.numberOfTallies != (long) tallies.size() || length < offset) {
+        return 0;
+    }
+    const long* stored = (const long*) (contents + sizeof(SnapshotHeader));
+    for(long i = 0; i < header.numberOfTallies; ++i) {
+        tallies[i] += stored[i];
+    }
+    return offset;
+}
+
+void VoteJournal::countFraud(JournalRecord& record, vector<long>& tallies) {
+    long code, indexes[MAX_QUESTIONS];
+    if(record.type != JOURNAL_FRAUD || record.delta == 0 || !Election::decode(record.vote, code)) {
+        return;
+    }
+    Election::tallyIndexes(code, indexes);
+    for(int q = 0; q < Election::numberOfQuestions(); ++q) {
+        tallies[indexes[q]] += record.delta;
+    }
+}
+
+long VoteJournal::loadSnapshot(function<void(JournalRecord&)>& apply, vector<long>& tallies) {
+    int descriptor = open(snapshotPath().c_str(), O_RDONLY);
+    if(descriptor < 0) {
+        return 0;
+    }
+    struct stat information;
+    fstat(descriptor, &information);
+    if((size_t) information.st_size < sizeof(SnapshotHeader)) {
+        close(descriptor);
+        return 0;
+    }
+    unsigned char* mapped = (unsigned char*) mmap(NULL, information.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if(mapped == MAP_FAILED) {
+        perror("Error at mapping vote snapshot.\n");
+        exit(1);
+    }
+    madvise(mapped, information.st_size, MADV_SEQUENTIAL);
+    snapshotBytes = information.st_size;
+
+    SnapshotHeader header;
+    size_t offset = readTallies(mapped, information.st_size, header, tallies), used;
+    if(offset == 0) {
+        fprintf(stderr, "Unknown vote snapshot format or a different election, refusing to start.\n");
+        exit(1);
+    }
+    long numberOfRecords = header.numberOfBallots + header.numberOfImpostors;
+    JournalRecord record;
+    for(long i = 0; i < numberOfRecords; ++i) {
+        if(decode(mapped + offset, information.st_size - offset, record, used) != FRAME_COMPLETE) {
+            fprintf(stderr, "Vote snapshot is corrupt, refusing to start.\n");
+            exit(1);
+        }
+        apply(record);
+        offset += used;
+    }
+    munmap(mapped, information.st_size);
+    return header.compactedThroughSegment;
+}
+
+void VoteJournal::recover(const char* directory, function<void(JournalRecord&)> apply, vector<long>& tallies) {
+    journalDirectory = directory;
+    mkdir(directory, 0700);
+
+    long compactedThroughSegment = loadSnapshot(apply, tallies);
+    vector<long> segments = listSegments();
+    long lastSegment = compactedThroughSegment;
+    for(size_t i = 0; i < segments.size(); ++i) {
+        if(segments[i] <= compactedThroughSegment) {
+            // merged into the snapshot right before a crash
+            unlink(segmentPath(segments[i]).c_str());
+            continue;
+        }
+        replaySegment(segments[i], apply);
+        segmentsToCompact.push_back(segments[i]);
+        lastSegment = segments[i];
+    }
+
+    // never append to a segment whose tail may be torn, start a fresh one
+    openSegment(lastSegment + 1);
+    thread(commitLoop).detach();
+    thread(compactionLoop).detach();
+    compactionWork.notify_one();
+}
+
+void VoteJournal::append(JournalRecord& record) {
+    if(!isEnabled()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(journalMutex);
+        encode(pendingRecords, record);
+        ++appendedSequence;
+    }
+    journalWork.notify_one();
+}
+
+long VoteJournal::appended() {
+    lock_guard<mutex> lock(journalMutex);
+    return appendedSequence;
+}
+
+long VoteJournal::durable() {
+    lock_guard<mutex> lock(journalMutex);
+    return durableSequence;
+}
+
+void VoteJournal::waitFor(long sequence) {
+    unique_lock<mutex> lock(journalMutex);
+    journalDurable.wait(lock, [sequence] { return durableSequence >= sequence; });
+}
+
+void VoteJournal::notify(int descriptor) {
+    lock_guard<mutex> lock(journalMutex);
+    journalNotifyDescriptor = descriptor;
+}
+
+void VoteJournal::commitLoop() {
+    vector<unsigned char> block;
+    while(true) {
+        long sequence;
+        {
+            unique_lock<mutex> lock(journalMutex);
+            journalWork.wait(lock, [] { return !pendingRecords.empty(); });
+            block.swap(pendingRecords);
+            sequence = appendedSequence;
+        }
+        unsigned int head[2];
+        head[0] = block.size();
+        head[1] = checksum(block.data(), block.size());
+        struct iovec parts[2];
+        parts[0].iov_base = head;
+        parts[0].iov_len = sizeof(head);
+        parts[1].iov_base = block.data();
+        parts[1].iov_len = block.size();
+        if(writev(journalDescriptor, parts, 2) != (ssize_t) (sizeof(head) + block.size())
+            || fdatasync(journalDescriptor) < 0) {
+            perror("Error at writing vote journal.\n");
+            exit(1);
+        }
+        journalSegmentBytes += sizeof(head) + block.size();
+        block.clear();
+        int notifyDescriptor;
+        {
+            lock_guard<mutex> lock(journalMutex);
+            durableSequence = sequence;
+            notifyDescriptor = journalNotifyDescriptor;
+        }
+        journalDurable.notify_all();
+        uint64_t one = 1;
+        if(notifyDescriptor >= 0 && write(notifyDescriptor, &one, sizeof(one)) < 0) {
+            perror("Error at waking the session engine.\n");
+        }
+
+        if(journalSegmentBytes >= JOURNAL_SEGMENT_BYTES) {
+            close(journalDescriptor);
+            {
+                lock_guard<mutex> lock(compactionMutex);
+                segmentsToCompact.push_back(journalSegment);
+            }
+            compactionWork.notify_one();
+            openSegment(journalSegment + 1);
+        }
+    }
+}
+
+void VoteJournal::compactionLoop() {
+    while(true) {
+        vector<long> segments;
+        {
+            unique_lock<mutex> lock(compactionMutex);
+            compactionWork.wait(lock, [] {
+                return !segmentsToCompact.empty()
+                    && (long) segmentsToCompact.size() * JOURNAL_SEGMENT_BYTES * COMPACTION_RATIO >= snapshotBytes;
+            });
+            segments.assign(segmentsToCompact.begin(), segmentsToCompact.end());
+        }
+        compact(segments);
+        lock_guard<mutex> lock(compactionMutex);
+        segmentsToCompact.erase(segmentsToCompact.begin(), segmentsToCompact.begin() + segments.size());
+    }
+}
+
+bool VoteJournal::writeAll(int descriptor, const unsigned char* bytes, size_t length) {
+    size_t done = 0;
+    while(done < length) {
+        ssize_t written = write(descriptor, bytes + done, length - done);
+        if(written <= 0) {
+            return false;
+        }
+        done += written;
+    }
+    return true;
+}
+
+// Merges the old snapshot with closed segments into a new snapshot. Both
+// sections of the old snapshot are already sorted, so it is read through a
+// mapping and the merge goes straight to the new file: only the records of
+// the segments (at most 1 / COMPACTION_RATIO of the snapshot, or one segment)
+// and a write buffer are held in memory.
+void VoteJournal::compact(const vector<long>& segments) {
+    map<ZZ, vector<unsigned char> > newBallots, newImpostors;
+    vector<long> tallies(Election::numberOfTallies(), 0);
+    function<void(JournalRecord&)> collect = [&](JournalRecord& record) {
+        countFraud(record, tallies);
+        record.delta = 0;
+        map<ZZ, vector<unsigned char> >& section = record.type == JOURNAL_BALLOT ? newBallots : newImpostors;
+        if(section.find(record.pseudonym) == section.end()) {
+            encode(section[record.pseudonym], record);
+        }
+    };
+    for(size_t i = 0; i < segments.size(); ++i) {
+        replaySegment(segments[i], collect);
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    const unsigned char* old = NULL;
+    size_t oldBytes = 0, offset = 0, used;
+    int descriptor = open(snapshotPath().c_str(), O_RDONLY);
+    if(descriptor >= 0) {
+        struct stat information;
+        fstat(descriptor, &information);
+        oldBytes = information.st_size;
+        if(oldBytes >= sizeof(SnapshotHeader)) {
+            old = (const unsigned char*) mmap(NULL, oldBytes, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        }
+        close(descriptor);
+        if(old == MAP_FAILED) {
+            perror("Error at mapping vote snapshot.\n");
+            exit(1);
+        }
+    }
+    if(old != NULL) {
+        madvise((void*) old, oldBytes, MADV_SEQUENTIAL);
+        // recovery already refused a snapshot this can't read
+        offset = readTallies(old, oldBytes, header, tallies);
+    }
+    if(offset == 0) {
+        memset(&header, 0, sizeof(SnapshotHeader));
+    }
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.numberOfTallies = tallies.size();
+    header.compactedThroughSegment = segments.back();
+    header.positiveVotes = 0;
+    header.negativeVotes = 0;
+
+    // write aside, sync, then atomically replace the old snapshot; the
+    // header goes in last, once the counts are known
+    string temporaryPath = snapshotPath() + ".tmp";
+    descriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(descriptor < 0) {
+        perror("Error at writing vote snapshot.\n");
+        exit(1);
+    }
+    vector<unsigned char> output(sizeof(SnapshotHeader));
+    output.insert(output.end(), (unsigned char*) tallies.data(), (unsigned char*) (tallies.data() + tallies.size()));
+    bool written = true;
+    size_t totalBytes = 0;
+    function<void(const unsigned char*, size_t)> emit = [&](const unsigned char* bytes, size_t length) {
+        output.insert(output.end(), bytes, bytes + length);
+        if((long) output.size() >= COMPACTION_BUFFER_BYTES) {
+            written = written && writeAll(descriptor, output.data(), output.size());
+            totalBytes += output.size();
+            output.clear();
+        }
+    };
+    long counts[2] = {header.numberOfBallots, header.numberOfImpostors};
+    map<ZZ, vector<unsigned char> >* sections[2] = {&newBallots, &newImpostors};
+    for(int s = 0; s < 2; ++s) {
+        long merged = 0;
+        map<ZZ, vector<unsigned char> >::iterator next = sections[s]->begin();
+        JournalRecord oldRecord;
+        for(long i = 0; i < counts[s]; ++i) {
+            decode(old + offset, oldBytes - offset, oldRecord, used);
+            while(next != sections[s]->end() && next->first < oldRecord.pseudonym) {
+                emit(next->second.data(), next->second.size());
+                ++next;
+                ++merged;
+            }
+            if(next != sections[s]->end() && next->first == oldRecord.pseudonym) {
+                ++next; // the snapshot already knows this pseudonym
+            }
+            emit(old + offset, used);
+            offset += used;
+            ++merged;
+        }
+        for(; next != sections[s]->end(); ++next) {
+            emit(next->second.data(), next->second.size());
+            ++merged;
+        }
+        counts[s] = merged;
+    }
+    if(old != NULL) {
+        munmap((void*) old, oldBytes);
+    }
+    header.numberOfBallots = counts[0];
+    header.numberOfImpostors = counts[1];
+    written = written && writeAll(descriptor, output.data(), output.size())
+        && pwrite(descriptor, &header, sizeof(SnapshotHeader), 0) == (ssize_t) sizeof(SnapshotHeader);
+    totalBytes += output.size();
+    if(!written || fsync(descriptor) < 0) {
+        perror("Error at writing vote snapshot.\n");
+        exit(1);
+    }
+    close(descriptor);
+    if(rename(temporaryPath.c_str(), snapshotPath().c_str()) < 0) {
+        perror("Error at replacing vote snapshot.\n");
+        exit(1);
+    }
+    syncDirectory();
+    for(size_t i = 0; i < segments.size(); ++i) {
+        unlink(segmentPath(segments[i]).c_str());
+    }
+    lock_guard<mutex> lock(compactionMutex);
+    snapshotBytes = totalBytes;
+}
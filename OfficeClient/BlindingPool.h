@@ -0,0 +1,110 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "GFunction.h"
+
+using namespace std;
+using namespace NTL;
+
+// The half of one blinded value that doesn't depend on the voter's ID:
+// the randomness, x = G(a, c) and r ^ 3 (mod n).
+class BlindingTuple {
+public:
+    ZZ a, c, d, r;
+    ZZ x, rCubed;
+};
+
+deque<BlindingTuple> blindingTuples;
+mutex blindingTuplesMutex;
+condition_variable blindingTuplesChanged;
+ZZ blindingModulus;
+size_t blindingTarget = 0;
+vector<thread> precomputers;
+
+// Keeps up to a target number of BlindingTuples ready for the current
+// modulus, computed by background threads, so a registration only computes
+// G(a ^ ID, d), F and one product per blinded value once the ID is known.
+// A new modulus throws away whatever was computed for the old one.
+class BlindingPool {
+private:
+    static void precompute();
+
+public:
+    static void make(BlindingTuple& tuple, const ZZ& modulus);
+    static void start(const ZZ& modulus, size_t target, int numberOfThreads);
+    static void take(vector<BlindingTuple>& tuples, size_t count, const ZZ& modulus);
+};
+
+void BlindingPool::make(BlindingTuple& tuple, const ZZ& modulus) {
+    ZZ exponent;
+    exponent = G_EXPONENT;
+    tuple.a = RandomBnd(modulus);
+    tuple.c = RandomBnd(modulus);
+    tuple.d = RandomBnd(modulus);
+    tuple.r = RandomBnd(modulus);
+    tuple.x = GFunction::applyFunction(tuple.a, tuple.c, exponent, modulus);
+    tuple.rCubed = PowerMod(tuple.r, 3, modulus);
+}
+
+void BlindingPool::precompute() {
+    while(true) {
+        ZZ modulus;
+        {
+            unique_lock<mutex> lock(blindingTuplesMutex);
+            blindingTuplesChanged.wait(lock, [] { return blindingTuples.size() < blindingTarget; });
+            modulus = blindingModulus;
+        }
+        BlindingTuple tuple;
+        make(tuple, modulus);
+        lock_guard<mutex> lock(blindingTuplesMutex);
+        if(modulus == blindingModulus && blindingTuples.size() < blindingTarget) {
+            blindingTuples.push_back(tuple);
+        }
+    }
+}
+
+// Aims the pool at modulus and target tuples; the threads are only started
+// by the first call.
+void BlindingPool::start(const ZZ& modulus, size_t target, int numberOfThreads) {
+    {
+        lock_guard<mutex> lock(blindingTuplesMutex);
+        if(modulus != blindingModulus) {
+            blindingTuples.clear();
+            blindingModulus = modulus;
+        }
+        blindingTarget = target;
+    }
+    blindingTuplesChanged.notify_all();
+    if(!precomputers.empty()) {
+        return;
+    }
+    for(int i = 0; i < numberOfThreads; ++i) {
+        precomputers.push_back(thread(precompute));
+        // nothing waits for them, they die with the process
+        precomputers.back().detach();
+    }
+}
+
+// Hands out count tuples for modulus, computing here whatever the pool
+// doesn't have ready.
+void BlindingPool::take(vector<BlindingTuple>& tuples, size_t count, const ZZ& modulus) {
+    tuples.resize(count);
+    size_t taken = 0;
+    {
+        lock_guard<mutex> lock(blindingTuplesMutex);
+        if(modulus == blindingModulus) {
+            while(taken < count && !blindingTuples.empty()) {
+                tuples[taken++] = move(blindingTuples.front());
+                blindingTuples.pop_front();
+            }
+        }
+    }
+    blindingTuplesChanged.notify_all();
+    for(size_t i = taken; i < count; ++i) {
+        make(tuples[i], modulus);
+    }
+}
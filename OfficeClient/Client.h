@@ -1,114 +1,73 @@
 #include <NTL/ZZ.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "FFunction.h"
 #include "GFunction.h"
+#include "WireCodec.h"
+#include "FiatShamir.h"
+#include "VoterProtocol.h"
+#include "CredentialWriter.h"
+#include "BlindingPool.h"
+#include "Gateway.h"
 
 using namespace std;
 using namespace NTL;
 
 #define INFORMATION "votingInformation"
-
-#define ID_OK 0
-#define ID_INVALID 1
-#define ID_USED 2
-
-#define NOT_OK 1
+#define PARAMETERS "officeParameters.txt" // the last server's n and k, to blind ahead
 
 ZZ compositeNumber;
 int securityConstant;
-vector<ZZ> blindSignatures;
+GatewayConnection* gateway = NULL; // carries every bulk registration when set
 
 class Client {
 private:
-    static ZZ receiveNumberFromServer(int sd);
-    static void sendNumberToServer(ZZ& number, int sd);
     static string zToString(const ZZ &z);
     static ZZ cstringToNumber(char x[]);
-    static void writePseudonymToFile(const char* info, ZZ ID, ZZ pseudonym, ZZ* a, ZZ* c, ZZ* d, ZZ* r, bool*);
-    static void sendParametersToServer(int sd, bool* chosenIndexes, ZZ* a, ZZ* c, ZZ* d, ZZ* r);
-    static void sendBlindSignaturesToServer(int sd);
-    static void createBlindSignatures(ZZ ID, ZZ* a, ZZ* c, ZZ* d, ZZ* r);
-    static void generateRandomParameters(ZZ* a, ZZ* c, ZZ* d, ZZ* r);
+    static string formatCredentials(Registration& registration);
+    static void writePseudonymToFile(const char* info, Registration& registration);
+    static void generateRandomParameters(Registration& registration);
+    static int registerVoter(WireCodec& codec, Registration& registration, bool version2, bool nonInteractive);
+    static int connectTo(const struct sockaddr_in& server);
 
 public:
-    static void execute(int sd);
+    static void execute(const struct sockaddr_in& server, bool version2, bool nonInteractive);
+    static void executeBulk(const struct sockaddr_in& server, const char* idsFile, int connections,
+        bool version2, bool nonInteractive, int gatewayPort);
 };
 
 
-void Client::sendNumberToServer(ZZ& number, int sd) {
-    long numberLength = NumBytes(number);
-    if(write(sd, &numberLength, sizeof(long)) < 0) {
-        perror("Error at writing number length to server.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    BytesFromZZ(representation, number, numberLength);
-    for(long i = 0; i < numberLength; ++i) {
-        if(write(sd, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to server.\n");
-            exit(0);
-        }
-    }
-}
-
-ZZ Client::receiveNumberFromServer(int sd) {
-    long numberLength;
-    if(read(sd, &numberLength, sizeof(long)) < 0) {
-        perror ("Error at reading number length from server.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    for(long i = 0; i < numberLength; ++i) {
-        if(read(sd, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to server.\n");
-            exit(0);
-        }
-    }
-    ZZ result;
-    ZZFromBytes(result, representation, numberLength);
-    return result;
-}
-
-
-void Client::generateRandomParameters(ZZ* a, ZZ* c, ZZ* d, ZZ* r) {
+void Client::generateRandomParameters(Registration& registration) {
+    vector<BlindingTuple> tuples;
+    BlindingPool::take(tuples, securityConstant, compositeNumber);
+    registration.a.resize(securityConstant);
+    registration.c.resize(securityConstant);
+    registration.d.resize(securityConstant);
+    registration.r.resize(securityConstant);
+    registration.x.resize(securityConstant);
+    registration.rCubed.resize(securityConstant);
     for (int i = 0; i < securityConstant; ++i) {
-        a[i] = RandomBnd(compositeNumber);
-        c[i] = RandomBnd(compositeNumber);
-        d[i] = RandomBnd(compositeNumber);
-        r[i] = RandomBnd(compositeNumber);
-    }
-}
-
-void Client::createBlindSignatures(ZZ ID, ZZ* a, ZZ* c, ZZ* d, ZZ* r) {
-    for(int i = 0; i < securityConstant; ++i) {
-        ZZ x = GFunction::applyFunction(a[i], c[i]);
-    	ZZ op;
-    	op = a[i] ^ ID;
-    	ZZ y = GFunction::applyFunction(op, d[i]);
-    	ZZ fResult = FFunction::applyFunction(x, y);
-    	blindSignatures.push_back((r[i] * r[i] * r[i] * fResult) % compositeNumber);
-    }
-}
-
-void Client::sendBlindSignaturesToServer(int sd) {
-    for(int i = 0; i < securityConstant; ++i) {
-        sendNumberToServer(blindSignatures[i], sd);
-    }
-}
-
-void Client::sendParametersToServer(int sd, bool* chosenIndexes, ZZ* a, ZZ* c, ZZ* d, ZZ* r) {
-    for(int i = 0; i < securityConstant; ++i) {
-        if(chosenIndexes[i]) {
-            sendNumberToServer(a[i], sd);
-            sendNumberToServer(c[i], sd);
-            sendNumberToServer(d[i], sd);
-            sendNumberToServer(r[i], sd);
-        }
+        registration.a[i] = tuples[i].a;
+        registration.c[i] = tuples[i].c;
+        registration.d[i] = tuples[i].d;
+        registration.r[i] = tuples[i].r;
+        registration.x[i] = tuples[i].x;
+        registration.rCubed[i] = tuples[i].rCubed;
     }
+    registration.blindSignatures.clear();
+    registration.sent = false;
 }
 
 string Client::zToString(const ZZ &z) {
@@ -125,100 +84,268 @@ ZZ Client::cstringToNumber(char x[]) {
     return z;
 }
 
-void Client::writePseudonymToFile(const char* info, ZZ ID, ZZ pseudonym, ZZ* a, ZZ* c, ZZ* d, ZZ* r, bool* chosen) {
+string Client::formatCredentials(Registration& registration) {
+    Credentials credentials;
+    VoterProtocol::keepCredentials(registration, securityConstant, credentials);
+    stringstream out;
+    out << credentials.pseudonym << '\n';
+    out << securityConstant << '\n';
+    for(int i = 0; i < securityConstant; ++i) {
+        out << credentials.a[i] << '\n' << credentials.c[i] << '\n'
+            << credentials.d[i] << '\n' << credentials.r[i] << '\n';
+    }
+    return out.str();
+}
+
+void Client::writePseudonymToFile(const char* info, Registration& registration) {
     string path;
     path += info;
-    path += zToString(ID);
+    path += zToString(registration.ID);
     path += ".txt";
     ofstream out(path.c_str(), fstream::trunc | fstream::out);
+    out << formatCredentials(registration);
+    out.close();
+}
 
-    out << pseudonym << '\n';
-    out << securityConstant << '\n';
-    for(int i = 0; i < securityConstant; ++i) {
-        if(!chosen[i]) {
-            out << a[i] << '\n' << c[i] << '\n' << d[i] << '\n' << r[i] << '\n';
-        }
+// Runs one registration on a connection whose greeting was already read.
+// Randomness is drawn here unless the caller drew it beforehand, and the
+// blinded values are computed unless they already match the ID.
+int Client::registerVoter(WireCodec& codec, Registration& registration, bool version2, bool nonInteractive) {
+    if(registration.sent || (int) registration.a.size() != securityConstant) {
+        generateRandomParameters(registration);
     }
-    for(int i = 0; i < securityConstant; ++i) {
-        if(chosen[i]) {
-            out << a[i] << '\n' << c[i] << '\n' << d[i] << '\n' << r[i] << '\n';
-        }
-    }
-
-    out.close();
+    return VoterProtocol::registerVoter(codec, registration, compositeNumber, securityConstant, version2, nonInteractive);
 }
 
-void Client::execute(int sd) {
-    compositeNumber = receiveNumberFromServer(sd);
-    if(read(sd, &securityConstant, sizeof(int)) < 0) {
-        perror ("Error at reading security constant from server.\n");
-        exit(0);
+// Protocol v2 sends the ID and the blinded values in one message and gets the
+// ID verdict and the chosen indexes (a k-bit vector) back in one, saving two
+// round trips. Blinding costs some work the server may then refuse, but a
+// registering voter normally has a valid ID.
+// Non-interactive registration goes further: the indexes to open are hashed
+// from the ID and the blinded values, so the openings ride along too and the
+// whole registration is one request and one response. It needs a server
+// running with at least FIAT_SHAMIR_MIN_SECURITY_CONSTANT blinded values.
+//
+// The kiosk blinds ahead: with the parameters of the last server it talked to
+// (PARAMETERS), the BlindingPool computes the ID-independent half of every
+// blinded value while the voter types, and only then the client connects. A
+// server with other parameters just costs the blinding on the spot, as on the
+// very first run.
+void Client::execute(const struct sockaddr_in& server, bool version2, bool nonInteractive) {
+    int numberOfPrecomputers = max(1u, thread::hardware_concurrency());
+    ifstream cached(PARAMETERS);
+    if(cached >> compositeNumber >> securityConstant && compositeNumber > 0 && securityConstant > 1) {
+        BlindingPool::start(compositeNumber, securityConstant, numberOfPrecomputers);
     }
+    cached.close();
 
     cout << "Please insert a valid ID: ";
-    ZZ ID;
-    cin >> ID;
-    sendNumberToServer(ID, sd);
-    int response;
-    if (read(sd, &response, sizeof(int)) < 0) {
-        perror ("Error at reading response from server.\n");
+    Registration registration;
+    cin >> registration.ID;
+
+    int sd = connectTo(server);
+    if(sd < 0) {
+        perror("Error at connecting to server.\n");
+        exit(errno);
+    }
+    WireCodec codec(sd);
+    ZZ serverComposite = codec.receiveNumber();
+    int serverSecurityConstant = codec.receiveInt();
+    if(codec.isBroken()) {
         exit(0);
     }
+    if(serverComposite == 0) {
+        // the office turned us away, the second field says for how long
+        cout << "The registration office is busy, please try again in " << serverSecurityConstant << " ms.\n";
+        close(sd);
+        return;
+    }
+    if(serverComposite != compositeNumber || serverSecurityConstant != securityConstant) {
+        compositeNumber = serverComposite;
+        securityConstant = serverSecurityConstant;
+        ofstream out(PARAMETERS, fstream::trunc | fstream::out);
+        out << compositeNumber << '\n' << securityConstant << '\n';
+        out.close();
+    }
+    GFunction::configure(compositeNumber);
+    FFunction::configure(compositeNumber);
+    version2 = version2 || nonInteractive; // the non-interactive session is a v2 one
+    if(nonInteractive && securityConstant < FIAT_SHAMIR_MIN_SECURITY_CONSTANT) {
+        cout << "The server uses too few blinded values for non-interactive registration, using v2.\n";
+        nonInteractive = false;
+    }
 
-    if(response == ID_INVALID) {
+    int status = registerVoter(codec, registration, version2, nonInteractive);
+    close(sd);
+    if(status == CONNECTION_LOST) {
+        exit(0);
+    }
+    if(status == ID_INVALID) {
         cout << "Invalid ID. Please don't try to cheat!\n";
         return;
     }
-    if(response == ID_USED) {
+    if(status == ID_USED) {
         cout << "You already used this ID. Please be fair!\n";
         return;
     }
-    // else is ID_OK
-
-    ZZ* a = new ZZ[securityConstant];
-    ZZ* c = new ZZ[securityConstant];
-    ZZ* d = new ZZ[securityConstant];
-    ZZ* r = new ZZ[securityConstant];
-
-    generateRandomParameters(a, c, d, r);
-    createBlindSignatures(ID, a, c, d, r);
-    for(int i = 0; i < securityConstant; ++i) {
+    if(status == REGISTRATION_REFUSED) {
+        cout << "You are trying to cheat! We caught you!\n";
+        return;
     }
-    sendBlindSignaturesToServer(sd);
+    writePseudonymToFile(INFORMATION, registration);
+    cout << "Thank you. Your pseudonym is: " << registration.pseudonym << '\n';
+}
 
-    bool* chosenIndexes = new bool[securityConstant];
-    for(int i = 0; i < securityConstant; ++i) {
-        chosenIndexes[i] = false;
+int Client::connectTo(const struct sockaddr_in& server) {
+    if(gateway != NULL) {
+        return gateway->openSession();
     }
-    for(int i = 0; i < securityConstant / 2; ++i) {
-        int index;
-        if(read(sd, &index, sizeof(int)) < 0) {
-            perror("Error at reading chosen index from server.\n");
-            exit(0);
-        }
-        chosenIndexes[index] = true;
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sd < 0) {
+        return -1;
     }
-    sendParametersToServer(sd, chosenIndexes, a, c, d, r);
-    int feedBack;
-    if(read(sd, &feedBack, sizeof(int)) < 0) {
-        perror("Error at reading feedBack from server.\n");
-        exit(0);
+    if(connect(sd, (const struct sockaddr*) &server, sizeof(server)) < 0) {
+        close(sd);
+        return -1;
     }
-    if(feedBack == NOT_OK) {
-        cout << "You are trying to cheat! We caught you!\n";
+    return sd;
+}
+
+// Kiosk mode: registers every ID of idsFile (whitespace separated) over up
+// to `connections` connections at once, one registration per connection as
+// the OfficeServer expects. Once the server's parameters are known, a worker
+// takes the BlindingPool's tuples for its next ID and blinds them before
+// connecting, so a connection is only held for the exchange itself;
+// randomness that never left the client (an ID refused by a v1 server) is
+// kept for the next ID.
+// Credentials go through a CredentialWriter.
+// With a gatewayPort the registrations are sessions of a single gateway
+// connection to that port instead, `connections` of them at once.
+void Client::executeBulk(const struct sockaddr_in& server, const char* idsFile, int connections,
+    bool version2, bool nonInteractive, int gatewayPort) {
+    vector<ZZ> IDs;
+    ifstream in(idsFile);
+    ZZ ID;
+    while(in >> ID) {
+        IDs.push_back(ID);
+    }
+    in.close();
+    if(IDs.empty()) {
+        cout << "No IDs to register in " << idsFile << ".\n";
         return;
     }
-    // else, the response is OKEY
-    ZZ noisedPseudonym;
-    noisedPseudonym = receiveNumberFromServer(sd);
-    ZZ noise;
-    noise = 1;
-    for(int i = 0; i < securityConstant; ++i) {
-        if(!chosenIndexes[i]) {
-            noise = (noise * r[i]) % compositeNumber;
+    version2 = version2 || nonInteractive;
+    if(gatewayPort > 0) {
+        struct sockaddr_in gatewayAddress = server;
+        gatewayAddress.sin_port = htons(gatewayPort);
+        int sd = connectTo(gatewayAddress);
+        if(sd < 0) {
+            perror("Error at connecting to the gateway port.\n");
+            return;
         }
+        gateway = new GatewayConnection(sd, false, NULL);
+        thread(&GatewayConnection::run, gateway).detach();
     }
-    ZZ pseudonym = noisedPseudonym / noise;
-    writePseudonymToFile(INFORMATION, ID, pseudonym, a, c, d, r, chosenIndexes);
-    cout << "Thank you. Your pseudonym is: " << pseudonym << '\n';
+
+    atomic<long> nextID(0);
+    atomic<long> outcomes[CONNECTION_LOST + 1];
+    for(int i = 0; i <= CONNECTION_LOST; ++i) {
+        outcomes[i] = 0;
+    }
+    atomic<bool> configured(false);
+    mutex configureMutex;
+    CredentialWriter writer;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for(int w = 0; w < connections; ++w) {
+        workers.push_back(thread([&] {
+            Registration registration;
+            while(true) {
+                long next = nextID++;
+                if(next >= (long) IDs.size()) {
+                    return;
+                }
+                registration.ID = IDs[next];
+                registration.blindSignatures.clear(); // they depend on the ID
+                if(configured) {
+                    if(registration.sent || (int) registration.a.size() != securityConstant) {
+                        generateRandomParameters(registration);
+                    }
+                    if(version2) {
+                        VoterProtocol::createBlindSignatures(registration, compositeNumber, securityConstant);
+                    }
+                }
+
+                // the server says nothing more until we answer, so the
+                // codec reading its parameters can go before the session's
+                int sd;
+                ZZ serverComposite;
+                int serverSecurityConstant;
+                bool broken;
+                while(true) {
+                    sd = connectTo(server);
+                    if(sd < 0) {
+                        break;
+                    }
+                    WireCodec codec(sd);
+                    serverComposite = codec.receiveNumber();
+                    serverSecurityConstant = codec.receiveInt();
+                    broken = codec.isBroken();
+                    if(broken || serverComposite != 0) {
+                        break;
+                    }
+                    // busy, the second field is when to come back
+                    close(sd);
+                    this_thread::sleep_for(chrono::milliseconds(serverSecurityConstant));
+                }
+                if(sd < 0 || broken) {
+                    if(sd >= 0) {
+                        close(sd);
+                    }
+                    ++outcomes[CONNECTION_LOST];
+                    continue;
+                }
+                WireCodec codec(sd);
+                if(!configured) {
+                    lock_guard<mutex> lock(configureMutex);
+                    if(!configured) {
+                        compositeNumber = serverComposite;
+                        securityConstant = serverSecurityConstant;
+                        GFunction::configure(compositeNumber);
+                        FFunction::configure(compositeNumber);
+                        // a registration's worth of tuples ahead for every connection
+                        BlindingPool::start(compositeNumber, (size_t) connections * securityConstant,
+                            max(1u, thread::hardware_concurrency()));
+                        if(nonInteractive && securityConstant < FIAT_SHAMIR_MIN_SECURITY_CONSTANT) {
+                            cout << "The server uses too few blinded values for non-interactive registration, using v2.\n";
+                        }
+                        configured = true;
+                    }
+                }
+                int status = CONNECTION_LOST;
+                if(serverComposite == compositeNumber && serverSecurityConstant == securityConstant) {
+                    status = registerVoter(codec, registration, version2,
+                        nonInteractive && securityConstant >= FIAT_SHAMIR_MIN_SECURITY_CONSTANT);
+                }
+                close(sd);
+                if(status == ID_OK) {
+                    writer.write(INFORMATION + zToString(registration.ID) + ".txt", formatCredentials(registration));
+                }
+                ++outcomes[status];
+            }
+        }));
+    }
+    for(size_t w = 0; w < workers.size(); ++w) {
+        workers[w].join();
+    }
+    long failedWrites = writer.close();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Registered " << outcomes[ID_OK] << " of " << IDs.size() << " voters in " << seconds << " s ("
+        << outcomes[ID_OK] / seconds << " registrations/s over " << connections
+        << (gateway != NULL ? " sessions of one gateway connection).\n" : " connections).\n");
+    cout << "Invalid IDs: " << outcomes[ID_INVALID] << ", used IDs: " << outcomes[ID_USED]
+        << ", refused: " << outcomes[REGISTRATION_REFUSED] << ", connection failures: " << outcomes[CONNECTION_LOST]
+        << ", unwritten credentials: " << failedWrites << ".\n";
 }
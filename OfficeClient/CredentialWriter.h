@@ -0,0 +1,76 @@
+#pragma once
+#include <fcntl.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#define CREDENTIAL_QUEUE_LIMIT 1024 // files waiting for the disk before write() blocks
+
+using namespace std;
+
+// Writes credential files on a thread of its own. Registering threads hand
+// over a path and the already formatted contents and go back to the network;
+// every file then costs one open, one write and one close.
+class CredentialWriter {
+private:
+    deque<pair<string, string> > pending;
+    mutex pendingMutex;
+    condition_variable pendingChanged;
+    bool closing;
+    long failures;
+    thread writer;
+
+    void writeLoop();
+
+public:
+    CredentialWriter() : closing(false), failures(0), writer(&CredentialWriter::writeLoop, this) {}
+    void write(const string& path, const string& contents);
+    long close(); // waits for every file, returns how many could not be written
+};
+
+void CredentialWriter::write(const string& path, const string& contents) {
+    unique_lock<mutex> lock(pendingMutex);
+    pendingChanged.wait(lock, [&] { return pending.size() < CREDENTIAL_QUEUE_LIMIT; });
+    pending.push_back(make_pair(path, contents));
+    pendingChanged.notify_all();
+}
+
+long CredentialWriter::close() {
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        closing = true;
+    }
+    pendingChanged.notify_all();
+    writer.join();
+    return failures;
+}
+
+void CredentialWriter::writeLoop() {
+    while(true) {
+        pair<string, string> file;
+        {
+            unique_lock<mutex> lock(pendingMutex);
+            pendingChanged.wait(lock, [&] { return !pending.empty() || closing; });
+            if(pending.empty()) {
+                return;
+            }
+            file = pending.front();
+            pending.pop_front();
+        }
+        pendingChanged.notify_all();
+        int descriptor = open(file.first.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        bool written = descriptor >= 0
+            && ::write(descriptor, file.second.data(), file.second.size()) == (ssize_t) file.second.size();
+        if(descriptor >= 0 && ::close(descriptor) < 0) {
+            written = false;
+        }
+        if(!written) {
+            perror("Error at writing credentials.\n");
+            ++failures;
+        }
+    }
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <string.h>
+#include <vector>
+#include "WireCodec.h"
+
+// Below this many blinded values a client could simply retry until the hash
+// hands it the challenge it wants: registration needs C(k, k/2) and voting
+// 2 ^ (k - k/2) to be out of reach, and 256 gives both 128 bits.
+#define FIAT_SHAMIR_MIN_SECURITY_CONSTANT 256
+
+using namespace std;
+using namespace NTL;
+
+const unsigned int sha256RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// SHA-256 (FIPS 180-4) of a message held in memory.
+class Sha256 {
+private:
+    static unsigned int rotate(unsigned int x, int n) { return (x >> n) | (x << (32 - n)); }
+    static void compress(unsigned int* state, const unsigned char* block);
+
+public:
+    static void digest(const unsigned char* message, size_t length, unsigned char* result);
+};
+
+void Sha256::compress(unsigned int* state, const unsigned char* block) {
+    unsigned int w[64];
+    for(int i = 0; i < 16; ++i) {
+        w[i] = (block[4 * i] << 24) | (block[4 * i + 1] << 16) | (block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+    for(int i = 16; i < 64; ++i) {
+        unsigned int s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    unsigned int v[8];
+    memcpy(v, state, sizeof(v));
+    for(int i = 0; i < 64; ++i) {
+        unsigned int t1 = v[7] + (rotate(v[4], 6) ^ rotate(v[4], 11) ^ rotate(v[4], 25))
+            + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256RoundConstants[i] + w[i];
+        unsigned int t2 = (rotate(v[0], 2) ^ rotate(v[0], 13) ^ rotate(v[0], 22))
+            + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(unsigned int));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for(int i = 0; i < 8; ++i) {
+        state[i] += v[i];
+    }
+}
+
+void Sha256::digest(const unsigned char* message, size_t length, unsigned char* result) {
+    unsigned int state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    size_t whole = length - length % 64;
+    for(size_t offset = 0; offset < whole; offset += 64) {
+        compress(state, message + offset);
+    }
+    // the tail, a one bit, zeros and the bit length fill one or two blocks
+    unsigned char tail[128];
+    memset(tail, 0, sizeof(tail));
+    size_t tailLength = length - whole;
+    memcpy(tail, message + whole, tailLength);
+    tail[tailLength] = 0x80;
+    size_t tailBlocks = tailLength < 56 ? 1 : 2;
+    unsigned long bits = (unsigned long) length * 8;
+    for(int i = 0; i < 8; ++i) {
+        tail[tailBlocks * 64 - 1 - i] = bits >> (8 * i);
+    }
+    for(size_t b = 0; b < tailBlocks; ++b) {
+        compress(state, tail + 64 * b);
+    }
+    for(int i = 0; i < 8; ++i) {
+        result[4 * i] = state[i] >> 24;
+        result[4 * i + 1] = state[i] >> 16;
+        result[4 * i + 2] = state[i] >> 8;
+        result[4 * i + 3] = state[i];
+    }
+}
+
+// The messages of a session in their wire encoding. Once everything the
+// challenge must depend on was added, the challenge is read from
+// SHA-256(digest || counter) instead of being sent by the server (the
+// Fiat-Shamir transform), so client and server derive the same one.
+class Transcript {
+private:
+    vector<unsigned char> messages;
+    unsigned char seed[32];
+    bool sealed;
+    unsigned int counter;
+    unsigned char stream[32];
+    int streamOffset;
+
+    unsigned char nextByte();
+    unsigned int uniform(unsigned int bound);
+
+public:
+    Transcript(const char* label);
+    void add(long value) { WireCodec::appendLong(messages, value); }
+    void add(const ZZ& number) { WireCodec::appendNumber(messages, number); }
+    void chooseIndexes(bool* chosen, int count, int numberOfChosen);
+    void chooseBits(int* bits, int count);
+};
+
+Transcript::Transcript(const char* label) : sealed(false), counter(0), streamOffset(32) {
+    // the label keeps a registration transcript from passing for a ballot
+    messages.insert(messages.end(), label, label + strlen(label) + 1);
+}
+
+unsigned char Transcript::nextByte() {
+    if(!sealed) {
+        Sha256::digest(messages.data(), messages.size(), seed);
+        sealed = true;
+    }
+    if(streamOffset == 32) {
+        unsigned char block[36];
+        memcpy(block, seed, 32);
+        for(int i = 0; i < 4; ++i) {
+            block[32 + i] = counter >> (8 * i);
+        }
+        ++counter;
+        Sha256::digest(block, sizeof(block), stream);
+        streamOffset = 0;
+    }
+    return stream[streamOffset++];
+}
+
+unsigned int Transcript::uniform(unsigned int bound) {
+    // rejection keeps every value equally likely
+    unsigned int limit = 0xffffffffu - 0xffffffffu % bound;
+    while(true) {
+        unsigned int value = 0;
+        for(int i = 0; i < 4; ++i) {
+            value = (value << 8) | nextByte();
+        }
+        if(value < limit) {
+            return value % bound;
+        }
+    }
+}
+
+void Transcript::chooseIndexes(bool* chosen, int count, int numberOfChosen) {
+    // the first numberOfChosen steps of a Fisher-Yates shuffle
+    vector<int> order(count);
+    for(int i = 0; i < count; ++i) {
+        order[i] = i;
+        chosen[i] = false;
+    }
+    for(int i = 0; i < numberOfChosen; ++i) {
+        swap(order[i], order[i + uniform(count - i)]);
+        chosen[order[i]] = true;
+    }
+}
+
+void Transcript::chooseBits(int* bits, int count) {
+    unsigned char byte = 0;
+    for(int i = 0; i < count; ++i) {
+        if(i % 8 == 0) {
+            byte = nextByte();
+        }
+        bits[i] = (byte >> (i % 8)) & 1;
+    }
+}
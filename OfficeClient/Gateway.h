@@ -0,0 +1,518 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define GATEWAY_MAX_FRAME 65536
+#define GATEWAY_CHUNK 16384
+#define GATEWAY_EVENTS 256
+#define GATEWAY_OPEN -1 // the length of the frame that opens a session
+#define GATEWAY_MAX_BACKLOG (1 << 20) // bytes buffered each way before the pump stops reading
+#define GATEWAY_MAX_CHANNELS 1024 // sessions the other side may keep open on one connection
+
+using namespace std;
+
+// One session carried by a gateway connection. The session logic sees an
+// ordinary socket, local, whose other end belongs to the connection's pump.
+class GatewayChannel {
+public:
+    long session;
+    int local;
+    vector<unsigned char> output; // for local, when it didn't take everything
+    size_t outputOffset;
+    unsigned int events; // what the pump's epoll watches on local, 0 once it watches nothing
+    bool localClosed;  // local hung up, the end frame is sent
+    bool remoteClosed; // the end frame arrived
+    bool paused; // not read while the connection is backlogged, in pausedSessions
+};
+
+// A long-lived connection between a polling-station gateway and a server
+// that carries many concurrent sessions. Every frame is the session
+// id (a long), the payload length (an int) and the payload. The side that
+// opens a session sends GATEWAY_OPEN as the length of its first frame,
+// without payload; a length of 0 ends the sender's half of the session.
+// Frames of sessions one side doesn't know (any more) are dropped. A session
+// opened while GATEWAY_MAX_CHANNELS are open is ended right away, so one
+// connection can't hold more sockets and threads than that. A side that
+// shuts its half of the connection down ends every session it left open,
+// and still gets their answers.
+//
+// Each session is bridged to a socketpair, so the sessions themselves run
+// exactly as over their own TCP connection (Server::execute, the
+// SessionEngine, the clients' WireCodec); only the handshake and the
+// ephemeral port per voter are gone. A single pump thread per connection
+// moves the bytes both ways without blocking. It holds at most about
+// GATEWAY_MAX_BACKLOG bytes each way: it stops reading the connection while
+// the sessions haven't taken what came for them, and stops reading the
+// sessions while the other side doesn't take what they sent.
+class GatewayConnection {
+private:
+    int connection;
+    bool accepting;
+    void (*dispatch)(int);
+    int epollDescriptor;
+    map<long, GatewayChannel*> channels;
+    map<int, GatewayChannel*> channelsByLocal;
+    mutex channelsMutex;
+    long nextSession;
+    bool closed;
+    bool inputClosed; // the other side sent everything
+    vector<unsigned char> input;
+    size_t inputOffset;
+    vector<unsigned char> output;
+    size_t outputOffset;
+    unsigned int connectionEvents; // what the pump's epoll watches on connection
+    size_t channelBacklog; // bytes of the channels' output the sessions didn't take yet
+    vector<long> pausedSessions;
+
+    static void setNonBlocking(int descriptor);
+    void appendFrame(long session, const unsigned char* payload, int length);
+    GatewayChannel* addChannel(long session, int local);
+    void removeChannel(GatewayChannel* channel);
+    bool deliver(GatewayChannel* channel, const unsigned char* payload, int length);
+    bool flushChannel(GatewayChannel* channel);
+    void watchChannel(GatewayChannel* channel);
+    void readChannel(GatewayChannel* channel);
+    void resumeChannels();
+    void openRemoteSession(long session);
+    void receiveFrame(GatewayChannel* channel, const unsigned char* payload, int length);
+    bool readConnection();
+    bool flushConnection();
+
+public:
+    GatewayConnection(int connection, bool accepting, void (*dispatch)(int));
+    ~GatewayConnection();
+    int openSession(); // a socket speaking to the server, -1 once the connection is lost
+    void run();
+};
+
+GatewayConnection::GatewayConnection(int connection, bool accepting, void (*dispatch)(int)) : connection(connection),
+    accepting(accepting), dispatch(dispatch), nextSession(0), closed(false), inputClosed(false), inputOffset(0),
+    outputOffset(0), connectionEvents(EPOLLIN), channelBacklog(0) {
+    setNonBlocking(connection);
+    int on = 1;
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    epollDescriptor = epoll_create1(0);
+    if(epollDescriptor < 0) {
+        perror("Error at creating epoll instance.\n");
+        exit(1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = connection;
+    epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, connection, &event);
+}
+
+GatewayConnection::~GatewayConnection() {
+    close(epollDescriptor);
+    close(connection);
+}
+
+void GatewayConnection::setNonBlocking(int descriptor) {
+    int flags = fcntl(descriptor, F_GETFL, 0);
+    fcntl(descriptor, F_SETFL, flags | O_NONBLOCK);
+}
+
+void GatewayConnection::appendFrame(long session, const unsigned char* payload, int length) {
+    unsigned char* sessionBytes = (unsigned char*) &session;
+    unsigned char* lengthBytes = (unsigned char*) &length;
+    output.insert(output.end(), sessionBytes, sessionBytes + sizeof(long));
+    output.insert(output.end(), lengthBytes, lengthBytes + sizeof(int));
+    if(length > 0) {
+        output.insert(output.end(), payload, payload + length);
+    }
+}
+
+// Called with channelsMutex held.
+GatewayChannel* GatewayConnection::addChannel(long session, int local) {
+    setNonBlocking(local);
+    GatewayChannel* channel = new GatewayChannel();
+    channel->session = session;
+    channel->local = local;
+    channel->outputOffset = 0;
+    channel->events = EPOLLIN;
+    channel->localClosed = false;
+    channel->remoteClosed = false;
+    channel->paused = false;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = local;
+    if(epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, local, &event) < 0) {
+        perror("Error at registering gateway session.\n");
+        close(local);
+        delete channel;
+        return NULL;
+    }
+    channels[session] = channel;
+    channelsByLocal[local] = channel;
+    return channel;
+}
+
+void GatewayConnection::removeChannel(GatewayChannel* channel) {
+    if(channel->events != 0) {
+        epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, channel->local, NULL);
+    }
+    close(channel->local);
+    channelBacklog -= channel->output.size() - channel->outputOffset;
+    channels.erase(channel->session);
+    channelsByLocal.erase(channel->local);
+    delete channel;
+}
+
+int GatewayConnection::openSession() {
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        return -1;
+    }
+    lock_guard<mutex> lock(channelsMutex);
+    if(closed || inputClosed || addChannel(nextSession, pair[0]) == NULL) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    // the server may speak first, so the pump can't wait for our first bytes
+    appendFrame(nextSession++, NULL, GATEWAY_OPEN);
+    flushConnection();
+    return pair[1];
+}
+
+// Hands a payload to the session, keeping what its socket doesn't take yet.
+bool GatewayConnection::deliver(GatewayChannel* channel, const unsigned char* payload, int length) {
+    channel->output.insert(channel->output.end(), payload, payload + length);
+    channelBacklog += length;
+    return flushChannel(channel);
+}
+
+bool GatewayConnection::flushChannel(GatewayChannel* channel) {
+    while(channel->outputOffset < channel->output.size()) {
+        ssize_t written = send(channel->local, channel->output.data() + channel->outputOffset,
+            channel->output.size() - channel->outputOffset, MSG_NOSIGNAL);
+        if(written < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        channel->outputOffset += written;
+        channelBacklog -= written;
+    }
+    channel->output.clear();
+    channel->outputOffset = 0;
+    if(channel->remoteClosed) {
+        shutdown(channel->local, SHUT_WR);
+    }
+    return true;
+}
+
+// Reads local until it hangs up, and asks for writability only while some
+// payload is waiting for it; a local that hung up with nothing pending isn't
+// watched at all, so its hangup can't wake the pump over and over. Neither is
+// one paused until the connection takes the frames already queued.
+void GatewayConnection::watchChannel(GatewayChannel* channel) {
+    bool pendingOutput = channel->outputOffset < channel->output.size();
+    bool reading = !channel->localClosed && output.size() - outputOffset <= GATEWAY_MAX_BACKLOG;
+    if(!channel->localClosed && !reading && !channel->paused) {
+        channel->paused = true;
+        pausedSessions.push_back(channel->session);
+    }
+    unsigned int events = (reading ? EPOLLIN : 0) | (pendingOutput ? EPOLLOUT : 0);
+    if(events == channel->events) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = channel->local;
+    if(events == 0) {
+        epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, channel->local, NULL);
+    }
+    else {
+        epoll_ctl(epollDescriptor, channel->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, channel->local, &event);
+    }
+    channel->events = events;
+}
+
+void GatewayConnection::readChannel(GatewayChannel* channel) {
+    unsigned char chunk[GATEWAY_CHUNK];
+    while(true) {
+        if(output.size() - outputOffset > GATEWAY_MAX_BACKLOG) {
+            watchChannel(channel);
+            return;
+        }
+        ssize_t received = read(channel->local, chunk, GATEWAY_CHUNK);
+        if(received > 0) {
+            appendFrame(channel->session, chunk, received);
+            continue;
+        }
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        // the session is over on this side
+        appendFrame(channel->session, chunk, 0);
+        channel->localClosed = true;
+        if(channel->remoteClosed) {
+            removeChannel(channel);
+            return;
+        }
+        watchChannel(channel);
+        return;
+    }
+}
+
+// Called once the connection took the backlog: the paused sessions are read
+// again.
+void GatewayConnection::resumeChannels() {
+    vector<long> sessions;
+    sessions.swap(pausedSessions);
+    for(size_t i = 0; i < sessions.size(); ++i) {
+        map<long, GatewayChannel*>::iterator found = channels.find(sessions[i]);
+        if(found != channels.end()) {
+            found->second->paused = false;
+            watchChannel(found->second);
+        }
+    }
+}
+
+void GatewayConnection::openRemoteSession(long session) {
+    if(channels.size() >= GATEWAY_MAX_CHANNELS) {
+        appendFrame(session, NULL, 0);
+        return;
+    }
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        perror("Error at opening gateway session.\n");
+        appendFrame(session, NULL, 0);
+        return;
+    }
+    if(addChannel(session, pair[0]) == NULL) {
+        close(pair[1]);
+        appendFrame(session, NULL, 0);
+        return;
+    }
+    dispatch(pair[1]);
+}
+
+// Hands a frame to its session; an empty one ends the remote half.
+void GatewayConnection::receiveFrame(GatewayChannel* channel, const unsigned char* payload, int length) {
+    if(length == 0) {
+        channel->remoteClosed = true;
+        if(channel->localClosed) {
+            removeChannel(channel);
+            return;
+        }
+    }
+    if(!deliver(channel, payload, length)) {
+        // the session hung up without reading everything
+        if(!channel->localClosed) {
+            appendFrame(channel->session, payload, 0);
+        }
+        removeChannel(channel);
+        return;
+    }
+    watchChannel(channel);
+}
+
+// Reads at most GATEWAY_MAX_BACKLOG bytes and hands every complete frame to
+// its session. Returns false once the connection is lost; the other side
+// shutting its half down isn't, the frames it sent before still count.
+bool GatewayConnection::readConnection() {
+    if(inputClosed) {
+        // only a hangup or an error wakes us up for connection now
+        return false;
+    }
+    unsigned char chunk[GATEWAY_CHUNK];
+    while(input.size() - inputOffset < GATEWAY_MAX_BACKLOG) {
+        ssize_t received = read(connection, chunk, GATEWAY_CHUNK);
+        if(received > 0) {
+            input.insert(input.end(), chunk, chunk + received);
+            continue;
+        }
+        if(received == 0) {
+            inputClosed = true;
+            break;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        break;
+    }
+    while(input.size() - inputOffset >= sizeof(long) + sizeof(int)) {
+        long session;
+        int length;
+        memcpy(&session, input.data() + inputOffset, sizeof(long));
+        memcpy(&length, input.data() + inputOffset + sizeof(long), sizeof(int));
+        if(length < GATEWAY_OPEN || length > GATEWAY_MAX_FRAME) {
+            return false;
+        }
+        if(length == GATEWAY_OPEN) {
+            inputOffset += sizeof(long) + sizeof(int);
+            if(accepting && channels.find(session) == channels.end()) {
+                openRemoteSession(session);
+            }
+            continue;
+        }
+        if(input.size() - inputOffset < sizeof(long) + sizeof(int) + length) {
+            break;
+        }
+        const unsigned char* payload = input.data() + inputOffset + sizeof(long) + sizeof(int);
+        inputOffset += sizeof(long) + sizeof(int) + length;
+
+        map<long, GatewayChannel*>::iterator found = channels.find(session);
+        GatewayChannel* channel = found == channels.end() ? NULL : found->second;
+        if(channel == NULL || channel->remoteClosed) {
+            // a session that already ended, or an end frame crossing ours
+            continue;
+        }
+        receiveFrame(channel, payload, length);
+    }
+    if(inputOffset > GATEWAY_CHUNK) {
+        input.erase(input.begin(), input.begin() + inputOffset);
+        inputOffset = 0;
+    }
+    if(inputClosed) {
+        // nothing more comes for the sessions still open, a partial frame included
+        vector<GatewayChannel*> open;
+        for(map<long, GatewayChannel*>::iterator i = channels.begin(); i != channels.end(); ++i) {
+            if(!i->second->remoteClosed) {
+                open.push_back(i->second);
+            }
+        }
+        for(size_t i = 0; i < open.size(); ++i) {
+            receiveFrame(open[i], NULL, 0);
+        }
+    }
+    return true;
+}
+
+bool GatewayConnection::flushConnection() {
+    while(outputOffset < output.size()) {
+        ssize_t written = send(connection, output.data() + outputOffset, output.size() - outputOffset, MSG_NOSIGNAL);
+        if(written < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        outputOffset += written;
+    }
+    if(outputOffset == output.size()) {
+        output.clear();
+        outputOffset = 0;
+    }
+    if(output.size() - outputOffset <= GATEWAY_MAX_BACKLOG && !pausedSessions.empty()) {
+        resumeChannels();
+    }
+    // the connection isn't read while the sessions are behind
+    bool reading = !inputClosed && channelBacklog <= GATEWAY_MAX_BACKLOG;
+    bool pendingOutput = !output.empty();
+    unsigned int events = (reading ? EPOLLIN : 0) | (pendingOutput ? EPOLLOUT : 0);
+    if(events != connectionEvents) {
+        struct epoll_event event;
+        event.events = events;
+        event.data.fd = connection;
+        epoll_ctl(epollDescriptor, EPOLL_CTL_MOD, connection, &event);
+        connectionEvents = events;
+    }
+    return true;
+}
+
+// The pump; returns once the connection is lost, or once the other side
+// ended its half and every session was answered, after every session on it
+// saw its socket close.
+void GatewayConnection::run() {
+    struct epoll_event events[GATEWAY_EVENTS];
+    bool alive = true;
+    while(alive) {
+        int numberOfEvents = epoll_wait(epollDescriptor, events, GATEWAY_EVENTS, -1);
+        if(numberOfEvents < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Error at waiting for gateway events.\n");
+            break;
+        }
+        lock_guard<mutex> lock(channelsMutex);
+        for(int i = 0; i < numberOfEvents && alive; ++i) {
+            if(events[i].data.fd == connection) {
+                if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                    alive = readConnection();
+                }
+                continue;
+            }
+            map<int, GatewayChannel*>::iterator found = channelsByLocal.find(events[i].data.fd);
+            if(found == channelsByLocal.end()) {
+                continue;
+            }
+            GatewayChannel* channel = found->second;
+            if((events[i].events & EPOLLOUT) && !flushChannel(channel)) {
+                // nobody reads what is left, forget the rest of the session
+                channelBacklog -= channel->output.size() - channel->outputOffset;
+                channel->output.clear();
+                channel->outputOffset = 0;
+                channel->remoteClosed = true;
+            }
+            if(!channel->localClosed && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                readChannel(channel);
+            }
+            else if(channel->localClosed && (channel->remoteClosed || (events[i].events & (EPOLLERR | EPOLLHUP)))) {
+                removeChannel(channel);
+            }
+            else {
+                watchChannel(channel);
+            }
+        }
+        alive = alive && flushConnection();
+        alive = alive && !(inputClosed && channels.empty() && output.empty());
+    }
+    lock_guard<mutex> lock(channelsMutex);
+    closed = true;
+    while(!channels.empty()) {
+        removeChannel(channels.begin()->second);
+    }
+}
+
+// Accepts gateway connections on a port of their own, one pump thread each.
+// Every session they open is handed to dispatch as a connected socket.
+class Gateway {
+public:
+    static void serve(int port, void (*dispatch)(int));
+};
+
+void Gateway::serve(int port, void (*dispatch)(int)) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sd < 0) {
+        perror("Error at creating gateway socket.\n");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if(bind(sd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(sd, 5) < 0) {
+        perror("Error at binding gateway port.\n");
+        exit(1);
+    }
+    thread([sd, dispatch] {
+        while(true) {
+            int client = accept(sd, NULL, NULL);
+            if(client < 0) {
+                perror("Error at accepting gateway.\n");
+                continue;
+            }
+            thread([client, dispatch] {
+                GatewayConnection gateway(client, true, dispatch);
+                gateway.run();
+            }).detach();
+        }
+    }).detach();
+}
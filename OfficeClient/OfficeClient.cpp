@@ -13,28 +13,69 @@
 extern int errno;
 
 #define PORT 2021
+#define DEFAULT_BULK_CONNECTIONS 8
+#define GATEWAY_PORT 2031
 
-int main ()
+// Usage: officeClient [--v1 | --non-interactive] [--bulk idsFile [--connections C] [--gateway [port]]]
+//                     [--fixed-width]
+// --v1 registers with the original protocol, for OfficeServers that predate v2.
+// --non-interactive sends everything at once, opening the indexes a hash of
+// the message picks (needs a server with --security-constant 256 or more).
+// --bulk registers every ID in idsFile over C concurrent connections (8 by
+// default), writes their credentials and reports registrations per second.
+// --gateway carries those C sessions over one gateway connection to port
+// (2031) instead, see officeServer --gateway.
+// --fixed-width blinds with the fixed-width Montgomery arithmetic of
+// MontgomeryEngine.h instead of ZZ.
+int main (int argc, char* argv[])
 {
-    int sd;
-    struct sockaddr_in server;
-
-    if ((sd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+    bool version2 = true;
+    bool nonInteractive = false;
+    const char* idsFile = NULL;
+    int connections = DEFAULT_BULK_CONNECTIONS;
+    int gatewayPort = 0;
+    for (int i = 1; i < argc; ++i)
     {
-        perror ("Error at creating socket\n");
-        return errno;
+        if (strcmp (argv[i], "--v1") == 0)
+        {
+            version2 = false;
+        }
+        if (strcmp (argv[i], "--non-interactive") == 0)
+        {
+            nonInteractive = true;
+        }
+        if (strcmp (argv[i], "--bulk") == 0 && i + 1 < argc)
+        {
+            idsFile = argv[++i];
+        }
+        if (strcmp (argv[i], "--gateway") == 0)
+        {
+            gatewayPort = GATEWAY_PORT;
+            if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+            {
+                gatewayPort = atoi (argv[++i]);
+            }
+        }
+        if (strcmp (argv[i], "--connections") == 0 && i + 1 < argc)
+        {
+            connections = max (1, atoi (argv[++i]));
+        }
+        if (strcmp (argv[i], "--fixed-width") == 0)
+        {
+            fixedWidthArithmetic = true;
+        }
     }
+    struct sockaddr_in server;
 
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = inet_addr("127.0.0.1"); // localhost
     server.sin_port = htons (PORT);
 
-    if (connect (sd, (struct sockaddr *) &server,sizeof (struct sockaddr)) == -1)
+    if (idsFile != NULL)
     {
-        perror ("Error at connecting to server.\n");
-        return errno;
+        Client::executeBulk(server, idsFile, connections, version2, nonInteractive, gatewayPort);
+        return 0;
     }
 
-    Client::execute(sd);
-    close (sd);
+    Client::execute(server, version2, nonInteractive);
 }
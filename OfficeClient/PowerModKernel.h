@@ -0,0 +1,124 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include "MontgomeryEngine.h"
+
+// exponents below 2 ^ SMALL_EXPONENT_BITS are handled by a fixed chain
+#define SMALL_EXPONENT_BITS 16
+
+using namespace std;
+using namespace NTL;
+
+// x ^ g + y ^ g mod n, the evaluation behind both GFunction and FFunction.
+//
+// For a small g (the functions' default is a cube) both powers follow the
+// same fixed square-and-multiply chain derived from g once, interleaved step
+// by step, and the sum is reduced with one conditional subtraction instead
+// of a division. For a large g the two powers have nothing to share (a
+// shared squaring chain, as in Shamir's trick, only helps x ^ a * y ^ b, not
+// a sum), so each one goes to NTL's windowed PowerMod.
+//
+// With fixedWidthArithmetic on, a modulus MontgomeryEngine supports is
+// handed to it instead, and so are the longer chains below, which then stay
+// in Montgomery form from their inputs to their result.
+class PowerModKernel {
+private:
+    static void powerPairBySmallChain(ZZ& xg, ZZ& yg, const ZZ& x, const ZZ& y, long g, const ZZ& n);
+
+public:
+    static ZZ sumOfPowers(const ZZ& x, const ZZ& y, const ZZ& g, const ZZ& n);
+    // r ^ 3 * F(G(a, c), G(op, d)) mod n, g and f being the exponents of G and F
+    static ZZ blind(const ZZ& a, const ZZ& c, const ZZ& op, const ZZ& d, const ZZ& r, long g, long f, const ZZ& n);
+    // rCubed * F(x, G(op, d)) mod n
+    static ZZ bindID(const ZZ& x, const ZZ& rCubed, const ZZ& op, const ZZ& d, long g, long f, const ZZ& n);
+    // the product over i of F(first, G(second, third)) when requests[i] is 0,
+    // of F(G(first, second), third) otherwise
+    static ZZ productOfFunctions(const int* requests, const ZZ* first, const ZZ* second, const ZZ* third,
+        int count, long g, long f, const ZZ& n);
+};
+
+void PowerModKernel::powerPairBySmallChain(ZZ& xg, ZZ& yg, const ZZ& x, const ZZ& y, long g, const ZZ& n) {
+    if(g == 0) {
+        xg = 1;
+        yg = 1;
+        return;
+    }
+    // MulMod and SqrMod want their inputs already reduced
+    ZZ xBase = x % n;
+    ZZ yBase = y % n;
+    xg = xBase;
+    yg = yBase;
+    int highestBit = 0;
+    while((g >> (highestBit + 1)) != 0) {
+        ++highestBit;
+    }
+    for(int bitIndex = highestBit - 1; bitIndex >= 0; --bitIndex) {
+        SqrMod(xg, xg, n);
+        SqrMod(yg, yg, n);
+        if((g >> bitIndex) & 1) {
+            MulMod(xg, xg, xBase, n);
+            MulMod(yg, yg, yBase, n);
+        }
+    }
+}
+
+ZZ PowerModKernel::sumOfPowers(const ZZ& x, const ZZ& y, const ZZ& g, const ZZ& n) {
+    ZZ xg, yg;
+    MontgomeryEngine* engine;
+    if(NumBits(g) <= SMALL_EXPONENT_BITS && (engine = MontgomeryEngine::cached(n)) != NULL) {
+        return engine->sumOfPowers(x, y, conv<long>(g));
+    }
+    if(NumBits(g) <= SMALL_EXPONENT_BITS) {
+        powerPairBySmallChain(xg, yg, x, y, conv<long>(g), n);
+    }
+    else {
+        xg = PowerMod(x % n, g, n);
+        yg = PowerMod(y % n, g, n);
+    }
+    ZZ result = xg + yg;
+    if(result >= n) {
+        result -= n;
+    }
+    return result;
+}
+
+ZZ PowerModKernel::blind(const ZZ& a, const ZZ& c, const ZZ& op, const ZZ& d, const ZZ& r, long g, long f, const ZZ& n) {
+    MontgomeryEngine* engine = MontgomeryEngine::cached(n);
+    if(engine != NULL) {
+        return engine->blind(a, c, op, d, r, g, f);
+    }
+    ZZ x = sumOfPowers(a, c, conv<ZZ>(g), n);
+    ZZ y = sumOfPowers(op, d, conv<ZZ>(g), n);
+    ZZ fResult = sumOfPowers(x, y, conv<ZZ>(f), n);
+    return (r * r * r * fResult) % n;
+}
+
+ZZ PowerModKernel::bindID(const ZZ& x, const ZZ& rCubed, const ZZ& op, const ZZ& d, long g, long f, const ZZ& n) {
+    MontgomeryEngine* engine = MontgomeryEngine::cached(n);
+    if(engine != NULL) {
+        return engine->bindID(x, rCubed, op, d, g, f);
+    }
+    ZZ y = sumOfPowers(op, d, conv<ZZ>(g), n);
+    ZZ fResult = sumOfPowers(x, y, conv<ZZ>(f), n);
+    return MulMod(rCubed, fResult, n);
+}
+
+ZZ PowerModKernel::productOfFunctions(const int* requests, const ZZ* first, const ZZ* second, const ZZ* third,
+    int count, long g, long f, const ZZ& n) {
+    MontgomeryEngine* engine = MontgomeryEngine::cached(n);
+    if(engine != NULL) {
+        return engine->productOfFunctions(requests, first, second, third, count, g, f);
+    }
+    ZZ product;
+    product = 1;
+    for(int i = 0; i < count; ++i) {
+        ZZ res;
+        if(requests[i] == 0) {
+            res = sumOfPowers(first[i], sumOfPowers(second[i], third[i], conv<ZZ>(g), n), conv<ZZ>(f), n);
+        }
+        else {
+            res = sumOfPowers(sumOfPowers(first[i], second[i], conv<ZZ>(g), n), third[i], conv<ZZ>(f), n);
+        }
+        product = (product * res) % n;
+    }
+    return product;
+}
@@ -0,0 +1,302 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <memory>
+#include <vector>
+#include "FFunction.h"
+#include "GFunction.h"
+#include "WireCodec.h"
+#include "FiatShamir.h"
+
+using namespace std;
+using namespace NTL;
+
+// what the OfficeServer answers an ID with
+#define ID_OK 0
+#define ID_INVALID 1
+#define ID_USED 2
+
+#define NOT_OK 1
+
+// what registerVoter reports besides ID_OK, ID_INVALID and ID_USED
+#define REGISTRATION_REFUSED 3 // the server found a badly formed blinded value
+#define CONNECTION_LOST 4
+
+// the HomeServer's verdicts
+#define VOTE_OK 0
+#define VOTE_INVALID 1
+#define VOTE_FRAUD 2
+
+// announces protocol v2 where a v1 client sends the length of its ID
+#define PROTOCOL_V2_REGISTRATION -2L
+// announces that the opened indexes are hashed from the message itself
+#define PROTOCOL_NONINTERACTIVE_REGISTRATION -3L
+
+// sent instead of the security constant when many ballots share a connection
+#define BATCH_SUBMISSION -1
+// sent before the security constant to get the requests as one bit vector
+#define PROTOCOL_V2_VOTE -2
+// sent instead to reveal, in the same message, the values a hash of the
+// ballot requests
+#define PROTOCOL_NONINTERACTIVE_VOTE -3
+
+// What one registration draws and learns. Keeping it out of the globals lets
+// bulk registration run many of them side by side.
+class Registration {
+public:
+    ZZ ID;
+    vector<ZZ> a, c, d, r;
+    vector<ZZ> x, rCubed; // G(a, c) and r ^ 3, all the blinding that doesn't need the ID
+    vector<ZZ> blindSignatures;
+    unique_ptr<bool[]> chosenIndexes;
+    ZZ pseudonym;
+    bool sent; // the blinded values went out, the randomness can't serve another ID
+
+    Registration() : sent(false) {}
+};
+
+// What the OfficeClient writes for one voter at registration: the unopened
+// values first, the HomeClient reveals from those.
+class Credentials {
+public:
+    ZZ ID;
+    ZZ pseudonym;
+    int securityConstant;
+    vector<ZZ> a, c, d, r;
+};
+
+// The voter's side of both protocols, shared by the OfficeClient, the
+// HomeClient and the LoadGenerator so they can't drift apart. Every step
+// runs on a connection whose greeting the caller already read, with the
+// server's n (and k for a registration) passed in.
+class VoterProtocol {
+private:
+    static void deriveIndexes(Registration& registration, const ZZ& compositeNumber, int securityConstant);
+    static void sendBlindSignatures(WireCodec& codec, Registration& registration, int securityConstant);
+    static void sendParameters(WireCodec& codec, Registration& registration, int securityConstant);
+
+public:
+    static void createBlindSignatures(Registration& registration, const ZZ& compositeNumber, int securityConstant);
+    static int registerVoter(WireCodec& codec, Registration& registration, const ZZ& compositeNumber, int securityConstant,
+        bool version2, bool nonInteractive);
+    static void keepCredentials(Registration& registration, int securityConstant, Credentials& credentials);
+    static void revealSubsecrets(WireCodec& codec, const int* requests, Credentials& credentials);
+    static int castBallot(WireCodec& codec, Credentials& credentials, const ZZ& compositeNumber, const ZZ& response,
+        bool version2, bool nonInteractive, ZZ& foundID);
+};
+
+void VoterProtocol::createBlindSignatures(Registration& registration, const ZZ& compositeNumber, int securityConstant) {
+    registration.blindSignatures.clear();
+    for(int i = 0; i < securityConstant; ++i) {
+        ZZ op;
+        op = registration.a[i] ^ registration.ID;
+        registration.blindSignatures.push_back(PowerModKernel::bindID(registration.x[i], registration.rCubed[i], op,
+            registration.d[i], G_EXPONENT, F_EXPONENT, compositeNumber));
+    }
+}
+
+// The same transcript OfficeServer hashes, so both derive the same indexes.
+void VoterProtocol::deriveIndexes(Registration& registration, const ZZ& compositeNumber, int securityConstant) {
+    Transcript transcript("evote registration");
+    transcript.add(compositeNumber);
+    transcript.add((long) securityConstant);
+    transcript.add(registration.ID);
+    for(int i = 0; i < securityConstant; ++i) {
+        transcript.add(registration.blindSignatures[i]);
+    }
+    transcript.chooseIndexes(registration.chosenIndexes.get(), securityConstant, securityConstant / 2);
+}
+
+void VoterProtocol::sendBlindSignatures(WireCodec& codec, Registration& registration, int securityConstant) {
+    for(int i = 0; i < securityConstant; ++i) {
+        codec.sendNumber(registration.blindSignatures[i]);
+    }
+    registration.sent = true;
+}
+
+void VoterProtocol::sendParameters(WireCodec& codec, Registration& registration, int securityConstant) {
+    for(int i = 0; i < securityConstant; ++i) {
+        if(registration.chosenIndexes[i]) {
+            codec.sendNumber(registration.a[i]);
+            codec.sendNumber(registration.c[i]);
+            codec.sendNumber(registration.d[i]);
+            codec.sendNumber(registration.r[i]);
+        }
+    }
+}
+
+// Runs one registration with the randomness the caller drew (k values of
+// each kind, not sent yet). The blinded values are computed unless they
+// already match the ID.
+int VoterProtocol::registerVoter(WireCodec& codec, Registration& registration, const ZZ& compositeNumber, int securityConstant,
+    bool version2, bool nonInteractive) {
+    registration.chosenIndexes.reset(new bool[securityConstant]);
+    for(int i = 0; i < securityConstant; ++i) {
+        registration.chosenIndexes[i] = false;
+    }
+    if(version2) {
+        if(registration.blindSignatures.empty()) {
+            createBlindSignatures(registration, compositeNumber, securityConstant);
+        }
+        codec.sendLong(nonInteractive ? PROTOCOL_NONINTERACTIVE_REGISTRATION : PROTOCOL_V2_REGISTRATION);
+        codec.sendNumber(registration.ID);
+        sendBlindSignatures(codec, registration, securityConstant);
+        if(nonInteractive) {
+            deriveIndexes(registration, compositeNumber, securityConstant);
+            sendParameters(codec, registration, securityConstant);
+        }
+    }
+    else {
+        codec.sendNumber(registration.ID);
+    }
+    int response = codec.receiveInt();
+    if(codec.isBroken()) {
+        return CONNECTION_LOST;
+    }
+    if(response != ID_OK) {
+        // ID isn't valid or was already used
+        return response == ID_USED ? ID_USED : ID_INVALID;
+    }
+
+    if(!version2) {
+        if(registration.blindSignatures.empty()) {
+            createBlindSignatures(registration, compositeNumber, securityConstant);
+        }
+        sendBlindSignatures(codec, registration, securityConstant);
+    }
+
+    // a non-interactive client already sent its openings
+    if(version2 && !nonInteractive) {
+        if(!codec.receiveBits(registration.chosenIndexes.get(), securityConstant)) {
+            return CONNECTION_LOST;
+        }
+    }
+    else if(!version2) {
+        for(int i = 0; i < securityConstant / 2; ++i) {
+            int index = codec.receiveInt();
+            if(codec.isBroken() || index < 0 || index >= securityConstant) {
+                return CONNECTION_LOST;
+            }
+            registration.chosenIndexes[index] = true;
+        }
+    }
+    if(!nonInteractive) {
+        sendParameters(codec, registration, securityConstant);
+    }
+    int feedBack = codec.receiveInt();
+    if(codec.isBroken()) {
+        return CONNECTION_LOST;
+    }
+    if(feedBack == NOT_OK) {
+        return REGISTRATION_REFUSED;
+    }
+    // else, the response is OKEY
+    ZZ noisedPseudonym;
+    noisedPseudonym = codec.receiveNumber();
+    if(codec.isBroken()) {
+        return CONNECTION_LOST;
+    }
+    ZZ noise;
+    noise = 1;
+    for(int i = 0; i < securityConstant; ++i) {
+        if(!registration.chosenIndexes[i]) {
+            noise = (noise * registration.r[i]) % compositeNumber;
+        }
+    }
+    // the noise has to be removed modulo n, an integer division only
+    // worked by accident for tiny moduli
+    registration.pseudonym = MulMod(noisedPseudonym, InvMod(noise, compositeNumber), compositeNumber);
+    return ID_OK;
+}
+
+void VoterProtocol::keepCredentials(Registration& registration, int securityConstant, Credentials& credentials) {
+    credentials.ID = registration.ID;
+    credentials.pseudonym = registration.pseudonym;
+    credentials.securityConstant = securityConstant;
+    credentials.a.clear();
+    credentials.c.clear();
+    credentials.d.clear();
+    credentials.r.clear();
+    for(int pass = 0; pass < 2; ++pass) {
+        for(int i = 0; i < securityConstant; ++i) {
+            if(registration.chosenIndexes[i] == (pass == 1)) {
+                credentials.a.push_back(registration.a[i]);
+                credentials.c.push_back(registration.c[i]);
+                credentials.d.push_back(registration.d[i]);
+                credentials.r.push_back(registration.r[i]);
+            }
+        }
+    }
+}
+
+void VoterProtocol::revealSubsecrets(WireCodec& codec, const int* requests, Credentials& credentials) {
+    for(int i = 0; i < (credentials.securityConstant - credentials.securityConstant / 2); ++i) {
+        ZZ part = credentials.a[i] ^ credentials.ID;
+        if(requests[i] == 0) {
+            codec.sendNumber(GFunction::applyFunction(credentials.a[i], credentials.c[i]));
+            codec.sendNumber(part);
+            codec.sendNumber(credentials.d[i]);
+        }
+        else {
+            codec.sendNumber(credentials.a[i]);
+            codec.sendNumber(credentials.c[i]);
+            codec.sendNumber(GFunction::applyFunction(part, credentials.d[i]));
+        }
+    }
+}
+
+// Casts response as the voter's ballot. A non-interactive ballot carries its
+// revealed values: the requests are hashed from the ballot and the nonce the
+// server answers PROTOCOL_NONINTERACTIVE_VOTE with, the way
+// HomeServer::deriveRequests does it, so the vote is one request and one
+// response; it needs credentials with at least
+// FIAT_SHAMIR_MIN_SECURITY_CONSTANT blinded values. Returns the verdict,
+// foundID being set for VOTE_FRAUD, or -1 when the session broke off.
+int VoterProtocol::castBallot(WireCodec& codec, Credentials& credentials, const ZZ& compositeNumber, const ZZ& response,
+    bool version2, bool nonInteractive, ZZ& foundID) {
+    ZZ nonce;
+    if(nonInteractive) {
+        codec.sendInt(PROTOCOL_NONINTERACTIVE_VOTE);
+        nonce = codec.receiveNumber();
+    }
+    else if(version2) {
+        codec.sendInt(PROTOCOL_V2_VOTE);
+    }
+    codec.sendInt(credentials.securityConstant);
+
+    // the public exponent is 3
+    ZZ encryptedPseudonym = PowerMod(credentials.pseudonym, 3, compositeNumber);
+    ZZ encryptedResponse = PowerMod(response, 3, compositeNumber);
+    codec.sendNumber(encryptedPseudonym);
+    codec.sendNumber(encryptedResponse);
+
+    // The first k - k / 2 indexes are the ones that we look for
+    int numberOfRequests = credentials.securityConstant - credentials.securityConstant / 2;
+    vector<int> requests(numberOfRequests);
+    if(nonInteractive) {
+        Transcript transcript("evote ballot");
+        transcript.add(compositeNumber);
+        transcript.add(nonce);
+        transcript.add((long) credentials.securityConstant);
+        transcript.add(encryptedPseudonym);
+        transcript.add(encryptedResponse);
+        transcript.chooseBits(requests.data(), numberOfRequests);
+    }
+    else if(version2) {
+        codec.receiveBits(requests.data(), numberOfRequests);
+    }
+    else {
+        for(int i = 0; i < numberOfRequests; ++i) {
+            requests[i] = codec.receiveInt();
+        }
+    }
+    revealSubsecrets(codec, requests.data(), credentials);
+
+    int verdict = codec.receiveInt();
+    if(verdict == VOTE_FRAUD) {
+        foundID = codec.receiveNumber();
+    }
+    if(codec.isBroken() || verdict < VOTE_OK || verdict > VOTE_FRAUD) {
+        return -1;
+    }
+    return verdict;
+}
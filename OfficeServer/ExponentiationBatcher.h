@@ -0,0 +1,117 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include "CRTContext.h"
+#include "TaskScheduler.h"
+
+#define DEFAULT_BATCH_WINDOW 200 // microseconds
+
+using namespace std;
+using namespace NTL;
+
+// One exponentiation waiting for a lane.
+class PendingExponentiation {
+public:
+    const CRTContext* context;
+    const ZZ* message;
+    ZZ* result;
+    bool done;
+};
+
+deque<PendingExponentiation*> pendingExponentiations;
+mutex pendingExponentiationsMutex;
+condition_variable exponentiationsDone;
+long batchWindow = 0; // microseconds a partial group waits for company, 0 to run it at once
+
+// Fills the lanes of MultiBufferEngine across sessions. A caller's messages
+// go out in full groups of MULTI_BUFFER_LANES right away, spread over the
+// compute threads; the rest wait in a shared queue for at most batchWindow.
+// Whoever finds a full group queued, or whose window has passed, runs the
+// group at the front, its own messages or another session's, so waiting
+// threads do the work and nothing waits longer than its window and a group.
+class ExponentiationBatcher {
+private:
+    static void runGroup(unique_lock<mutex>& lock);
+
+public:
+    // results[i] = messages[i] ^ d mod n for i < count
+    static void exponentiate(const CRTContext& context, const ZZ* messages, ZZ* results, int count);
+};
+
+void ExponentiationBatcher::runGroup(unique_lock<mutex>& lock) {
+    // the lanes share a key, so a group only takes the front's context
+    const CRTContext* context = pendingExponentiations.front()->context;
+    PendingExponentiation* group[MULTI_BUFFER_LANES];
+    int count = 0;
+    while(count < MULTI_BUFFER_LANES && !pendingExponentiations.empty()
+        && pendingExponentiations.front()->context == context) {
+        group[count++] = pendingExponentiations.front();
+        pendingExponentiations.pop_front();
+    }
+    lock.unlock();
+    ZZ messages[MULTI_BUFFER_LANES], results[MULTI_BUFFER_LANES];
+    for(int i = 0; i < count; ++i) {
+        messages[i] = *group[i]->message;
+    }
+    context->exponentiateLanes(messages, results, count);
+    lock.lock();
+    for(int i = 0; i < count; ++i) {
+        *group[i]->result = results[i];
+        group[i]->done = true;
+    }
+    exponentiationsDone.notify_all();
+}
+
+void ExponentiationBatcher::exponentiate(const CRTContext& context, const ZZ* messages, ZZ* results, int count) {
+    if(!multiBufferExponentiation) {
+        // each message goes to whichever core is free
+        TaskScheduler::parallelFor(count, [&](int i) {
+            results[i] = context.exponentiate(messages[i]);
+        });
+        return;
+    }
+    int groups = batchWindow > 0 ? count / MULTI_BUFFER_LANES : (count + MULTI_BUFFER_LANES - 1) / MULTI_BUFFER_LANES;
+    TaskScheduler::parallelFor(groups, [&](int g) {
+        int start = g * MULTI_BUFFER_LANES;
+        context.exponentiateLanes(messages + start, results + start, min(MULTI_BUFFER_LANES, count - start));
+    });
+    int start = min(count, groups * MULTI_BUFFER_LANES);
+    if(start == count) {
+        return;
+    }
+    vector<PendingExponentiation> pending(count - start);
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::microseconds(batchWindow);
+    unique_lock<mutex> lock(pendingExponentiationsMutex);
+    for(size_t i = 0; i < pending.size(); ++i) {
+        pending[i].context = &context;
+        pending[i].message = messages + start + i;
+        pending[i].result = results + start + i;
+        pending[i].done = false;
+        pendingExponentiations.push_back(&pending[i]);
+    }
+    while(true) {
+        bool finished = true;
+        for(size_t i = 0; i < pending.size(); ++i) {
+            finished = finished && pending[i].done;
+        }
+        if(finished) {
+            return;
+        }
+        bool expired = chrono::steady_clock::now() >= deadline;
+        if(!pendingExponentiations.empty() && (pendingExponentiations.size() >= MULTI_BUFFER_LANES || expired)) {
+            runGroup(lock);
+        }
+        else if(expired) {
+            // ours are running on another thread
+            exponentiationsDone.wait(lock);
+        }
+        else {
+            exponentiationsDone.wait_until(lock, deadline);
+        }
+    }
+}
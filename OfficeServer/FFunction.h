@@ -1,17 +1,35 @@
+#pragma once
 #include <NTL/ZZ.h>
+#include "PowerModKernel.h"
+
+#define F_EXPONENT 3
 
 using namespace std;
 using namespace NTL;
 
 class FFunction {
+private:
+    static ZZ exponent;
+    static ZZ modulus;
 
 public:
-    static ZZ applyFunction(ZZ& firstParameter, ZZ& secondParameter);
+    // the two-parameter form evaluates modulo the n given here
+    static void configure(const ZZ& compositeNumber);
+    static ZZ applyFunction(const ZZ& firstParameter, const ZZ& secondParameter);
+    static ZZ applyFunction(const ZZ& firstParameter, const ZZ& secondParameter, const ZZ& g, const ZZ& compositeNumber);
 };
 
-ZZ FFunction::applyFunction(ZZ& firstParameter, ZZ& secondParameter) {
-    ZZ result;
-    result = 1;
+ZZ FFunction::exponent = conv<ZZ>(F_EXPONENT);
+ZZ FFunction::modulus;
+
+void FFunction::configure(const ZZ& compositeNumber) {
+    modulus = compositeNumber;
+}
+
+ZZ FFunction::applyFunction(const ZZ& firstParameter, const ZZ& secondParameter) {
+    return applyFunction(firstParameter, secondParameter, exponent, modulus);
+}
 
-    return result;
+ZZ FFunction::applyFunction(const ZZ& firstParameter, const ZZ& secondParameter, const ZZ& g, const ZZ& compositeNumber) {
+    return PowerModKernel::sumOfPowers(firstParameter, secondParameter, g, compositeNumber);
 }
@@ -0,0 +1,133 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "WireCodec.h"
+#include "CRTContext.h"
+
+#define KEY_FILE_MAGIC "EVOTEKEY"
+#define KEY_FILE_VERSION 1
+#define KEY_FILE_NUMBERS 7
+
+using namespace std;
+using namespace NTL;
+
+// Fixed-size head of the binary key file. It is followed by the private key,
+// the composite number, both primes and the three CRT values, each in the
+// wire encoding, then an FNV-1a checksum of everything before it.
+class KeyFileHeader {
+public:
+    char magic[8];
+    int version;
+    int modulusBits;
+};
+
+// The RSA key together with its CRT precomputation, so a restarted server
+// loads it instead of searching for primes and inverting again.
+class KeyFile {
+private:
+    static unsigned int checksum(const unsigned char* bytes, size_t length);
+
+public:
+    static bool save(const char* path, const ZZ& privateKey, const ZZ& compositeNumber, const CRTContext& context);
+    static bool load(const char* path, ZZ& privateKey, ZZ& compositeNumber, CRTContext& context);
+};
+
+unsigned int KeyFile::checksum(const unsigned char* bytes, size_t length) {
+    unsigned int hash = 2166136261u;
+    for(size_t i = 0; i < length; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool KeyFile::save(const char* path, const ZZ& privateKey, const ZZ& compositeNumber, const CRTContext& context) {
+    KeyFileHeader header;
+    memset(&header, 0, sizeof(KeyFileHeader));
+    memcpy(header.magic, KEY_FILE_MAGIC, 8);
+    header.version = KEY_FILE_VERSION;
+    header.modulusBits = NumBits(compositeNumber);
+
+    vector<unsigned char> contents((unsigned char*) &header, (unsigned char*) &header + sizeof(KeyFileHeader));
+    const ZZ* numbers[KEY_FILE_NUMBERS] = {&privateKey, &compositeNumber, &context.firstPrimeNumber,
+        &context.secondPrimeNumber, &context.firstModularExpression, &context.secondModularExpression,
+        &context.firstInvModularSecond};
+    for(int i = 0; i < KEY_FILE_NUMBERS; ++i) {
+        WireCodec::appendNumber(contents, *numbers[i]);
+    }
+    unsigned int sum = checksum(contents.data(), contents.size());
+    contents.insert(contents.end(), (unsigned char*) &sum, (unsigned char*) &sum + sizeof(unsigned int));
+
+    // written aside, synced and renamed, so a crash never leaves half a key
+    // behind; only the owner may read it, it holds the private key
+    string temporaryPath = string(path) + ".tmp";
+    int descriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(descriptor < 0) {
+        return false;
+    }
+    size_t done = 0;
+    while(done < contents.size()) {
+        ssize_t written = write(descriptor, contents.data() + done, contents.size() - done);
+        if(written <= 0) {
+            break;
+        }
+        done += written;
+    }
+    bool synced = done == contents.size() && fsync(descriptor) == 0;
+    if(close(descriptor) < 0 || !synced || rename(temporaryPath.c_str(), path) < 0) {
+        return false;
+    }
+    // the rename itself must survive a crash too
+    string directoryPath = string(path);
+    size_t slash = directoryPath.rfind('/');
+    directoryPath = slash == string::npos ? "." : directoryPath.substr(0, slash + 1);
+    int directory = open(directoryPath.c_str(), O_RDONLY);
+    if(directory >= 0) {
+        fsync(directory);
+        close(directory);
+    }
+    return true;
+}
+
+bool KeyFile::load(const char* path, ZZ& privateKey, ZZ& compositeNumber, CRTContext& context) {
+    FILE* in = fopen(path, "rb");
+    if(in == NULL) {
+        return false;
+    }
+    vector<unsigned char> contents;
+    unsigned char chunk[4096];
+    size_t received;
+    while((received = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        contents.insert(contents.end(), chunk, chunk + received);
+    }
+    fclose(in);
+
+    KeyFileHeader header;
+    if(contents.size() < sizeof(KeyFileHeader) + sizeof(unsigned int)) {
+        return false;
+    }
+    memcpy(&header, contents.data(), sizeof(KeyFileHeader));
+    size_t end = contents.size() - sizeof(unsigned int);
+    unsigned int expected;
+    memcpy(&expected, contents.data() + end, sizeof(unsigned int));
+    if(memcmp(header.magic, KEY_FILE_MAGIC, 8) != 0 || header.version != KEY_FILE_VERSION
+        || checksum(contents.data(), end) != expected) {
+        return false;
+    }
+    ZZ* numbers[KEY_FILE_NUMBERS] = {&privateKey, &compositeNumber, &context.firstPrimeNumber,
+        &context.secondPrimeNumber, &context.firstModularExpression, &context.secondModularExpression,
+        &context.firstInvModularSecond};
+    size_t offset = sizeof(KeyFileHeader), used;
+    for(int i = 0; i < KEY_FILE_NUMBERS; ++i) {
+        if(WireCodec::parseNumber(contents.data() + offset, end - offset, *numbers[i], used) != FRAME_COMPLETE) {
+            return false;
+        }
+        offset += used;
+    }
+    context.prepareEngines();
+    return offset == end;
+}
@@ -0,0 +1,299 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define MAX_PHASES 16
+#define HISTOGRAM_SUB_BUCKETS 16 // per power of two, so a bucket is at most 1/16 wide
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + 37 * HISTOGRAM_SUB_BUCKETS)
+
+using namespace std;
+
+enum Counter {
+    SESSIONS_STARTED,
+    SESSIONS_FINISHED,
+    SESSIONS_COMPLETED,
+    REJECTED_ID_INVALID,
+    REJECTED_ID_USED,
+    REJECTED_NOT_OK,
+    REJECTED_INVALID,
+    REJECTED_FRAUD,
+    REJECTED_BUSY,
+    SESSIONS_TIMED_OUT,
+    SESSIONS_OVERSIZED,
+    SESSION_BYTES_READ,
+    SESSION_BYTES_WRITTEN,
+    SESSION_SYSCALLS,
+    NUMBER_OF_COUNTERS
+};
+
+const char* counterNames[NUMBER_OF_COUNTERS] = {
+    "sessions_started_total", "sessions_finished_total", "sessions_completed_total",
+    "sessions_rejected_total{reason=\"ID_INVALID\"}", "sessions_rejected_total{reason=\"ID_USED\"}",
+    "sessions_rejected_total{reason=\"NOT_OK\"}", "sessions_rejected_total{reason=\"INVALID\"}",
+    "sessions_rejected_total{reason=\"FRAUD\"}", "sessions_rejected_total{reason=\"BUSY\"}",
+    "sessions_timed_out_total", "sessions_oversized_total",
+    "session_bytes_read_total", "session_bytes_written_total", "session_syscalls_total"
+};
+
+// The counters and phase histograms of one thread. Only the owner writes, with
+// plain relaxed stores, so the hot path never contends on a shared cache line;
+// a scrape sums every shard.
+class MetricsShard {
+public:
+    atomic<long> counters[NUMBER_OF_COUNTERS];
+    const char* phaseNames[MAX_PHASES];
+    atomic<int> numberOfPhases;
+    atomic<long> phaseBuckets[MAX_PHASES][HISTOGRAM_BUCKETS];
+    atomic<long> phaseSums[MAX_PHASES];
+
+    MetricsShard() : numberOfPhases(0) {
+        for(int i = 0; i < NUMBER_OF_COUNTERS; ++i) {
+            counters[i] = 0;
+        }
+        for(int p = 0; p < MAX_PHASES; ++p) {
+            phaseSums[p] = 0;
+            for(int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+                phaseBuckets[p][b] = 0;
+            }
+        }
+    }
+};
+
+atomic<bool> metricsEnabled(false);
+vector<MetricsShard*> metricsShards; // never freed, a scrape may still read them
+vector<string (*)()> metricsSources; // more lines for the scrape, in the same format
+mutex metricsShardsMutex;
+thread_local MetricsShard* threadMetricsShard = NULL;
+
+// Counters and log-linear (HDR style) latency histograms, served in the
+// Prometheus text format to whoever connects to the metrics port.
+class Metrics {
+private:
+    static MetricsShard* shard();
+    static void bump(atomic<long>& value, long amount) {
+        value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+    static int bucketOf(long microseconds);
+    static long lowerBound(int bucket);
+    static string scrape();
+    static void serveLoop(int sd);
+
+public:
+    static bool isEnabled() { return metricsEnabled.load(memory_order_relaxed); }
+    static void serve(int port);
+    static void addSource(string (*source)());
+    static void count(Counter counter, long amount = 1);
+    static void observe(const char* phase, long microseconds);
+};
+
+MetricsShard* Metrics::shard() {
+    if(threadMetricsShard == NULL) {
+        threadMetricsShard = new MetricsShard();
+        lock_guard<mutex> lock(metricsShardsMutex);
+        metricsShards.push_back(threadMetricsShard);
+    }
+    return threadMetricsShard;
+}
+
+int Metrics::bucketOf(long microseconds) {
+    if(microseconds < HISTOGRAM_SUB_BUCKETS) {
+        return microseconds < 0 ? 0 : microseconds;
+    }
+    int exponent = 63 - __builtin_clzl(microseconds); // >= 4
+    int subBucket = (microseconds >> (exponent - 4)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    int bucket = HISTOGRAM_SUB_BUCKETS + (exponent - 4) * HISTOGRAM_SUB_BUCKETS + subBucket;
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+long Metrics::lowerBound(int bucket) {
+    if(bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS + 4;
+    long subBucket = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + subBucket) << (exponent - 4);
+}
+
+void Metrics::count(Counter counter, long amount) {
+    if(isEnabled()) {
+        bump(shard()->counters[counter], amount);
+    }
+}
+
+void Metrics::observe(const char* phase, long microseconds) {
+    if(!isEnabled()) {
+        return;
+    }
+    MetricsShard* owner = shard();
+    // phase names are string literals, so a pointer comparison finds them
+    int numberOfPhases = owner->numberOfPhases.load(memory_order_relaxed);
+    int p = 0;
+    while(p < numberOfPhases && owner->phaseNames[p] != phase) {
+        ++p;
+    }
+    if(p == numberOfPhases) {
+        if(p == MAX_PHASES) {
+            return;
+        }
+        owner->phaseNames[p] = phase;
+        owner->numberOfPhases.store(p + 1, memory_order_release);
+    }
+    bump(owner->phaseBuckets[p][bucketOf(microseconds)], 1);
+    bump(owner->phaseSums[p], microseconds);
+}
+
+string Metrics::scrape() {
+    vector<MetricsShard*> shards;
+    vector<string (*)()> sources;
+    {
+        lock_guard<mutex> lock(metricsShardsMutex);
+        shards = metricsShards;
+        sources = metricsSources;
+    }
+    long totals[NUMBER_OF_COUNTERS] = {0};
+    vector<string> phases;
+    vector<vector<long> > buckets;
+    vector<long> sums;
+    for(size_t s = 0; s < shards.size(); ++s) {
+        for(int i = 0; i < NUMBER_OF_COUNTERS; ++i) {
+            totals[i] += shards[s]->counters[i].load(memory_order_relaxed);
+        }
+        int numberOfPhases = shards[s]->numberOfPhases.load(memory_order_acquire);
+        for(int p = 0; p < numberOfPhases; ++p) {
+            size_t merged = 0;
+            while(merged < phases.size() && phases[merged] != shards[s]->phaseNames[p]) {
+                ++merged;
+            }
+            if(merged == phases.size()) {
+                phases.push_back(shards[s]->phaseNames[p]);
+                buckets.push_back(vector<long>(HISTOGRAM_BUCKETS, 0));
+                sums.push_back(0);
+            }
+            for(int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+                buckets[merged][b] += shards[s]->phaseBuckets[p][b].load(memory_order_relaxed);
+            }
+            sums[merged] += shards[s]->phaseSums[p].load(memory_order_relaxed);
+        }
+    }
+
+    string body;
+    char line[256];
+    for(int i = 0; i < NUMBER_OF_COUNTERS; ++i) {
+        snprintf(line, sizeof(line), "evote_%s %ld\n", counterNames[i], totals[i]);
+        body += line;
+    }
+    snprintf(line, sizeof(line), "evote_sessions_in_flight %ld\n", totals[SESSIONS_STARTED] - totals[SESSIONS_FINISHED]);
+    body += line;
+    for(size_t p = 0; p < phases.size(); ++p) {
+        // only the buckets that saw a value are listed, the counts are cumulative
+        long cumulative = 0;
+        for(int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            if(buckets[p][b] == 0) {
+                continue;
+            }
+            cumulative += buckets[p][b];
+            long upperBound = b + 1 < HISTOGRAM_BUCKETS ? lowerBound(b + 1) : lowerBound(b) * 2;
+            snprintf(line, sizeof(line), "evote_phase_microseconds_bucket{phase=\"%s\",le=\"%ld\"} %ld\n",
+                phases[p].c_str(), upperBound, cumulative);
+            body += line;
+        }
+        snprintf(line, sizeof(line), "evote_phase_microseconds_bucket{phase=\"%s\",le=\"+Inf\"} %ld\n", phases[p].c_str(), cumulative);
+        body += line;
+        snprintf(line, sizeof(line), "evote_phase_microseconds_sum{phase=\"%s\"} %ld\n", phases[p].c_str(), sums[p]);
+        body += line;
+        snprintf(line, sizeof(line), "evote_phase_microseconds_count{phase=\"%s\"} %ld\n", phases[p].c_str(), cumulative);
+        body += line;
+    }
+    for(size_t s = 0; s < sources.size(); ++s) {
+        body += sources[s]();
+    }
+    return body;
+}
+
+void Metrics::addSource(string (*source)()) {
+    lock_guard<mutex> lock(metricsShardsMutex);
+    metricsSources.push_back(source);
+}
+
+void Metrics::serve(int port) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local scrapers only
+    address.sin_port = htons(port);
+    int on = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(sd < 0 || bind(sd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(sd, 5) < 0) {
+        perror("Error at opening the metrics port.\n");
+        return;
+    }
+    metricsEnabled = true;
+    thread(serveLoop, sd).detach();
+}
+
+void Metrics::serveLoop(int sd) {
+    while(true) {
+        int client = accept(sd, NULL, NULL);
+        if(client < 0) {
+            continue;
+        }
+        // whatever the request was, the answer is the full scrape
+        char request[1024];
+        if(read(client, request, sizeof(request)) < 0) {
+            close(client);
+            continue;
+        }
+        string body = scrape();
+        char head[128];
+        snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body.size());
+        string response = string(head) + body;
+        size_t offset = 0;
+        while(offset < response.size()) {
+            ssize_t written = write(client, response.data() + offset, response.size() - offset);
+            if(written <= 0) {
+                break;
+            }
+            offset += written;
+        }
+        close(client);
+    }
+}
+
+// Counts one session from construction to destruction, together with the
+// traffic its codec saw. outcome stays NUMBER_OF_COUNTERS for a session that
+// ended before a verdict.
+template<class Codec> class SessionMetrics {
+public:
+    Codec& codec;
+    Counter outcome;
+
+    SessionMetrics(Codec& codec) : codec(codec), outcome(NUMBER_OF_COUNTERS) {
+        Metrics::count(SESSIONS_STARTED);
+    }
+    ~SessionMetrics() {
+        if(!Metrics::isEnabled()) {
+            return;
+        }
+        if(outcome != NUMBER_OF_COUNTERS) {
+            Metrics::count(outcome);
+        }
+        if(codec.isTimedOut()) {
+            Metrics::count(SESSIONS_TIMED_OUT);
+        }
+        Metrics::count(SESSION_BYTES_READ, codec.getBytesRead());
+        Metrics::count(SESSION_BYTES_WRITTEN, codec.getBytesWritten());
+        Metrics::count(SESSION_SYSCALLS, codec.getSyscalls());
+        Metrics::count(SESSIONS_FINISHED);
+    }
+};
@@ -1,4 +1,6 @@
 #include "Server.h"
+#include "WorkerPool.h"
+#include "Gateway.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -7,14 +9,143 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #define PORT 2021
+#define METRICS_PORT 9021
+#define GATEWAY_PORT 2031
 extern int errno;
 
 using namespace std;
 
-int main ()
+// Usage: officeServer [--workers [N]] [--security-constant k] [--key-bits b] [--trace file]
+//                     [--metrics [port]] [--gateway [port]] [--queue-limit N]
+//                     [--request-deadline ms] [--reply-deadline ms] [--fixed-width] [--multi-buffer [us]]
+// Without arguments every registration runs inline in the accept loop.
+// With --workers accepted clients are handed to N worker threads
+// (one per core when N is missing).
+// --security-constant overrides the default number of blinded values (k),
+// at most 4096.
+// Non-interactive clients are only served with k >= 256.
+// --key-bits searches a new b-bit key (b even, 1024 to 8192) on every core
+// and caches it in serverKey.bin; without it the cached key is reused, or
+// made when there is none. A damaged serverKey.bin stops the server instead
+// of being replaced.
+// --trace records the phases of every session and rewrites file each second
+// in the Chrome trace format.
+// --metrics serves counters and phase histograms on 127.0.0.1:port (9021).
+// --gateway also accepts gateway connections on port (2031), each carrying
+// many registrations (see Gateway.h); they run on the workers, which are
+// started even without --workers.
+// --queue-limit bounds the clients waiting for a worker (256); past it a
+// client is told when to retry instead of queuing.
+// --request-deadline and --reply-deadline bound the time a client gets for
+// its ID and for each later message, in milliseconds (10000, 0 for none);
+// a client that misses one loses its session.
+// --fixed-width signs and verifies with the fixed-width Montgomery arithmetic
+// of MontgomeryEngine.h instead of ZZ.
+// --multi-buffer signs 8 messages at a time in the SIMD lanes of
+// MultiBufferEngine.h; a session's last few wait up to us microseconds (200)
+// for other sessions' messages to fill their lanes. It needs a build with
+// AVX-512 IFMA.
+// officeServer --build-roll only compiles ids.txt into ids.roll, carrying the
+// used IDs of ids.used over, and exits.
+int main (int argc, char* argv[])
 {
+    if (argc > 1 && strcmp (argv[1], "--build-roll") == 0)
+    {
+        VoterRoll::build(VALID_IDS, VALID_IDS_ROLL, VALID_IDS_USED);
+        printf ("Wrote %s\n", VALID_IDS_ROLL);
+        return 0;
+    }
+    int numberOfWorkers = 0;
+    int requestedSecurityConstant = 0;
+    int gatewayPort = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp (argv[i], "--security-constant") == 0 && i + 1 < argc)
+        {
+            requestedSecurityConstant = atoi (argv[++i]);
+            if (requestedSecurityConstant < 2 || requestedSecurityConstant > MAX_SECURITY_CONSTANT)
+            {
+                fprintf (stderr, "--security-constant needs a number from 2 to %d.\n", MAX_SECURITY_CONSTANT);
+                return 1;
+            }
+        }
+        if (strcmp (argv[i], "--key-bits") == 0 && i + 1 < argc)
+        {
+            int keyBits = atoi (argv[++i]);
+            if (keyBits % 2 != 0 || keyBits < MIN_KEY_BITS || keyBits > MAX_KEY_BITS)
+            {
+                fprintf (stderr, "--key-bits needs an even number from %d to %d.\n", MIN_KEY_BITS, MAX_KEY_BITS);
+                return 1;
+            }
+            primeLength = keyBits / 2;
+            regenerateKey = true;
+        }
+        if (strcmp (argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            Trace::enable (argv[++i]);
+        }
+        if (strcmp (argv[i], "--metrics") == 0)
+        {
+            int metricsPort = METRICS_PORT;
+            if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+            {
+                metricsPort = atoi (argv[++i]);
+            }
+            Metrics::serve (metricsPort);
+        }
+        if (strcmp (argv[i], "--gateway") == 0)
+        {
+            gatewayPort = GATEWAY_PORT;
+            if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+            {
+                gatewayPort = atoi (argv[++i]);
+            }
+        }
+        if (strcmp (argv[i], "--queue-limit") == 0 && i + 1 < argc)
+        {
+            queueLimit = max (1, atoi (argv[++i]));
+        }
+        if (strcmp (argv[i], "--request-deadline") == 0 && i + 1 < argc)
+        {
+            requestDeadline = atol (argv[++i]);
+        }
+        if (strcmp (argv[i], "--reply-deadline") == 0 && i + 1 < argc)
+        {
+            replyDeadline = atol (argv[++i]);
+        }
+        if (strcmp (argv[i], "--fixed-width") == 0)
+        {
+            fixedWidthArithmetic = true;
+        }
+        if (strcmp (argv[i], "--multi-buffer") == 0)
+        {
+            multiBufferExponentiation = true;
+            batchWindow = DEFAULT_BATCH_WINDOW;
+            if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+            {
+                batchWindow = atol (argv[++i]);
+            }
+        }
+        if (strcmp (argv[i], "--workers") == 0)
+        {
+            numberOfWorkers = WorkerPool::defaultNumberOfWorkers();
+            if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+            {
+                numberOfWorkers = atoi (argv[++i]);
+            }
+        }
+    }
+    if (multiBufferExponentiation && !MULTI_BUFFER_IFMA)
+    {
+        fprintf (stderr, "--multi-buffer needs a build with AVX-512 IFMA, the lanes are slower than NTL without it.\n");
+        return 1;
+    }
+    // a voter hanging up mid-session must not take the whole server down
+    signal (SIGPIPE, SIG_IGN);
+
     struct sockaddr_in server;
     struct sockaddr_in from;
     int sd;
@@ -41,11 +172,32 @@ int main ()
     setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
     Server::initialize();
-    if (listen (sd, 5) == -1)
+    if (requestedSecurityConstant > 0)
+    {
+        securityConstant = requestedSecurityConstant;
+    }
+    if (gatewayPort > 0 && numberOfWorkers == 0)
+    {
+        // a gateway session must not hold up the accept loop
+        numberOfWorkers = WorkerPool::defaultNumberOfWorkers();
+    }
+    // with workers the admission queue does the waiting, the kernel's
+    // backlog only has to cover the moments between two accepts
+    if (listen (sd, numberOfWorkers > 0 ? SOMAXCONN : 5) == -1)
     {
         perror ("Error at listening to port.\n");
         return errno;
     }
+    if (numberOfWorkers > 0)
+    {
+        WorkerPool::start(numberOfWorkers);
+        printf ("Registrations are handled by %d workers\n", numberOfWorkers);
+    }
+    if (gatewayPort > 0)
+    {
+        Gateway::serve(gatewayPort, WorkerPool::admit);
+        printf ("Gateways connect at port %d\n", gatewayPort);
+    }
 
     while (1)
     {
@@ -62,6 +214,11 @@ int main ()
             perror ("Error at accepting client.\n");
             continue;
         }
+        if (numberOfWorkers > 0)
+        {
+            WorkerPool::admit(client);
+            continue;
+        }
         Server::execute(client);
         close (client);
     }
@@ -2,19 +2,37 @@
 #include <NTL/ZZ.h>
 #include <fstream>
 #include <string>
-#include <set>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <iostream>
 #include "FFunction.h"
 #include "GFunction.h"
+#include "WireCodec.h"
+#include "CRTContext.h"
+#include "TaskScheduler.h"
+#include "ExponentiationBatcher.h"
+#include "VoterRoll.h"
+#include "KeyFile.h"
+#include "Trace.h"
+#include "FiatShamir.h"
 
 #define PRIMES_LENGTH 15
+#define MIN_KEY_BITS 1024 // bounds of --key-bits, which must be even
+#define MAX_KEY_BITS 8192
 #define VALID_IDS "ids.txt"
+#define VALID_IDS_ROLL "ids.roll" // compiled from VALID_IDS whenever that is newer
+#define VALID_IDS_USED "ids.used" // one bit per VALID_IDS_ROLL position, survives restarts
 #define INFORMATION "serverInfo.txt"
+#define KEY_FILE "serverKey.bin" // key and CRT values, reused across restarts
 #define SECURITY_CONSTANT 10
+#define MAX_SECURITY_CONSTANT 4096 // as in the HomeServer; registration keeps k values on the stack
+#define DEFAULT_DEADLINE 10000 // milliseconds a client gets for each of its messages
 
 #define ID_OK 0
 #define ID_INVALID 1
@@ -23,44 +41,90 @@
 #define OK 0
 #define NOT_OK 1
 
+// Sent by protocol v2 clients where a v1 client sends the length of its ID.
+// The ID and all k blinded values follow in the same message, and the ID
+// verdict and the chosen indexes (as a k-bit vector) come back together.
+#define PROTOCOL_V2 -2L
+// Sent the same way by clients that open the indexes hashed from their own
+// message (see FiatShamir.h): ID, blinded values and openings arrive at once
+// and the ID verdict, the check and the signature go back at once.
+#define PROTOCOL_NONINTERACTIVE -3L
+
 using namespace std;
 using namespace NTL;
 
 ZZ compositeNumber, firstPrimeNumber, secondPrimeNumber;
 ZZ phiCompositeNumber;
 ZZ privateKey;
+CRTContext signingContext; // built once the key is known, read-only afterwards
+int primeLength = PRIMES_LENGTH;
+bool regenerateKey = false; // set to search for a new key even if KEY_FILE exists
 int securityConstant;
-std::set<ZZ> validIds;
-std::set<ZZ> usedIDs;
+long requestDeadline = DEFAULT_DEADLINE; // for the ID (and whatever travels with it), 0 for none
+long replyDeadline = DEFAULT_DEADLINE;   // for every later message of the client
 
 class Server {
 private:
+	static ZZ searchPrime(const ZZ& excluded);
 	static void generatePrimes();
+	static void generateKey();
 	static void computeCompositeAndPhi();
 	static void computePrivateKey();
     static void initializeValidIDs();
-    static void sendNumberToClient(ZZ& number, int client);
-	static ZZ receiveNumberFromClient(int client);
+    static int reserveID(ZZ& ID);
     static ZZ signBlindMessageUsingCRT(ZZ blindMessage); // sign a single blinded message
+    static void signBlindMessagesUsingCRT(vector<ZZ>& blindMessages, vector<ZZ>& signedBlindMessages);
     static void chooseRandomIndexes(bool*);
-	static void receiveBlindSignaturesFromClient(int client, vector<ZZ>& blindSignatures);
-	static void receiveParametersForChecking(int client, ZZ* a, ZZ* c, ZZ* d, ZZ* r);
+    static void deriveIndexes(bool* chosenIndex, ZZ& ID, vector<ZZ>& blindSignatures);
+	static void receiveBlindSignaturesFromClient(WireCodec& codec, vector<ZZ>& blindSignatures);
+	static void receiveParametersForChecking(WireCodec& codec, ZZ* a, ZZ* c, ZZ* d, ZZ* r);
 	static bool verifyCorrectFunction(ZZ blindSignature, ZZ ID, ZZ a, ZZ c, ZZ d, ZZ r);
 
 public:
 	static void initialize();
     static void execute(int client);
+    static void refuse(int client, int retryAfter);
 };
 
-void Server::generatePrimes() {
-	firstPrimeNumber = GenPrime_ZZ(PRIMES_LENGTH);
-	while ((firstPrimeNumber - 1) % 3 == 0) {
-		firstPrimeNumber = GenPrime_ZZ(PRIMES_LENGTH);
+// Every core tests random candidates p = 5 (mod 6), so that 3 is invertible
+// modulo p - 1, until one of them is prime. A candidate costs a trial
+// division and a few Miller-Rabin rounds, so the cores stop moments after
+// the first find instead of finishing whole prime searches of their own.
+ZZ Server::searchPrime(const ZZ& excluded) {
+	int numberOfSearchers = max(1u, thread::hardware_concurrency());
+	atomic<bool> found(false);
+	mutex primeMutex;
+	ZZ prime;
+	vector<thread> searchers;
+	for(int i = 0; i < numberOfSearchers; ++i) {
+		searchers.push_back(thread([&] {
+			while(!found) {
+				ZZ candidate = RandomBits_ZZ(primeLength);
+				// the two top bits set make n = p * q exactly 2 * primeLength bits
+				SetBit(candidate, primeLength - 1);
+				SetBit(candidate, primeLength - 2);
+				candidate += (5 - candidate % 6 + 6) % 6;
+				if(NumBits(candidate) != primeLength || candidate == excluded || !ProbPrime(candidate)) {
+					continue;
+				}
+				lock_guard<mutex> lock(primeMutex);
+				if(!found) {
+					prime = candidate;
+					found = true;
+				}
+			}
+		}));
 	}
-	secondPrimeNumber = GenPrime_ZZ(PRIMES_LENGTH);
-	while (secondPrimeNumber == firstPrimeNumber || (secondPrimeNumber - 1) % 3 == 0) {
-		secondPrimeNumber = GenPrime_ZZ(PRIMES_LENGTH);
+	for(size_t i = 0; i < searchers.size(); ++i) {
+		searchers[i].join();
 	}
+	return prime;
+}
+
+void Server::generatePrimes() {
+	ZZ none;
+	firstPrimeNumber = searchPrime(none);
+	secondPrimeNumber = searchPrime(firstPrimeNumber);
 }
 
  void Server::computeCompositeAndPhi() {
@@ -75,91 +139,84 @@ void Server::computePrivateKey() {
 }
 
 void Server::initializeValidIDs() {
-    ifstream in(VALID_IDS);
-    int numberOfIDs;
-    in >> numberOfIDs;
-    ZZ id;
-    for(int i = 0; i < numberOfIDs; ++i) {
-        in >> id;
-        validIds.insert(id);
+    VoterRoll::load(VALID_IDS, VALID_IDS_ROLL, VALID_IDS_USED, compositeNumber);
+}
+
+int Server::reserveID(ZZ& ID) {
+    long position = VoterRoll::find(ID);
+    if(position < 0) {
+        return ID_INVALID;
     }
-    in.close();
+    // checking and marking the ID is one atomic step, so two sessions
+    // presenting the same ID can't both be accepted
+    if(!VoterRoll::claim(position)) {
+        return ID_USED;
+    }
+    return ID_OK;
 }
 
-void Server::initialize() {
+void Server::generateKey() {
 	generatePrimes();
 	computeCompositeAndPhi();
 	computePrivateKey();
-    initializeValidIDs();
-    securityConstant = SECURITY_CONSTANT;
+	signingContext.build(privateKey, firstPrimeNumber, secondPrimeNumber);
+	if(!KeyFile::save(KEY_FILE, privateKey, compositeNumber, signingContext)) {
+		// credentials signed with a key that is lost on restart are worthless
+		perror("Error at writing the key file.\n");
+		exit(1);
+	}
+	// the text form is kept for HomeServers that don't read KEY_FILE
 	ofstream out(INFORMATION, fstream::trunc | fstream::out);
+	chmod(INFORMATION, S_IRUSR | S_IWUSR);
 	out << privateKey << '\n' << compositeNumber << '\n' << firstPrimeNumber << '\n' << secondPrimeNumber << '\n';
 	out.close();
-
-}
-
-void Server::sendNumberToClient(ZZ& number, int client) {
-    long numberLength = NumBytes(number);
-    if(write(client, &numberLength, sizeof(long)) < 0) {
-        perror("Error at writing number length to client.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    BytesFromZZ(representation, number, numberLength);
-    for(long i = 0; i < numberLength; ++i) {
-        if(write(client, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to client.\n");
-            exit(0);
-        }
-    }
 }
 
-ZZ Server::receiveNumberFromClient(int client) {
-    long numberLength;
-    if(read(client, &numberLength, sizeof(long)) < 0) {
-        perror ("Error at reading number length from client.\n");
-        exit(0);
-    }
-    unsigned char representation[numberLength + 1];
-    for(long i = 0; i < numberLength; ++i) {
-        if(read(client, representation + i, sizeof(char)) < 0) {
-            perror("Error at writing number to client.\n");
-            exit(0);
-        }
-    }
-    ZZ result;
-    ZZFromBytes(result, representation, numberLength);
-    return result;
+void Server::initialize() {
+	// A new key invalidates every credential issued so far, so it is only
+	// made on request or when there is none; a damaged one stops the server.
+	if(regenerateKey || access(KEY_FILE, F_OK) != 0) {
+		generateKey();
+	}
+	else if(!KeyFile::load(KEY_FILE, privateKey, compositeNumber, signingContext)) {
+		fprintf(stderr, "%s is damaged: restore it, or start with --key-bits to issue a new key.\n", KEY_FILE);
+		exit(1);
+	}
+	else {
+		firstPrimeNumber = signingContext.firstPrimeNumber;
+		secondPrimeNumber = signingContext.secondPrimeNumber;
+		phiCompositeNumber = (firstPrimeNumber - 1) * (secondPrimeNumber - 1);
+	}
+	GFunction::configure(compositeNumber);
+	FFunction::configure(compositeNumber);
+	if(computeThreads.empty()) {
+		TaskScheduler::start(thread::hardware_concurrency() > 1 ? thread::hardware_concurrency() - 1 : 0);
+	}
+    initializeValidIDs();
+    securityConstant = SECURITY_CONSTANT;
 }
 
 ZZ Server::signBlindMessageUsingCRT(ZZ blindMessage) {
+	// d mod (p-1), d mod (q - 1) and p ^ (-1) mod q were computed in initialize()
+	return signingContext.exponentiate(blindMessage);
+}
 
-	// We compute c^d mod n by using CRT:
-	// First we compute	d mod (p-1), d mod (q - 1) and p ^ (-1) mod q.
-
-	ZZ firstModularExpression = privateKey % (firstPrimeNumber - 1);
-	ZZ secondModularExpression = privateKey % (secondPrimeNumber - 1);
-	ZZ firstInvModularSecond = InvMod(firstPrimeNumber % secondPrimeNumber, secondPrimeNumber);
-
-	ZZ x1, x2;
-	// We compute x1 = (d mod p) ^ n_1  mod p and x2 = (d mod q) ^ n_2 mod q
-	x1 = PowerMod(blindMessage % firstPrimeNumber, firstModularExpression, firstPrimeNumber);
-	x2 = PowerMod(blindMessage % secondPrimeNumber, secondModularExpression, secondPrimeNumber);
-
-	// The result of c ^ d mod n is: x1 + p((x2 - x1)(p ^ (-1) mod q) mod q).
-	ZZ signedBlindMessage;
-	signedBlindMessage = x1 + firstPrimeNumber * (((x2 - x1) * firstInvModularSecond) % secondPrimeNumber);
-	return signedBlindMessage;
+void Server::signBlindMessagesUsingCRT(vector<ZZ>& blindMessages, vector<ZZ>& signedBlindMessages) {
+	// the messages are independent: they go to whichever core is free, with
+	// --multi-buffer in lanes shared with the other sessions' messages
+	signedBlindMessages.resize(blindMessages.size());
+	ExponentiationBatcher::exponentiate(signingContext, blindMessages.data(), signedBlindMessages.data(),
+		blindMessages.size());
 }
 
 
 void Server::chooseRandomIndexes(bool* chosenIndex) {
     int numberOfChosenIndexes = 0;
-    for(int i = 0; i < SECURITY_CONSTANT; ++i) {
+    for(int i = 0; i < securityConstant; ++i) {
         chosenIndex[i] = false;
     }
-    while(numberOfChosenIndexes < SECURITY_CONSTANT / 2) {
-        long index = RandomBnd(SECURITY_CONSTANT);
+    while(numberOfChosenIndexes < securityConstant / 2) {
+        long index = RandomBnd(securityConstant);
         if(!chosenIndex[index]) {
             chosenIndex[index] = true;
             ++numberOfChosenIndexes;
@@ -168,116 +225,170 @@ void Server::chooseRandomIndexes(bool* chosenIndex) {
 }
 
 
-void Server::receiveBlindSignaturesFromClient(int client, vector<ZZ>& blindSignatures) {
+void Server::deriveIndexes(bool* chosenIndex, ZZ& ID, vector<ZZ>& blindSignatures) {
+    Transcript transcript("evote registration");
+    transcript.add(compositeNumber);
+    transcript.add((long) securityConstant);
+    transcript.add(ID);
     for(int i = 0; i < securityConstant; ++i) {
-		ZZ blindSignature = receiveNumberFromClient(client);
+        transcript.add(blindSignatures[i]);
+    }
+    transcript.chooseIndexes(chosenIndex, securityConstant, securityConstant / 2);
+}
+
+void Server::receiveBlindSignaturesFromClient(WireCodec& codec, vector<ZZ>& blindSignatures) {
+    for(int i = 0; i < securityConstant; ++i) {
+		ZZ blindSignature = codec.receiveNumber();
         blindSignatures.push_back(blindSignature);
     }
 }
-void Server::receiveParametersForChecking(int client, ZZ* a, ZZ* c, ZZ* d, ZZ* r) {
+void Server::receiveParametersForChecking(WireCodec& codec, ZZ* a, ZZ* c, ZZ* d, ZZ* r) {
     for(int i = 0; i < securityConstant / 2; ++i) {
         // fill the information
-        a[i] = receiveNumberFromClient(client);
-        c[i] = receiveNumberFromClient(client);
-        d[i] = receiveNumberFromClient(client);
-        r[i] = receiveNumberFromClient(client);
+        a[i] = codec.receiveNumber();
+        c[i] = codec.receiveNumber();
+        d[i] = codec.receiveNumber();
+        r[i] = codec.receiveNumber();
     }
 }
 
 bool Server::verifyCorrectFunction(ZZ blindSignature, ZZ ID, ZZ a, ZZ c, ZZ d, ZZ r) {
-    ZZ x = GFunction::applyFunction(a, c);
 	ZZ op;
 	op = a ^ ID;
-	ZZ y = GFunction::applyFunction(op, d);
-	ZZ fResult = FFunction::applyFunction(x, y);
-	ZZ correctResult = (r * r * r * fResult) % compositeNumber;
+	// r ^ 3 * F(G(a, c), G(a ^ ID, d)) (mod n)
+	ZZ correctResult = PowerModKernel::blind(a, c, op, d, r, G_EXPONENT, F_EXPONENT, compositeNumber);
 	return correctResult == blindSignature;
 }
 
 void Server::execute(int client) { // IS it an int??
+    long session = Trace::newSession();
+    TraceSpan registration("registration", session);
+    WireCodec codec(client);
+    SessionMetrics<WireCodec> metrics(codec);
     // we have the server initialized, first send the crypto parameters to client
-    sendNumberToClient(compositeNumber, client);
-    if(write(client, &securityConstant, sizeof(int)) < 0) {
-        perror ("Error at writing security constant to client.\n");
-        exit(0);
-    }
+    codec.sendNumber(compositeNumber);
+    codec.sendInt(securityConstant);
 
 	ZZ clientID;
-	clientID = receiveNumberFromClient(client); // we must know the client's ID
-	int response;
-	if(validIds.find(clientID) == validIds.end()) {
-		// ID isn't valid
-		response = ID_INVALID;
-		if (write(client, &response, sizeof(int)) < 0) {
-			perror ("Error at writing response to client.\n");
-			exit(0);
-		}
-		return;
+	bool version2, nonInteractive;
+	// a client that stalls must not hold this thread forever
+	codec.setDeadline(requestDeadline);
+	{
+		TraceSpan span("receive ID", session);
+		long firstField = codec.receiveLong();
+		nonInteractive = firstField == PROTOCOL_NONINTERACTIVE;
+		version2 = firstField == PROTOCOL_V2 || nonInteractive;
+		// we must know the client's ID
+		clientID = version2 ? codec.receiveNumber() : codec.receiveNumberBody(firstField);
 	}
-	if(usedIDs.find(clientID) != usedIDs.end()) {
-		// ID isn't valid
-		response = ID_USED;
-		if (write(client, &response, sizeof(int)) < 0) {
-			perror ("Error at writing response to client.\n");
-			exit(0);
-		}
+	if(codec.isBroken() || (nonInteractive && securityConstant < FIAT_SHAMIR_MIN_SECURITY_CONSTANT)) {
+		// too few blinded values for a hashed challenge to be safe
 		return;
 	}
-	response = ID_OK;
-	usedIDs.insert(clientID);
-	if (write(client, &response, sizeof(int)) < 0) {
-		perror("Error at writing response to client.\n");
-		exit(0);
+	int response;
+	{
+		TraceSpan span("reserve ID", session);
+		response = reserveID(clientID);
 	}
-
     vector<ZZ> blindSignatures;
-    receiveBlindSignaturesFromClient(client, blindSignatures);
-    bool chosenIndexes[securityConstant];
-    chooseRandomIndexes(chosenIndexes);
+    ZZ a[securityConstant / 2], c[securityConstant / 2], d[securityConstant / 2], r[securityConstant / 2];
+    if(version2) {
+        // already on the wire behind the ID, whatever the verdict
+        TraceSpan span("receive blinded values", session);
+        receiveBlindSignaturesFromClient(codec, blindSignatures);
+        if(nonInteractive) {
+            receiveParametersForChecking(codec, a, c, d, r);
+        }
+    }
+	codec.sendInt(response);
+	if(response != ID_OK) {
+		// ID isn't valid or was already used
+		metrics.outcome = response == ID_INVALID ? REJECTED_ID_INVALID : REJECTED_ID_USED;
+		return;
+	}
 
-    for(int i = 0; i < securityConstant; ++i) {
-        if(chosenIndexes[i]) {
-            if(write(client, &i, sizeof(int)) < 0) {
-                perror("Error at writing chosen indexes to client.\n");
-                exit(0);
+    if(!version2) {
+        TraceSpan span("receive blinded values", session);
+        codec.setDeadline(replyDeadline);
+        receiveBlindSignaturesFromClient(codec, blindSignatures);
+    }
+    if(codec.isBroken()) {
+        return;
+    }
+    bool chosenIndexes[securityConstant];
+    if(nonInteractive) {
+        // the client already opened the indexes this derives
+        TraceSpan span("derive indexes", session);
+        deriveIndexes(chosenIndexes, clientID, blindSignatures);
+    }
+    else {
+        chooseRandomIndexes(chosenIndexes);
+        if(version2) {
+            codec.sendBits(chosenIndexes, securityConstant);
+        }
+        else {
+            for(int i = 0; i < securityConstant; ++i) {
+                if(chosenIndexes[i]) {
+                    codec.sendInt(i);
+                }
             }
         }
+        // The server transmitted chosen indexes, now has to receive from the client the information
+        TraceSpan span("receive opened values", session);
+        codec.setDeadline(replyDeadline);
+        receiveParametersForChecking(codec, a, c, d, r);
     }
-    // The server transmitted chosen indexes, now has to receive from the client the information
-
-    ZZ a[securityConstant / 2], c[securityConstant / 2], d[securityConstant / 2], r[securityConstant / 2];
-    receiveParametersForChecking(client, a, c, d, r);
-    int foundIndexes = 0;
-	bool allFine = true;
-	// allFine becomes false when there is a function's result which is faulty computed.
-    for(int i = 0; i < securityConstant && allFine; ++i) {
+    if(codec.isBroken()) {
+        return;
+    }
+    vector<int> openedIndexes;
+    for(int i = 0; i < securityConstant; ++i) {
         if(chosenIndexes[i]) {
-			allFine = verifyCorrectFunction(blindSignatures[i], clientID, a[foundIndexes],
-				c[foundIndexes], d[foundIndexes], r[foundIndexes]);
-            ++foundIndexes;
+            openedIndexes.push_back(i);
         }
     }
+	// allFine becomes false when there is a function's result which is faulty computed.
+	// The checks are independent, so they run on the compute threads and the
+	// remaining ones are dropped as soon as one of them fails.
+	bool allFine;
+	{
+		TraceSpan span("verifyCorrectFunction", session);
+		allFine = TaskScheduler::parallelAll(openedIndexes.size(), [&](int j) {
+			return verifyCorrectFunction(blindSignatures[openedIndexes[j]], clientID, a[j], c[j], d[j], r[j]);
+		});
+	}
+	metrics.outcome = allFine ? SESSIONS_COMPLETED : REJECTED_NOT_OK;
 	if(allFine) {
-		int feedBack = OK;
-		if(write(client, &feedBack, sizeof(int)) < 0) {
-			perror("Error at writing feedBack to client.\n");
-			exit(0);
-		}
-		ZZ product;
-		product = 1;
+		codec.sendInt(OK);
+		vector<ZZ> unopenedMessages, signedMessages;
 		for(int i = 0; i < securityConstant; ++i) {
 			if(!chosenIndexes[i]) { // if no information was found from these
-				product *= signBlindMessageUsingCRT(blindSignatures[i]);
-				product = product % compositeNumber;
+				unopenedMessages.push_back(blindSignatures[i]);
 			}
 		}
-		sendNumberToClient(product, client);
+		TraceSpan span("CRT signing", session);
+		signBlindMessagesUsingCRT(unopenedMessages, signedMessages);
+		ZZ product;
+		product = 1;
+		for(size_t i = 0; i < signedMessages.size(); ++i) {
+			product *= signedMessages[i];
+			product = product % compositeNumber;
+		}
+		codec.sendNumber(product);
 	}
 	else {
-		int feedBack = NOT_OK;
-		if(write(client, &feedBack, sizeof(int)) < 0) {
-			perror("Error at writing feedBack to client.\n");
-			exit(0);
-		}
+		codec.sendInt(NOT_OK);
 	}
+	TraceSpan span("send result", session);
+	codec.flush();
+}
+
+// Turns a client away without a session: a composite number of 0, then how
+// many milliseconds it should wait before trying again.
+void Server::refuse(int client, int retryAfter) {
+	WireCodec codec(client);
+	codec.sendNumber(ZZ());
+	codec.sendInt(retryAfter);
+	codec.flush();
+	Metrics::count(REJECTED_BUSY);
 }
@@ -0,0 +1,166 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+
+#define TRACE_RING_EVENTS 16384 // per thread, the oldest spans are overwritten
+#define TRACE_EXPORT_SECONDS 1
+
+using namespace std;
+
+// One finished span. name points to a string literal.
+class TraceEvent {
+public:
+    const char* name;
+    long session;
+    long start; // microseconds since tracing was enabled
+    long duration;
+};
+
+// Spans recorded by one thread. Only the owner writes, so recording takes no
+// lock; the exporter copies the events and then drops those the owner may
+// have overwritten meanwhile.
+class TraceRing {
+public:
+    int thread;
+    atomic<long> written;
+    TraceEvent events[TRACE_RING_EVENTS];
+
+    TraceRing() : thread(0), written(0) {}
+};
+
+atomic<bool> tracingEnabled(false);
+chrono::steady_clock::time_point tracingStart;
+string tracePath;
+vector<TraceRing*> traceRings; // rings are never freed, an exporter may still read them
+mutex traceRingsMutex;
+atomic<long> nextTracedSession(0);
+thread_local TraceRing* threadTraceRing = NULL;
+
+// Lightweight spans around the phases of a session, exported in the Chrome
+// trace event format (chrome://tracing, Perfetto) and fed to the phase
+// histograms of Metrics. With both off a span costs two relaxed loads.
+class Trace {
+private:
+    static TraceRing* ring();
+    static void exportLoop();
+
+public:
+    static void enable(const char* path);
+    static bool isEnabled() { return tracingEnabled.load(memory_order_relaxed); }
+    static long now();
+    static long newSession() { return isEnabled() ? ++nextTracedSession : 0; }
+    static void record(const char* name, long session, long start, long duration);
+    static bool exportTo(const string& path);
+};
+
+// Records the time between its construction and its destruction.
+class TraceSpan {
+private:
+    const char* name;
+    long session;
+    long start;
+
+public:
+    TraceSpan(const char* name, long session) : name(name), session(session), start(-1) {
+        if(Trace::isEnabled() || Metrics::isEnabled()) {
+            start = Trace::now();
+        }
+    }
+    ~TraceSpan() {
+        if(start < 0) {
+            return;
+        }
+        long duration = Trace::now() - start;
+        if(Trace::isEnabled()) {
+            Trace::record(name, session, start, duration);
+        }
+        Metrics::observe(name, duration);
+    }
+};
+
+void Trace::enable(const char* path) {
+    tracePath = path;
+    tracingStart = chrono::steady_clock::now();
+    tracingEnabled = true;
+    thread(exportLoop).detach();
+}
+
+long Trace::now() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tracingStart).count();
+}
+
+TraceRing* Trace::ring() {
+    if(threadTraceRing == NULL) {
+        threadTraceRing = new TraceRing();
+        lock_guard<mutex> lock(traceRingsMutex);
+        threadTraceRing->thread = traceRings.size() + 1;
+        traceRings.push_back(threadTraceRing);
+    }
+    return threadTraceRing;
+}
+
+void Trace::record(const char* name, long session, long start, long duration) {
+    TraceRing* owner = ring();
+    long index = owner->written.load(memory_order_relaxed);
+    TraceEvent& event = owner->events[index % TRACE_RING_EVENTS];
+    event.name = name;
+    event.session = session;
+    event.start = start;
+    event.duration = duration;
+    owner->written.store(index + 1, memory_order_release);
+}
+
+bool Trace::exportTo(const string& path) {
+    vector<TraceRing*> rings;
+    {
+        lock_guard<mutex> lock(traceRingsMutex);
+        rings = traceRings;
+    }
+    string temporaryPath = path + ".tmp";
+    FILE* out = fopen(temporaryPath.c_str(), "w");
+    if(out == NULL) {
+        return false;
+    }
+    fprintf(out, "{\"traceEvents\":[");
+    bool first = true;
+    vector<TraceEvent> copied;
+    for(size_t r = 0; r < rings.size(); ++r) {
+        long end = rings[r]->written.load(memory_order_acquire);
+        long begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+        copied.clear();
+        for(long i = begin; i < end; ++i) {
+            copied.push_back(rings[r]->events[i % TRACE_RING_EVENTS]);
+        }
+        // whatever the owner wrote while we copied may have replaced old events
+        long overwrittenBefore = rings[r]->written.load(memory_order_acquire) - TRACE_RING_EVENTS;
+        for(long i = begin; i < end; ++i) {
+            if(i < overwrittenBefore) {
+                continue;
+            }
+            TraceEvent& event = copied[i - begin];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld,\"dur\":%ld,\"args\":{\"session\":%ld}}",
+                first ? "" : ",", event.name, (int) getpid(), rings[r]->thread, event.start, event.duration, event.session);
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    bool written = fclose(out) == 0;
+    return written && rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+void Trace::exportLoop() {
+    while(true) {
+        this_thread::sleep_for(chrono::seconds(TRACE_EXPORT_SECONDS));
+        if(!exportTo(tracePath)) {
+            perror("Error at writing the trace file.\n");
+        }
+    }
+}
@@ -0,0 +1,463 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define ROLL_MAGIC "EVOTEROL"
+#define ROLL_VERSION 1
+#define ROLL_BUCKET_LOAD 2          // average number of IDs per hash bucket
+#define ROLL_DIRECT_SLOT 0x80000000u // displacement flag: the bucket's only ID sits at the slot in the low bits
+#define ROLL_MAX_IDS 0x7fffffffL
+#define USED_MAGIC "EVOTEUSE"
+#define USED_VERSION 1
+
+using namespace std;
+using namespace NTL;
+
+// Fixed-size head of the binary voter roll. It is followed by
+// numberOfBuckets displacements (unsigned int) and then numberOfIDs slots of
+// idBytes little-endian bytes each, every ID in the slot the hash assigns it.
+class RollHeader {
+public:
+    char magic[8];
+    int version;
+    int idBytes;
+    long numberOfIDs;
+    long numberOfBuckets;
+};
+
+// Fixed-size head of the used-ID file kept next to the binary roll. It is
+// followed by one bit per roll position in 64-bit words. The fingerprints
+// tie the bits to the key the IDs registered under and to the roll whose
+// positions they index.
+class UsedHeader {
+public:
+    char magic[8];
+    int version;
+    int reserved;
+    long numberOfIDs;
+    unsigned long keyFingerprint;
+    unsigned long rollFingerprint;
+};
+
+const unsigned char* mappedRoll = NULL;
+size_t mappedRollBytes = 0;
+RollHeader rollHeader;
+const unsigned int* rollDisplacements = NULL;
+const unsigned char* rollSlots = NULL;
+// one bit per roll position, set once the ID at that position registered;
+// it maps the used-ID file, so a registration outlives a restart
+unsigned long* usedRollPositions = NULL;
+long usedPageBytes = sysconf(_SC_PAGESIZE);
+
+// The list of valid IDs, compiled from the text roll into a binary file with
+// a minimal perfect hash (hash and displace). The server maps the file
+// read-only, so startup doesn't parse anything, and checking an ID costs two
+// hashes and one comparison. A position in the roll doubles as the index of
+// the ID in the used-ID bitmap, which is claimed with a single atomic or and
+// synced to its file before the ID is accepted.
+class VoterRoll {
+private:
+    static unsigned long hash(const unsigned char* key, int length, unsigned long seed);
+    static unsigned long fingerprint(const unsigned char* bytes, size_t length, unsigned long value = 14695981039346656037UL);
+    static unsigned long keyFingerprint(const ZZ& modulus);
+    static bool encode(const ZZ& ID, int idBytes, unsigned char* key);
+    static bool isStale(const char* textPath, const char* binaryPath);
+    static long locate(const unsigned char* key, int idBytes, const unsigned int* displacements, long numberOfBuckets, long numberOfIDs);
+    static bool parse(const unsigned char* roll, size_t bytes, RollHeader& header);
+    static bool readUsedHeader(const char* usedPath, UsedHeader& header);
+    static bool usedIDs(const char* binaryPath, const char* usedPath, UsedHeader& usedHeader, vector<ZZ>& IDs);
+    static void writeUsed(const char* usedPath, UsedHeader& header, const vector<unsigned long>& words);
+    static void mapUsed(const char* usedPath, const ZZ& modulus);
+
+public:
+    static void build(const char* textPath, const char* binaryPath, const char* usedPath);
+    static void load(const char* textPath, const char* binaryPath, const char* usedPath, const ZZ& modulus);
+    static long find(const ZZ& ID);
+    static bool claim(long position);
+    static long size() { return rollHeader.numberOfIDs; }
+};
+
+unsigned long VoterRoll::hash(const unsigned char* key, int length, unsigned long seed) {
+    // FNV-1a with the seed folded into the basis, then a murmur3 finalizer
+    // so that nearby seeds give unrelated positions
+    unsigned long value = 14695981039346656037UL ^ (seed * 0x9e3779b97f4a7c15UL);
+    for(int i = 0; i < length; ++i) {
+        value = (value ^ key[i]) * 1099511628211UL;
+    }
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdUL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53UL;
+    value ^= value >> 33;
+    return value;
+}
+
+unsigned long VoterRoll::fingerprint(const unsigned char* bytes, size_t length, unsigned long value) {
+    // FNV-1a, continued from value so a file can be fingerprinted in pieces
+    for(size_t i = 0; i < length; ++i) {
+        value = (value ^ bytes[i]) * 1099511628211UL;
+    }
+    return value;
+}
+
+unsigned long VoterRoll::keyFingerprint(const ZZ& modulus) {
+    vector<unsigned char> bytes(NumBytes(modulus));
+    BytesFromZZ(bytes.data(), modulus, bytes.size());
+    return fingerprint(bytes.data(), bytes.size());
+}
+
+bool VoterRoll::encode(const ZZ& ID, int idBytes, unsigned char* key) {
+    if(sign(ID) < 0 || NumBytes(ID) > idBytes) {
+        return false;
+    }
+    BytesFromZZ(key, ID, idBytes);
+    return true;
+}
+
+bool VoterRoll::isStale(const char* textPath, const char* binaryPath) {
+    struct stat text, binary;
+    if(stat(binaryPath, &binary) < 0) {
+        return true;
+    }
+    return stat(textPath, &text) == 0 && text.st_mtime > binary.st_mtime;
+}
+
+void VoterRoll::build(const char* textPath, const char* binaryPath, const char* usedPath) {
+    ifstream in(textPath);
+    long numberOfIDs = 0;
+    in >> numberOfIDs;
+    if(numberOfIDs < 0 || numberOfIDs > ROLL_MAX_IDS) {
+        fprintf(stderr, "The voter roll has an invalid size.\n");
+        exit(1);
+    }
+    vector<ZZ> IDs(numberOfIDs);
+    int idBytes = 1;
+    for(long i = 0; i < numberOfIDs; ++i) {
+        in >> IDs[i];
+        idBytes = max(idBytes, (int) NumBytes(IDs[i]));
+    }
+    in.close();
+    sort(IDs.begin(), IDs.end());
+    IDs.erase(unique(IDs.begin(), IDs.end()), IDs.end());
+    numberOfIDs = IDs.size();
+
+    vector<unsigned char> keys(numberOfIDs * idBytes);
+    for(long i = 0; i < numberOfIDs; ++i) {
+        encode(IDs[i], idBytes, keys.data() + i * idBytes);
+    }
+    IDs.clear();
+
+    // every ID falls in a bucket; buckets are placed largest first, each
+    // trying seeds until all of its IDs land on free slots
+    long numberOfBuckets = numberOfIDs / ROLL_BUCKET_LOAD + 1;
+    vector<vector<long> > buckets(numberOfBuckets);
+    for(long i = 0; i < numberOfIDs; ++i) {
+        buckets[hash(keys.data() + i * idBytes, idBytes, 0) % numberOfBuckets].push_back(i);
+    }
+    vector<long> order(numberOfBuckets);
+    for(long b = 0; b < numberOfBuckets; ++b) {
+        order[b] = b;
+    }
+    sort(order.begin(), order.end(), [&](long x, long y) { return buckets[x].size() > buckets[y].size(); });
+
+    vector<unsigned int> displacements(numberOfBuckets, 0);
+    vector<long> slotOf(numberOfIDs, -1); // which ID occupies each slot
+    vector<long> positions;
+    long nextFree = 0;
+    for(long o = 0; o < numberOfBuckets; ++o) {
+        vector<long>& bucket = buckets[order[o]];
+        if(bucket.empty()) {
+            break;
+        }
+        if(bucket.size() == 1) {
+            // a lone ID doesn't need a seed search, it takes the next free slot
+            while(slotOf[nextFree] >= 0) {
+                ++nextFree;
+            }
+            slotOf[nextFree] = bucket[0];
+            displacements[order[o]] = ROLL_DIRECT_SLOT | nextFree;
+            continue;
+        }
+        for(unsigned int seed = 1; ; ++seed) {
+            if(seed >= ROLL_DIRECT_SLOT) {
+                fprintf(stderr, "Could not build the voter roll hash.\n");
+                exit(1);
+            }
+            positions.clear();
+            bool placed = true;
+            for(size_t k = 0; k < bucket.size() && placed; ++k) {
+                long position = hash(keys.data() + bucket[k] * idBytes, idBytes, seed) % numberOfIDs;
+                placed = slotOf[position] < 0 && std::find(positions.begin(), positions.end(), position) == positions.end();
+                positions.push_back(position);
+            }
+            if(placed) {
+                for(size_t k = 0; k < bucket.size(); ++k) {
+                    slotOf[positions[k]] = bucket[k];
+                }
+                displacements[order[o]] = seed;
+                break;
+            }
+        }
+    }
+
+    RollHeader header;
+    memset(&header, 0, sizeof(RollHeader));
+    memcpy(header.magic, ROLL_MAGIC, 8);
+    header.version = ROLL_VERSION;
+    header.idBytes = idBytes;
+    header.numberOfIDs = numberOfIDs;
+    header.numberOfBuckets = numberOfBuckets;
+
+    // IDs that registered with the old roll stay used in the new one
+    UsedHeader usedHeader;
+    vector<ZZ> carriedIDs;
+    bool carryUsedIDs = usedIDs(binaryPath, usedPath, usedHeader, carriedIDs);
+
+    string temporaryPath = string(binaryPath) + ".tmp";
+    FILE* out = fopen(temporaryPath.c_str(), "wb");
+    if(out == NULL) {
+        perror("Error at creating the binary voter roll.\n");
+        exit(1);
+    }
+    bool written = fwrite(&header, sizeof(RollHeader), 1, out) == 1
+        && fwrite(displacements.data(), sizeof(unsigned int), numberOfBuckets, out) == (size_t) numberOfBuckets;
+    unsigned long rollFingerprint = fingerprint((const unsigned char*) &header, sizeof(RollHeader));
+    rollFingerprint = fingerprint((const unsigned char*) displacements.data(), numberOfBuckets * sizeof(unsigned int), rollFingerprint);
+    for(long s = 0; s < numberOfIDs && written; ++s) {
+        written = fwrite(keys.data() + slotOf[s] * idBytes, idBytes, 1, out) == 1;
+        rollFingerprint = fingerprint(keys.data() + slotOf[s] * idBytes, idBytes, rollFingerprint);
+    }
+    written = fflush(out) == 0 && fsync(fileno(out)) == 0 && written;
+    if(fclose(out) != 0 || !written) {
+        perror("Error at writing the binary voter roll.\n");
+        exit(1);
+    }
+    string nextUsedPath = string(usedPath) + ".next";
+    if(carryUsedIDs) {
+        // the new bits are synced aside first; load() moves them in should we
+        // crash between the two renames
+        vector<unsigned long> words((numberOfIDs + 63) / 64, 0);
+        unsigned char key[idBytes];
+        for(size_t i = 0; i < carriedIDs.size(); ++i) {
+            if(!encode(carriedIDs[i], idBytes, key)) {
+                continue;
+            }
+            long position = locate(key, idBytes, displacements.data(), numberOfBuckets, numberOfIDs);
+            if(position >= 0 && memcmp(keys.data() + slotOf[position] * idBytes, key, idBytes) == 0) {
+                words[position / 64] |= 1UL << (position % 64);
+            }
+        }
+        usedHeader.numberOfIDs = numberOfIDs;
+        usedHeader.rollFingerprint = rollFingerprint;
+        writeUsed(nextUsedPath.c_str(), usedHeader, words);
+    }
+    if(rename(temporaryPath.c_str(), binaryPath) < 0
+        || (carryUsedIDs && rename(nextUsedPath.c_str(), usedPath) < 0)) {
+        perror("Error at writing the binary voter roll.\n");
+        exit(1);
+    }
+}
+
+long VoterRoll::locate(const unsigned char* key, int idBytes, const unsigned int* displacements, long numberOfBuckets, long numberOfIDs) {
+    if(numberOfIDs == 0) {
+        return -1;
+    }
+    unsigned int displacement = displacements[hash(key, idBytes, 0) % numberOfBuckets];
+    if(displacement & ROLL_DIRECT_SLOT) {
+        return displacement & ~ROLL_DIRECT_SLOT;
+    }
+    return hash(key, idBytes, displacement) % numberOfIDs;
+}
+
+bool VoterRoll::parse(const unsigned char* roll, size_t bytes, RollHeader& header) {
+    if(bytes < sizeof(RollHeader)) {
+        return false;
+    }
+    memcpy(&header, roll, sizeof(RollHeader));
+    size_t expectedBytes = sizeof(RollHeader) + header.numberOfBuckets * sizeof(unsigned int)
+        + header.numberOfIDs * header.idBytes;
+    return memcmp(header.magic, ROLL_MAGIC, 8) == 0 && header.version == ROLL_VERSION
+        && header.numberOfBuckets >= 1 && bytes == expectedBytes;
+}
+
+bool VoterRoll::readUsedHeader(const char* usedPath, UsedHeader& header) {
+    int descriptor = open(usedPath, O_RDONLY);
+    if(descriptor < 0) {
+        return false;
+    }
+    struct stat information;
+    bool valid = fstat(descriptor, &information) == 0
+        && read(descriptor, &header, sizeof(UsedHeader)) == (ssize_t) sizeof(UsedHeader)
+        && memcmp(header.magic, USED_MAGIC, 8) == 0 && header.version == USED_VERSION && header.numberOfIDs >= 0
+        && (size_t) information.st_size == sizeof(UsedHeader) + (header.numberOfIDs + 63) / 64 * sizeof(unsigned long);
+    close(descriptor);
+    return valid;
+}
+
+// The IDs the used-ID file marks in the roll at binaryPath, if it was made
+// for that roll.
+bool VoterRoll::usedIDs(const char* binaryPath, const char* usedPath, UsedHeader& usedHeader, vector<ZZ>& IDs) {
+    if(!readUsedHeader(usedPath, usedHeader)) {
+        return false;
+    }
+    int descriptor = open(binaryPath, O_RDONLY);
+    if(descriptor < 0) {
+        return false;
+    }
+    struct stat information;
+    fstat(descriptor, &information);
+    vector<unsigned char> roll(information.st_size);
+    bool complete = read(descriptor, roll.data(), roll.size()) == (ssize_t) roll.size();
+    close(descriptor);
+    RollHeader header;
+    if(!complete || !parse(roll.data(), roll.size(), header) || header.numberOfIDs != usedHeader.numberOfIDs
+        || fingerprint(roll.data(), roll.size()) != usedHeader.rollFingerprint) {
+        return false;
+    }
+    vector<unsigned long> words((header.numberOfIDs + 63) / 64);
+    descriptor = open(usedPath, O_RDONLY);
+    complete = descriptor >= 0 && pread(descriptor, words.data(), words.size() * sizeof(unsigned long), sizeof(UsedHeader))
+        == (ssize_t) (words.size() * sizeof(unsigned long));
+    if(descriptor >= 0) {
+        close(descriptor);
+    }
+    if(!complete) {
+        return false;
+    }
+    const unsigned char* slots = roll.data() + sizeof(RollHeader) + header.numberOfBuckets * sizeof(unsigned int);
+    for(long position = 0; position < header.numberOfIDs; ++position) {
+        if(words[position / 64] & (1UL << (position % 64))) {
+            IDs.push_back(ZZFromBytes(slots + position * header.idBytes, header.idBytes));
+        }
+    }
+    return true;
+}
+
+void VoterRoll::writeUsed(const char* usedPath, UsedHeader& header, const vector<unsigned long>& words) {
+    string temporaryPath = string(usedPath) + ".tmp";
+    int descriptor = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool written = descriptor >= 0 && write(descriptor, &header, sizeof(UsedHeader)) == (ssize_t) sizeof(UsedHeader)
+        && write(descriptor, words.data(), words.size() * sizeof(unsigned long)) == (ssize_t) (words.size() * sizeof(unsigned long))
+        && fsync(descriptor) == 0;
+    if(descriptor >= 0 && close(descriptor) < 0) {
+        written = false;
+    }
+    if(!written || rename(temporaryPath.c_str(), usedPath) < 0) {
+        perror("Error at writing the used IDs.\n");
+        exit(1);
+    }
+}
+
+// Maps the used-ID file read-write. A new key starts it over, every ID may
+// register once under it; bits made for another roll stop the server.
+void VoterRoll::mapUsed(const char* usedPath, const ZZ& modulus) {
+    unsigned long rollFingerprint = fingerprint(mappedRoll, mappedRollBytes);
+    UsedHeader header;
+    string nextUsedPath = string(usedPath) + ".next";
+    if(readUsedHeader(nextUsedPath.c_str(), header) && header.rollFingerprint == rollFingerprint) {
+        // build() stopped between renaming the roll and the bits
+        rename(nextUsedPath.c_str(), usedPath);
+    }
+    bool valid = readUsedHeader(usedPath, header);
+    if(!valid && access(usedPath, F_OK) == 0) {
+        fprintf(stderr, "%s is damaged, refusing to start.\n", usedPath);
+        exit(1);
+    }
+    if(!valid || header.keyFingerprint != keyFingerprint(modulus)) {
+        memset(&header, 0, sizeof(UsedHeader));
+        memcpy(header.magic, USED_MAGIC, 8);
+        header.version = USED_VERSION;
+        header.numberOfIDs = rollHeader.numberOfIDs;
+        header.keyFingerprint = keyFingerprint(modulus);
+        header.rollFingerprint = rollFingerprint;
+        writeUsed(usedPath, header, vector<unsigned long>((rollHeader.numberOfIDs + 63) / 64, 0));
+    }
+    else if(header.rollFingerprint != rollFingerprint || header.numberOfIDs != rollHeader.numberOfIDs) {
+        fprintf(stderr, "%s was written for another voter roll, refusing to start.\n", usedPath);
+        exit(1);
+    }
+
+    int descriptor = open(usedPath, O_RDWR);
+    if(descriptor < 0) {
+        perror("Error at opening the used IDs.\n");
+        exit(1);
+    }
+    size_t usedBytes = sizeof(UsedHeader) + (rollHeader.numberOfIDs + 63) / 64 * sizeof(unsigned long);
+    void* mapped = mmap(NULL, usedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if(mapped == MAP_FAILED) {
+        perror("Error at mapping the used IDs.\n");
+        exit(1);
+    }
+    usedRollPositions = (unsigned long*) ((unsigned char*) mapped + sizeof(UsedHeader));
+}
+
+void VoterRoll::load(const char* textPath, const char* binaryPath, const char* usedPath, const ZZ& modulus) {
+    if(isStale(textPath, binaryPath)) {
+        build(textPath, binaryPath, usedPath);
+    }
+    int descriptor = open(binaryPath, O_RDONLY);
+    if(descriptor < 0) {
+        perror("Error at opening the binary voter roll.\n");
+        exit(1);
+    }
+    struct stat information;
+    fstat(descriptor, &information);
+    mappedRollBytes = information.st_size;
+    if(mappedRollBytes < sizeof(RollHeader)) {
+        fprintf(stderr, "The binary voter roll is truncated.\n");
+        exit(1);
+    }
+    mappedRoll = (const unsigned char*) mmap(NULL, mappedRollBytes, PROT_READ, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if(mappedRoll == MAP_FAILED) {
+        perror("Error at mapping the binary voter roll.\n");
+        exit(1);
+    }
+    if(!parse(mappedRoll, mappedRollBytes, rollHeader)) {
+        fprintf(stderr, "Unknown binary voter roll format, refusing to start.\n");
+        exit(1);
+    }
+    rollDisplacements = (const unsigned int*) (mappedRoll + sizeof(RollHeader));
+    rollSlots = mappedRoll + sizeof(RollHeader) + rollHeader.numberOfBuckets * sizeof(unsigned int);
+    mapUsed(usedPath, modulus);
+}
+
+long VoterRoll::find(const ZZ& ID) {
+    unsigned char key[rollHeader.idBytes];
+    if(!encode(ID, rollHeader.idBytes, key)) {
+        return -1;
+    }
+    long position = locate(key, rollHeader.idBytes, rollDisplacements, rollHeader.numberOfBuckets, rollHeader.numberOfIDs);
+    // a perfect hash sends an unknown ID somewhere too, so compare
+    if(position < 0 || memcmp(rollSlots + position * rollHeader.idBytes, key, rollHeader.idBytes) != 0) {
+        return -1;
+    }
+    return position;
+}
+
+bool VoterRoll::claim(long position) {
+    unsigned long bit = 1UL << (position % 64);
+    unsigned long* word = usedRollPositions + position / 64;
+    if((__atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST) & bit) != 0) {
+        return false;
+    }
+    // the claim reaches the disk before the ID is accepted
+    unsigned char* page = (unsigned char*) ((unsigned long) word & ~(unsigned long) (usedPageBytes - 1));
+    if(msync(page, usedPageBytes, MS_SYNC) < 0) {
+        perror("Error at writing the used IDs.\n");
+        exit(1);
+    }
+    return true;
+}
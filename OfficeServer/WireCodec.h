@@ -0,0 +1,311 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <vector>
+#include <chrono>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#define CODEC_BUFFER_SIZE 16384
+#define MAX_NUMBER_LENGTH 65536
+
+#define FRAME_INCOMPLETE 0
+#define FRAME_COMPLETE 1
+#define FRAME_MALFORMED -1
+
+using namespace std;
+using namespace NTL;
+
+// Buffered reader/writer for the protocol's wire format: a number travels as
+// its byte length (a long) followed by its little-endian bytes, a plain int
+// travels as its sizeof(int) bytes. The format is the same the old
+// byte-at-a-time helpers produced, so either side may still use them.
+//
+// Outgoing frames are appended to one reusable buffer and only written when
+// the codec is about to wait for the peer (or on an explicit flush()), so a
+// whole protocol step costs one write. Incoming bytes are read in chunks and
+// served from a buffer, so short reads are handled in one place.
+//
+// A bit vector (challenges of protocol v2) travels as ceil(count / 8) bytes,
+// bit i of the vector being bit i % 8 of byte i / 8; both sides know count.
+//
+// Errors don't exit: the codec prints the error, marks itself broken and
+// returns zeros from then on. Callers check isBroken() between protocol steps.
+// A peer that misses a deadline (setDeadline) breaks the codec the same way,
+// and isTimedOut() tells it apart.
+class WireCodec {
+private:
+    int descriptor;
+    vector<unsigned char> output;
+    vector<unsigned char> input;
+    size_t inputStart, inputEnd; // unread bytes are input[inputStart, inputEnd)
+    bool broken;
+    bool timedOut;
+    long deadline; // steady clock milliseconds, 0 when the peer may take forever
+    long syscalls;
+    long bytesWritten, bytesRead;
+
+    void fail(const char* message);
+    static long steadyMilliseconds();
+    bool await(short events);
+    bool fill(size_t needed);
+
+public:
+    WireCodec(int descriptor);
+    ~WireCodec();
+
+    static void appendInt(vector<unsigned char>& buffer, int value);
+    static void appendLong(vector<unsigned char>& buffer, long value);
+    static void appendNumber(vector<unsigned char>& buffer, const ZZ& number);
+    static int parseNumber(const unsigned char* bytes, size_t available, ZZ& number, size_t& consumed);
+    template<class T> static void appendBits(vector<unsigned char>& buffer, const T* bits, int count);
+
+    void sendInt(int value);
+    void sendLong(long value);
+    void sendNumber(const ZZ& number);
+    template<class T> void sendBits(const T* bits, int count);
+    int receiveInt();
+    long receiveLong();
+    ZZ receiveNumber();
+    ZZ receiveNumberBody(long numberLength); // a number whose length was already read
+    template<class T> bool receiveBits(T* bits, int count);
+    bool flush();
+    void setDeadline(long milliseconds); // from now on, 0 for none
+
+    bool isBroken() { return broken; }
+    bool isTimedOut() { return timedOut; }
+    long getSyscalls() { return syscalls; }
+    long getBytesWritten() { return bytesWritten; }
+    long getBytesRead() { return bytesRead; }
+};
+
+WireCodec::WireCodec(int descriptor) : descriptor(descriptor), input(CODEC_BUFFER_SIZE),
+    inputStart(0), inputEnd(0), broken(false), timedOut(false), deadline(0), syscalls(0), bytesWritten(0), bytesRead(0) {
+    output.reserve(CODEC_BUFFER_SIZE);
+}
+
+WireCodec::~WireCodec() {
+    flush();
+}
+
+void WireCodec::fail(const char* message) {
+    if(!broken) {
+        perror(message);
+        broken = true;
+    }
+}
+
+long WireCodec::steadyMilliseconds() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void WireCodec::setDeadline(long milliseconds) {
+    deadline = milliseconds > 0 ? steadyMilliseconds() + milliseconds : 0;
+}
+
+// Waits until the descriptor is ready for events or the deadline passes.
+bool WireCodec::await(short events) {
+    while(deadline != 0 && !broken) {
+        long remaining = deadline - steadyMilliseconds();
+        struct pollfd ready;
+        ready.fd = descriptor;
+        ready.events = events;
+        int status = remaining > 0 ? poll(&ready, 1, remaining) : 0;
+        if(status > 0) {
+            return true;
+        }
+        if(status == 0) {
+            errno = ETIMEDOUT;
+            fail("Error at waiting for peer, deadline passed.\n");
+            timedOut = true;
+        }
+        else if(errno != EINTR) {
+            fail("Error at waiting for peer.\n");
+        }
+    }
+    return !broken;
+}
+
+void WireCodec::appendInt(vector<unsigned char>& buffer, int value) {
+    unsigned char* bytes = (unsigned char*) &value;
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(int));
+}
+
+void WireCodec::appendLong(vector<unsigned char>& buffer, long value) {
+    unsigned char* bytes = (unsigned char*) &value;
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(long));
+}
+
+void WireCodec::appendNumber(vector<unsigned char>& buffer, const ZZ& number) {
+    long numberLength = NumBytes(number);
+    unsigned char* lengthBytes = (unsigned char*) &numberLength;
+    buffer.insert(buffer.end(), lengthBytes, lengthBytes + sizeof(long));
+    size_t start = buffer.size();
+    buffer.resize(start + numberLength);
+    BytesFromZZ(buffer.data() + start, number, numberLength);
+}
+
+template<class T> void WireCodec::appendBits(vector<unsigned char>& buffer, const T* bits, int count) {
+    size_t start = buffer.size();
+    buffer.resize(start + (count + 7) / 8, 0);
+    for(int i = 0; i < count; ++i) {
+        if(bits[i]) {
+            buffer[start + i / 8] |= 1 << (i % 8);
+        }
+    }
+}
+
+int WireCodec::parseNumber(const unsigned char* bytes, size_t available, ZZ& number, size_t& consumed) {
+    long numberLength;
+    if(available < sizeof(long)) {
+        return FRAME_INCOMPLETE;
+    }
+    memcpy(&numberLength, bytes, sizeof(long));
+    if(numberLength < 0 || numberLength > MAX_NUMBER_LENGTH) {
+        return FRAME_MALFORMED;
+    }
+    if(available < sizeof(long) + numberLength) {
+        return FRAME_INCOMPLETE;
+    }
+    ZZFromBytes(number, bytes + sizeof(long), numberLength);
+    consumed = sizeof(long) + numberLength;
+    return FRAME_COMPLETE;
+}
+
+void WireCodec::sendInt(int value) {
+    if(!broken) {
+        appendInt(output, value);
+    }
+}
+
+void WireCodec::sendLong(long value) {
+    if(!broken) {
+        appendLong(output, value);
+    }
+}
+
+void WireCodec::sendNumber(const ZZ& number) {
+    if(!broken) {
+        appendNumber(output, number);
+    }
+}
+
+template<class T> void WireCodec::sendBits(const T* bits, int count) {
+    if(!broken) {
+        appendBits(output, bits, count);
+    }
+}
+
+bool WireCodec::flush() {
+    size_t offset = 0;
+    while(!broken && offset < output.size() && await(POLLOUT)) {
+        ssize_t written = write(descriptor, output.data() + offset, output.size() - offset);
+        ++syscalls;
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fail("Error at writing to peer.\n");
+            break;
+        }
+        offset += written;
+        bytesWritten += written;
+    }
+    output.clear();
+    return !broken;
+}
+
+bool WireCodec::fill(size_t needed) {
+    // whatever we queued must reach the peer before we wait for its answer
+    if(!output.empty() && !flush()) {
+        return false;
+    }
+    if(inputEnd - inputStart >= needed) {
+        return true;
+    }
+    if(inputStart == inputEnd) {
+        inputStart = inputEnd = 0;
+    }
+    if(inputStart + needed > input.size()) {
+        memmove(input.data(), input.data() + inputStart, inputEnd - inputStart);
+        inputEnd -= inputStart;
+        inputStart = 0;
+        if(needed > input.size()) {
+            input.resize(needed);
+        }
+    }
+    while(!broken && inputEnd - inputStart < needed && await(POLLIN)) {
+        ssize_t received = read(descriptor, input.data() + inputEnd, input.size() - inputEnd);
+        ++syscalls;
+        if(received < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fail("Error at reading from peer.\n");
+        }
+        else if(received == 0) {
+            errno = ECONNRESET;
+            fail("Error at reading from peer, connection closed.\n");
+        }
+        else {
+            inputEnd += received;
+            bytesRead += received;
+        }
+    }
+    return !broken;
+}
+
+int WireCodec::receiveInt() {
+    int value = 0;
+    if(fill(sizeof(int))) {
+        memcpy(&value, input.data() + inputStart, sizeof(int));
+        inputStart += sizeof(int);
+    }
+    return value;
+}
+
+long WireCodec::receiveLong() {
+    long value = 0;
+    if(fill(sizeof(long))) {
+        memcpy(&value, input.data() + inputStart, sizeof(long));
+        inputStart += sizeof(long);
+    }
+    return value;
+}
+
+ZZ WireCodec::receiveNumber() {
+    long numberLength = receiveLong();
+    if(broken) {
+        return ZZ();
+    }
+    return receiveNumberBody(numberLength);
+}
+
+ZZ WireCodec::receiveNumberBody(long numberLength) {
+    ZZ number;
+    if(numberLength < 0 || numberLength > MAX_NUMBER_LENGTH) {
+        errno = EPROTO;
+        fail("Error at reading number from peer, malformed length.\n");
+        return number;
+    }
+    if(!fill(numberLength)) {
+        return number;
+    }
+    ZZFromBytes(number, input.data() + inputStart, numberLength);
+    inputStart += numberLength;
+    return number;
+}
+
+template<class T> bool WireCodec::receiveBits(T* bits, int count) {
+    size_t length = (count + 7) / 8;
+    if(!fill(length)) {
+        return false;
+    }
+    for(int i = 0; i < count; ++i) {
+        bits[i] = (input[inputStart + i / 8] >> (i % 8)) & 1;
+    }
+    inputStart += length;
+    return true;
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <queue>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include "Server.h"
+
+#define DEFAULT_QUEUE_LIMIT 256
+#define MIN_RETRY_AFTER 50 // milliseconds
+
+using namespace std;
+
+// Accepted sockets waiting for a worker. The accept loop only pushes here,
+// the workers pop a client, run a whole registration session and close it.
+// The queue is bounded: past queueLimit a client is told to retry later
+// instead of waiting behind sessions it can't overtake, so the accept loop
+// keeps draining the kernel's backlog and nobody sees a reset.
+queue<int> pendingClients;
+mutex pendingClientsMutex;
+condition_variable pendingClientsAvailable;
+vector<thread> workers;
+size_t queueLimit = DEFAULT_QUEUE_LIMIT;
+atomic<long> sessionMicroseconds(0); // moving average of a session on a worker
+
+class WorkerPool {
+private:
+    static void work();
+
+public:
+    static int defaultNumberOfWorkers();
+    static void start(int numberOfWorkers);
+    static bool submit(int client);
+    static void admit(int client);
+    static int retryAfter(size_t queueDepth);
+    static string exposition();
+};
+
+int WorkerPool::defaultNumberOfWorkers() {
+    int numberOfCores = (int) thread::hardware_concurrency();
+    return numberOfCores > 0 ? numberOfCores : 1;
+}
+
+void WorkerPool::work() {
+    while(true) {
+        int client;
+        {
+            unique_lock<mutex> lock(pendingClientsMutex);
+            pendingClientsAvailable.wait(lock, [] { return !pendingClients.empty(); });
+            client = pendingClients.front();
+            pendingClients.pop();
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        Server::execute(client);
+        close(client);
+        long elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        long average = sessionMicroseconds.load(memory_order_relaxed);
+        sessionMicroseconds.store(average + (elapsed - average) / 16, memory_order_relaxed);
+    }
+}
+
+void WorkerPool::start(int numberOfWorkers) {
+    for(int i = 0; i < numberOfWorkers; ++i) {
+        workers.push_back(thread(work));
+    }
+    Metrics::addSource(exposition);
+}
+
+// Queues the client, unless queueLimit clients are waiting already.
+bool WorkerPool::submit(int client) {
+    {
+        lock_guard<mutex> lock(pendingClientsMutex);
+        if(pendingClients.size() >= queueLimit) {
+            return false;
+        }
+        pendingClients.push(client);
+    }
+    pendingClientsAvailable.notify_one();
+    return true;
+}
+
+void WorkerPool::admit(int client) {
+    if(submit(client)) {
+        return;
+    }
+    size_t queueDepth;
+    {
+        lock_guard<mutex> lock(pendingClientsMutex);
+        queueDepth = pendingClients.size();
+    }
+    Server::refuse(client, retryAfter(queueDepth));
+    close(client);
+}
+
+// About when the queue ahead of a refused client will have drained.
+int WorkerPool::retryAfter(size_t queueDepth) {
+    long milliseconds = sessionMicroseconds.load(memory_order_relaxed) * queueDepth / max((size_t) 1, workers.size()) / 1000;
+    return max((long) MIN_RETRY_AFTER, milliseconds);
+}
+
+string WorkerPool::exposition() {
+    size_t queueDepth;
+    {
+        lock_guard<mutex> lock(pendingClientsMutex);
+        queueDepth = pendingClients.size();
+    }
+    char lines[256];
+    snprintf(lines, sizeof(lines), "evote_admission_queue_depth %zu\nevote_admission_queue_limit %zu\nevote_workers %zu\n",
+        queueDepth, queueLimit, workers.size());
+    return lines;
+}